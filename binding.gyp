@@ -8,9 +8,16 @@
         "src/noden_info.cc",
         "src/noden_context.cc",
         "src/noden_program.cc",
+        "src/noden_cache.cc",
         "src/noden_buffer.cc",
         "src/noden_run.cc",
-        "src/cl_memory.cc"
+        "src/noden_prepared.cc",
+        "src/noden_autotune.cc",
+        "src/cl_memory.cc",
+        "src/cl_events.cc",
+        "src/noden_submit.cc",
+        "src/cl_arena.cc",
+        "src/noden_copy.cc"
       ],
       "include_dirs": [ "include" ],
       "msvs_settings": {
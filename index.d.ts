@@ -17,8 +17,10 @@ import { OpenCLPlatform } from "./types/Platform"
 export * from "./types/Platform"
 
 export type BufDir = 'readonly' | 'writeonly' | 'readwrite'
-export type BufSVMType = 'none' | 'coarse' | 'fine'
-export type ImageDims = { width: number, height: number, depth?: number }
+export type BufSVMType = 'none' | 'coarse' | 'fine' | 'device'
+export type ImageChannelOrder = 'R' | 'RG' | 'RGBA' | 'BGRA'
+export type ImageChannelType = 'FLOAT' | 'HALF_FLOAT' | 'UNORM_INT8' | 'UNORM_INT16'
+export type ImageDims = { width: number, height: number, depth?: number, channelOrder?: ImageChannelOrder, channelType?: ImageChannelType }
 
 /** Internal structure for managing allocated buffers */
 export interface ContextBuffer {
@@ -48,6 +50,8 @@ interface OpenCLBufferInternals {
 	readonly numBytes: number
   /** The time taken to perform the allocation of OpenCL memory for this OpenCLBuffer */
 	readonly creationTime: number
+	/** True if the buffer was created with `wrapBuffer` and the device uses the Node buffer memory without copying */
+	readonly zeroCopy: boolean
 	/** Field to carry a load time timestamp */
 	loadstamp: number
 	/** Field to carry a frame timestamp */
@@ -69,14 +73,20 @@ interface OpenCLBufferFunctions {
 	 * @param bufDir the host data direction for which the access is required, will default to `readwrite`.
 	 * @returns a promise that resolves when host access is available.
 	 */
-	hostAccess(bufDir?: BufDir): Promise<undefined>
+	hostAccess(bufDir?: BufDir): Promise<HostAccessResult | undefined>
 	/** Allow normal [host access](https://github.com/Streampunk/nodencl#host-access-to-data-buffers) to the buffer for read and write operations in Javascript.
 	 * @param bufDir the host data direction for which the access is required.
 	 * @param sourceBuf Allows a source buffer to be passed to the asynchronous thread and be
 	 * copied into the buffer object. Requires that the bufDir is not `readonly`.
 	 * @returns a promise that resolves when any source copy is complete and host access is available.
 	 */
-	hostAccess(bufDir: BufDir | 'none', sourceBuf: Buffer): Promise<undefined>
+	hostAccess(bufDir: BufDir | 'none', sourceBuf: Buffer): Promise<HostAccessResult | undefined>
+	/** Allow normal [host access](https://github.com/Streampunk/nodencl#host-access-to-data-buffers) to part of the buffer.
+	 * @param bufDir the host data direction for which the access is required.
+	 * @param options the range of the buffer to make available to the host
+	 * @returns a promise that resolves when host access to the range is available.
+	 */
+	hostAccess(bufDir: BufDir | 'none', options: HostAccessOptions): Promise<HostAccessResult | undefined>
 	/**
 	 * Allow normal [host access](https://github.com/Streampunk/nodencl#host-access-to-data-buffers) to the buffer for read and write operations in Javascript,
 	 * with [overlapping](https://github.com/Streampunk/nodencl#overlapping) support.
@@ -84,9 +94,34 @@ interface OpenCLBufferFunctions {
 	 * @param queueNum the CommandQueue to use for this operation when overlapping is enabled.
 	 * Typically will be `context.queue.load` or `context.queue.unload`.
 	 * @param sourceBuf an optional Buffer object to be used as source data when the bufDir is not readonly
+	 * @param options optional range of the buffer and events that the host access must wait for
 	 * @returns a promise that resolves when any source copy is complete and host access is available.
 	 */
-	hostAccess(bufDir: BufDir | 'none', queueNum: number, sourceBuf?: Buffer): Promise<undefined>
+	hostAccess(bufDir: BufDir | 'none', queueNum: number, sourceBuf?: Buffer, options?: HostAccessOptions): Promise<HostAccessResult | undefined>
+	hostAccess(bufDir: BufDir | 'none', queueNum: number, options: HostAccessOptions): Promise<HostAccessResult | undefined>
+	/**
+	 * Allow host access as for hostAccess, given [synchronously](https://github.com/Streampunk/nodencl#synchronous-fast-path)
+	 * when the queue is idle, there are no events to wait for and the range is no larger than `syncBytes`
+	 * @returns the result of the host access, or a promise for it when the access could not be given synchronously
+	 */
+	hostAccessSync(bufDir?: BufDir | 'none', queueNum?: number, sourceBuf?: Buffer, options?: HostAccessSyncOptions):
+		HostAccessResult | undefined | Promise<HostAccessResult | undefined>
+	hostAccessSync(bufDir: BufDir | 'none', queueNum: number, options: HostAccessSyncOptions):
+		HostAccessResult | undefined | Promise<HostAccessResult | undefined>
+	/**
+	 * [Copy](https://github.com/Streampunk/nodencl#transfers) data from a Node buffer into this buffer using the device's copy engines
+	 * @param source the data to copy, which must not be changed until the promise resolves
+	 * @param options byte offset in this buffer, command queue to use and events to wait for
+	 * @returns a promise that resolves when the copy is complete
+	 */
+	writeFrom(source: Buffer, options?: TransferOptions): Promise<TransferResult>
+	/**
+	 * [Copy](https://github.com/Streampunk/nodencl#transfers) data from this buffer into a Node buffer using the device's copy engines
+	 * @param dest the Node buffer to fill, which must not be used until the promise resolves
+	 * @param options byte offset in this buffer, command queue to use and events to wait for
+	 * @returns a promise that resolves when the copy is complete
+	 */
+	readInto(dest: Buffer, options?: TransferOptions): Promise<TransferResult>
 	/** Free any allocated OpenCL memory associated with this OpenCLBuffer object */
 	freeAllocation(): undefined
 
@@ -125,6 +160,103 @@ export interface RunTimings {
 	readonly dataFromKernel: number
   /** Total time taken during transfers and processing */
 	readonly totalTime: number
+	/** Device timestamps for each command enqueued by the run - only present when profiling is enabled */
+	readonly profile?: ReadonlyArray<ProfileEntry>
+	/** Event that completes when the run has completed on the device - only present when overlapping or event completion is enabled */
+	readonly event?: OpenCLEvent
+}
+
+/** Timings object returned by the Program runBatch function */
+export interface BatchTimings {
+	/** Total time taken to enqueue and complete all the runs */
+	readonly totalTime: number
+	/** Timings for each run in the batch. The kernelExec time only measures enqueueing the kernel */
+	readonly runs: ReadonlyArray<RunTimings>
+	/** Event that completes when the batch has completed on the device - only present when overlapping or event completion is enabled */
+	readonly event?: OpenCLEvent
+}
+
+/** Handle to an OpenCL event, used to order work between command queues */
+export interface OpenCLEvent {
+	readonly clEvent: unknown
+}
+
+/** Options for work that must wait for other work to complete, possibly on other queues */
+export interface EventOptions {
+	/** Events that must complete before the work starts on the device */
+	waitFor?: OpenCLEvent | ReadonlyArray<OpenCLEvent>
+}
+
+/** Options for a run, which may change the range of work items of the program for this run only */
+export interface RunOptions extends EventOptions {
+	/** Global work items, with the same number of dimensions as the program */
+	globalWorkItems?: number | Uint32Array
+	/** Work items per group, a zero lets the implementation choose */
+	workItemsPerGroup?: number | Uint32Array
+	/** Offset added to the global ids of the work items, defaults to zero */
+	globalWorkOffset?: number | Uint32Array
+}
+
+/** Options for host access, which may be limited to part of the buffer */
+export interface HostAccessOptions extends EventOptions {
+	/** Byte offset of the start of the range, defaults to 0 */
+	offset?: number
+	/** Number of bytes in the range, defaults to the rest of the buffer */
+	length?: number
+	/** Pixel position [x, y] of the top left of a rectangle of the image dimensions */
+	origin?: [number, number]
+	/** Size [width, height] in pixels of a rectangle of the image dimensions */
+	region?: [number, number]
+}
+
+/** Options for synchronous host access */
+export interface HostAccessSyncOptions extends HostAccessOptions {
+	/** Largest range, in bytes, that is accessed synchronously, defaults to 1MiB */
+	syncBytes?: number
+}
+
+/** Options for a synchronous run */
+export interface RunSyncOptions extends RunOptions {
+	/** Largest number of global work items that are run synchronously, defaults to 65536 */
+	syncWorkItems?: number
+}
+
+/** Options for writeFrom and readInto transfers */
+export interface TransferOptions extends EventOptions {
+	/** Byte offset in the OpenCL buffer, defaults to 0 */
+	offset?: number
+	/** The CommandQueue to use for the transfer, defaults to 0 */
+	queueNum?: number
+}
+
+/** Result of a writeFrom or readInto transfer */
+export interface TransferResult {
+	/** Completed event of the transfer */
+	readonly event: OpenCLEvent
+	/** Device timestamps of the commands of the transfer, present when profiling is enabled */
+	readonly profile?: ReadonlyArray<ProfileEntry>
+}
+
+/** Device timestamps in nanoseconds for one OpenCL command, available when profiling is enabled */
+export interface ProfileEntry {
+	/** Type of command - `kernel`, `map`, `unmap`, `svmMap`, `svmUnmap`, `bufferToImage`, `imageToBuffer`, `stagingToDevice`, `deviceToStaging`, `read` or `write` */
+	readonly name: string
+	/** Time the command was enqueued by the host */
+	readonly queued: bigint
+	/** Time the command was submitted to the device */
+	readonly submit: bigint
+	/** Time the command started executing on the device */
+	readonly start: bigint
+	/** Time the command finished executing on the device */
+	readonly end: bigint
+}
+
+/** Result of a hostAccess call when profiling or overlapping is enabled */
+export interface HostAccessResult {
+	/** Device timestamps for each command enqueued - only present when profiling is enabled */
+	readonly profile?: ReadonlyArray<ProfileEntry>
+	/** Event that completes when the host access commands have completed on the device - only present when overlapping is enabled */
+	readonly event?: OpenCLEvent
 }
 
 export interface OpenCLProgram {
@@ -134,18 +266,106 @@ export interface OpenCLProgram {
 	readonly numQueues: number
   /** The time taken to build the kernelSource for the selected program */
 	readonly buildTime: number
+	/** True if the program was created from a binary in the context's program cache */
+	readonly fromCache: boolean
+	/** Names of all the kernel functions in the program's build */
+	readonly kernelNames: ReadonlyArray<string>
   /**
 	 * [Run](https://github.com/Streampunk/nodencl#execute-the-kernel) the program with the provided parameters
 	 * Prefer clContext.runProgram if using the buffer cache
 	 * @param params an object with keys that match the selected kernel parameter names and
 	 * data types that match the selected kernel parameters
 	 * @param queueNum the CommandQueue to be used to run the program. Typically will be `context.queue.process`
+	 * @param options optional events that the run must wait for and range of work items for the run
 	 * @returns Promise that resolves to a RunTimings object on success
 	 */
-	run(params: KernelParams, queueNum?: number): Promise<RunTimings>
+	run(params: KernelParams, queueNum?: number, options?: RunOptions): Promise<RunTimings>
+	/**
+	 * Run the program as for run, enqueueing and waiting for it on the calling thread when the queue is
+	 * idle, there are no events to wait for and the run is no larger than `syncWorkItems` -
+	 * see [synchronous fast path](https://github.com/Streampunk/nodencl#synchronous-fast-path)
+	 * @returns a RunTimings object, or a promise for it when the run could not be made synchronously
+	 */
+	runSync(params: KernelParams, queueNum?: number, options?: RunSyncOptions): RunTimings | Promise<RunTimings>
+	/**
+	 * Run the program many times with different parameters, enqueueing all the runs in one call and
+	 * waiting once for them all to complete
+	 * @param params an array of objects with keys that match the selected kernel parameter names and
+	 * data types that match the selected kernel parameters
+	 * @param queueNum the CommandQueue to be used to run the program. Typically will be `context.queue.process`
+	 * @param options optional events that the first run must wait for and range of work items for every run
+	 * @returns Promise that resolves to a BatchTimings object on success
+	 */
+	runBatch(params: ReadonlyArray<KernelParams>, queueNum?: number, options?: RunOptions): Promise<BatchTimings>
+	/**
+	 * [Prepare](https://github.com/Streampunk/nodencl#prepared-runs) the program to be run repeatedly with
+	 * the provided parameters, resolving parameter types and buffers once
+	 * @param params an object with keys that match the selected kernel parameter names and
+	 * data types that match the selected kernel parameters
+	 * @returns a PreparedRun object that can be run many times
+	 */
+	prepare(params: KernelParams): PreparedRun
+	/**
+	 * [Autotune](https://github.com/Streampunk/nodencl#autotuning-work-group-sizes) the work group size by timing
+	 * runs with each candidate size, keeping the fastest for later runs of the program
+	 * @param params an object with keys that match the selected kernel parameter names, with representative buffers
+	 * @param queueNum the CommandQueue to be used for the timed runs
+	 * @param options the number of timed runs per candidate and whether to ignore a stored result
+	 * @returns Promise that resolves to the chosen size and the timings of each candidate
+	 */
+	autotune(params: KernelParams, queueNum?: number, options?: { iterations?: number, force?: boolean }): Promise<AutotuneResult>
+	/**
+	 * Create another kernel from the same build as this program without compiling the source again
+	 * @param name the name of a kernel function listed in kernelNames
+	 * @param options the number and size of the kernel's work items
+	 * @returns Promise that resolves to a program object for the named kernel
+	 */
+	createKernel(name: string, options: { globalWorkItems: number | Uint32Array, workItemsPerGroup?: number | Uint32Array }): Promise<OpenCLProgram>
+}
+
+/** Result of autotuning the work group size of a program */
+export interface AutotuneResult {
+	/** The chosen work items per group, all zero when the implementation's own choice was fastest */
+	readonly workItemsPerGroup: Uint32Array
+	/** True if the choice was read from the context's cacheDir rather than timed */
+	readonly fromCache: boolean
+	/** Best time in microseconds of each candidate, null if the device rejected it - empty when fromCache */
+	readonly timings: ReadonlyArray<{ workItemsPerGroup: Uint32Array, time: number | null }>
+	/** Time taken in microseconds */
+	readonly totalTime: number
+}
+
+/** A program with its kernel parameters resolved ready for repeated runs */
+export interface PreparedRun {
+	/** The number of CommandQueues configured - will be > 1 if overlapping is enabled */
+	readonly numQueues: number
+	/**
+	 * Run the prepared program. Only a single run of a PreparedRun may be in progress at any time.
+	 * @param params optional object containing the subset of kernel parameters that have changed since the last run
+	 * @param queueNum the CommandQueue to be used to run the program. Typically will be `context.queue.process`
+	 * @param options optional events that the run must wait for
+	 * @returns Promise that resolves to a RunTimings object on success
+	 */
+	run(params?: Partial<KernelParams>, queueNum?: number, options?: RunOptions): Promise<RunTimings>
+	run(queueNum: number, options?: RunOptions): Promise<RunTimings>
 }
 
 /** Object to hold a context for a selected OpenCL platform and device */
+export interface PoolStats {
+	/** Number of buffer requests satisfied by an unreserved allocation */
+	readonly hits: number
+	/** Number of buffer requests that needed a new allocation */
+	readonly misses: number
+	/** Number of unreserved allocations freed to stay within the budget or after an allocation failure */
+	readonly evictions: number
+	/** Total bytes of owned buffer allocations */
+	readonly allocatedBytes: number
+	/** Number of unreserved allocations available for reuse */
+	readonly freeBuffers: number
+	/** Budget in bytes set at context creation, 0 for no limit */
+	readonly bufferBudget: number
+}
+
 export class clContext {
 	/**
 	 * Create a new clContext object with the default OpenCL platform and device
@@ -165,12 +385,24 @@ export class clContext {
 			deviceIndex: number
 			/** Enable [overlapping](https://github.com/Streampunk/nodencl#overlapping) of data transfers and running kernels */
 			overlapping?: boolean
+			/** Folder in which to keep a persistent cache of compiled program binaries */
+			cacheDir?: string
+			/** Enable [profiling](https://github.com/Streampunk/nodencl#profiling) of commands on the device */
+			profiling?: boolean
+			/** Use a dedicated [submission thread](https://github.com/Streampunk/nodencl#submission-threads) per command queue */
+			submitThreads?: boolean
+			/** Resolve runs and waits from [OpenCL event callbacks](https://github.com/Streampunk/nodencl#event-completion) rather than blocking a thread */
+			eventCompletion?: boolean
+			/** Maximum number of bytes of owned buffer allocations before unreserved buffers are freed, 0 for no limit */
+			bufferBudget?: number
+			/** Size in bytes of the slabs that buffers of type 'none' are carved from, 0 to allocate every buffer separately */
+			arenaSize?: number
 		},
 		logger?: { log?: Function, warn?: Function, error?: Function }
 	)
 
 	// Internal parameters
-	readonly params: { platformIndex: number, deviceIndex: number, overlapping: boolean }
+	readonly params: { platformIndex: number, deviceIndex: number, overlapping: boolean, cacheDir?: string, profiling?: boolean, submitThreads?: boolean, eventCompletion?: boolean, bufferBudget?: number, arenaSize?: number }
 	readonly logger: { log: Function, warn: Function, error: Function }
 	readonly buffers: ReadonlyArray<ContextBuffer>
 	readonly bufIndex: number
@@ -204,6 +436,15 @@ export class clContext {
 			globalWorkItems: number | Uint32Array
       /** The number of work-items that make up a work-group that will execute the kernel function */
 			workItemsPerGroup?: number
+			/** Extra options passed to the OpenCL compiler, e.g. '-cl-fast-relaxed-math' */
+			buildOptions?: string
+			/** Macros defined when compiling the kernel - arrays become comma separated lists, booleans 1 or 0 */
+			defines?: { [name: string]: number | string | boolean | ReadonlyArray<number> }
+			/** Names of scalar kernel arguments whose values are compiled into a variant of the program for each value.
+			 * The kernel must test `#ifdef NODEN_SPECIALISED_<name>` and use the macro, otherwise specialisation has no effect */
+			specialise?: ReadonlyArray<string>
+			/** Largest number of specialised variants kept, the least recently used is dropped beyond this. Defaults to 16 */
+			maxVariants?: number
 		}
 	): Promise<OpenCLProgram>
 
@@ -226,6 +467,14 @@ export class clContext {
 		id?: string
 	): Promise<OpenCLBuffer>
 
+  /**
+	 * [Wrap](https://github.com/Streampunk/nodencl#wrapping-node-buffers) an existing Node buffer as OpenCL memory so that kernels can use it without a copy
+	 * @param nodeBuffer The Node buffer to use, that is kept alive as long as the returned buffer
+	 * @param bufDir The data direction for the buffer with respect to execution of kernel functions, will default to `readwrite`
+	 * @returns Promise that resolves to an OpenCLBuffer object sharing memory with the Node buffer
+	 */
+	wrapBuffer(nodeBuffer: Buffer, bufDir?: BufDir): Promise<OpenCLBuffer>
+
   /** Log any buffer allocations that have had the owner parameter set */
 	logBuffers(): null
 
@@ -235,6 +484,9 @@ export class clContext {
 	 */
 	releaseBuffers(owner: string): null
 
+	/** Statistics for the reuse of unreserved buffer allocations */
+	getPoolStats(): PoolStats
+
 	/**
 	 * [Run](https://github.com/Streampunk/nodencl#execute-the-kernel) the program with the provided parameters
 	 * Prefer this function rather than program.run if using the buffer cache
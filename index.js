@@ -14,6 +14,7 @@
 */
 
 const addon = require('bindings')('nodencl');
+const fs = require('fs');
 
 const SegfaultHandler = require('segfault-handler');
 SegfaultHandler.registerHandler('crash.log'); // With no argument, SegfaultHandler will generate a generic log file name
@@ -23,11 +24,18 @@ function getPlatformInfo() {
 }
 
 async function createContext(params) {
+  if (params.cacheDir)
+    await fs.promises.mkdir(params.cacheDir, { recursive: true });
   return (0 === Object.keys(params).length) ? await addon.createContext() :
     await addon.createContext({
       platformIndex: params.platformIndex, 
       deviceIndex: params.deviceIndex,
-      numQueues: params.overlapping ? 3 : 1
+      numQueues: params.overlapping ? 3 : 1,
+      cacheDir: params.cacheDir,
+      profiling: params.profiling,
+      submitThreads: params.submitThreads,
+      eventCompletion: params.eventCompletion,
+      arenaSize: params.arenaSize
     });
 }
 
@@ -49,11 +57,94 @@ function releaseReference(buffer) {
     buffer.reserved = false;
 }
 
+function poolKey(numBytes, bufDir, bufType, imageDims) {
+  return `${numBytes}:${bufDir}:${bufType}:${imageDims.width || 0}x${imageDims.height || 0}x${imageDims.depth || 0}:` +
+    `${imageDims.channelOrder || 'RGBA'}:${imageDims.channelType || 'FLOAT'}`;
+}
+
+// Route runs of a program to variants built with the values of its specialised arguments as macros
+function specialiseProgram(context, kernel, options, program) {
+  const names = options.specialise;
+  if (!Array.isArray(names) || names.some(n => typeof n !== 'string'))
+    throw new TypeError('specialise parameter must be an array of kernel argument names.');
+  const maxVariants = (options.maxVariants === undefined) ? 16 : options.maxVariants;
+  if (!Number.isInteger(maxVariants) || (maxVariants < 1))
+    throw new RangeError('maxVariants parameter must be a positive integer.');
+  // variants in least recently used order, the oldest is dropped when there are too many
+  const variants = new Map();
+  const built = new Map();
+  const generic = { run: program.run, runSync: program.runSync, runBatch: program.runBatch, prepare: program.prepare, autotune: program.autotune };
+
+  const variantKey = params => JSON.stringify(names.map(n => {
+    if (typeof params[n] !== 'number')
+      throw new TypeError(`Specialised argument ${n} must be a number.`);
+    return params[n];
+  }));
+  const getVariant = key => {
+    let variant = variants.get(key);
+    if (variant) {
+      variants.delete(key);
+    } else {
+      const defines = Object.assign({}, options.defines);
+      JSON.parse(key).forEach((v, i) => defines[`NODEN_SPECIALISED_${names[i]}`] = v);
+      variant = context.createProgram(kernel, Object.assign({}, options, { defines: defines }))
+        .then(p => {
+          if (variants.get(key) === variant) built.set(key, p);
+          return p;
+        });
+      variant.catch(() => {
+        if (variants.get(key) === variant) variants.delete(key);
+      });
+      if (variants.size >= maxVariants) {
+        const oldest = variants.keys().next().value;
+        variants.delete(oldest);
+        built.delete(oldest);
+      }
+    }
+    variants.set(key, variant);
+    return variant;
+  };
+  const getBuilt = key => {
+    const variant = built.get(key);
+    if (variant) getVariant(key);
+    return variant;
+  };
+
+  program.run = async (params, queueNum, runOptions) =>
+    (await getVariant(variantKey(params))).run(params, queueNum, runOptions);
+  program.runBatch = async (params, queueNum, runOptions) => {
+    const keys = new Set(params.map(variantKey));
+    if (1 !== keys.size)
+      return generic.runBatch.call(program, params, queueNum, runOptions);
+    return (await getVariant(keys.values().next().value)).runBatch(params, queueNum, runOptions);
+  };
+  program.autotune = async (params, queueNum, tuneOptions) =>
+    (await getVariant(variantKey(params))).autotune(params, queueNum, tuneOptions);
+  // preparing is synchronous so only uses a variant that has already been built
+  program.prepare = params => {
+    const variant = getBuilt(variantKey(params));
+    return variant ? variant.prepare(params) : generic.prepare.call(program, params);
+  };
+  // as is running synchronously, falling back to the generic build until the variant is ready
+  program.runSync = (params, queueNum, runOptions) => {
+    const variant = getBuilt(variantKey(params));
+    return variant ? variant.runSync(params, queueNum, runOptions) :
+      generic.runSync.call(program, params, queueNum, runOptions);
+  };
+  return program;
+}
+
 function clContext(params, logger) {
   this.params = params;
   this.logger = logger || { log: console.log, warn: console.warn, error: console.error };
   this.buffers = [];
   this.bufIndex = 0;
+  // unreserved buffers available for reuse, in least recently used order - by pool key and overall
+  this.pool = new Map();
+  this.poolLRU = new Set();
+  this.poolBytes = 0;
+  this.poolStats = { hits: 0, misses: 0, evictions: 0 };
+  this.bufferBudget = params.bufferBudget || 0;
   this.queue = { load: 0, process: params.overlapping ? 1 : 0, unload: params.overlapping ? 2 : 0 };
   this.context = undefined;
 
@@ -68,6 +159,44 @@ function clContext(params, logger) {
     if (undefined === this.context) throw new Error('clContext must be initialised');
   };
 
+  this.poolAdd = buf => {
+    if (!buf.pooled || buf.reserved) return;
+    let free = this.pool.get(buf.poolKey);
+    if (!free) {
+      free = new Set();
+      this.pool.set(buf.poolKey, free);
+    }
+    free.add(buf);
+    this.poolLRU.add(buf);
+  };
+
+  this.poolRemove = buf => {
+    const free = this.pool.get(buf.poolKey);
+    if (free) {
+      free.delete(buf);
+      if (0 === free.size) this.pool.delete(buf.poolKey);
+    }
+    this.poolLRU.delete(buf);
+  };
+
+  this.freeBuffer = buf => {
+    this.poolRemove(buf);
+    buf.freeAllocation();
+    buf.pooled = false;
+    this.poolBytes -= buf.length;
+  };
+
+  // free the least recently used unreserved buffer, returning false if there are none
+  this.evictBuffer = () => {
+    const next = this.poolLRU.values().next();
+    if (next.done) return false;
+    const buf = next.value;
+    this.freeBuffer(buf);
+    this.buffers.splice(this.buffers.indexOf(buf), 1);
+    this.poolStats.evictions++;
+    return true;
+  };
+
   this.getPlatformInfo = () => {
     this.checkContext();    
     return addon.getPlatformInfo()[this.context.platformIndex];
@@ -79,31 +208,28 @@ clContext.prototype.initialise = async function() {
 };
 
 clContext.prototype.checkAlloc = async function(cb) {
-  let result;
-  try {
-    result = await cb();
-  } catch (err) {
-    if (-4 == err.code) { // memory allocation failure
-      this.logger.warn('Failed to allocate OpenCL memory - freeing unreserved allocations');
-      this.buffers = this.buffers.filter(el => {
-        if (!el.reserved) el.freeAllocation();
-        return el.reserved === true;
-      });
-      result = await cb();
-    } else
-      throw err;
+  for (;;) {
+    try {
+      return await cb();
+    } catch (err) {
+      if (-4 != err.code) throw err;
+      // memory allocation failure - free unreserved allocations one at a time until the allocation succeeds
+      if (!this.evictBuffer()) throw err;
+      this.logger.warn('Failed to allocate OpenCL memory - freed least recently used unreserved allocation');
+    }
   }
-  return result;
 };
 
 clContext.prototype.createBuffer = async function(numBytes, bufDir, bufType, imageDims, owner, id) {
   if (!bufType) bufType = 'none';
   if (!imageDims) imageDims = {};
-  const buf = this.buffers.find(el => 
-    !el.reserved && (el.length === numBytes) && (el.bufDir === bufDir) &&
-                    (el.bufType === bufType));
-  if (buf) {
+  const key = poolKey(numBytes, bufDir, bufType, imageDims);
+  const free = this.pool.get(key);
+  if (free) {
+    const buf = free.values().next().value;
     // this.logger.log(`reuse ${buf.index}: ${owner} <- ${buf.owner} ${numBytes} bytes`);
+    this.poolRemove(buf);
+    this.poolStats.hits++;
     buf.reserved = true;
     buf.owner = owner;
     buf.loadstamp = 0;
@@ -111,7 +237,12 @@ clContext.prototype.createBuffer = async function(numBytes, bufDir, bufType, ima
     buf.id = id;
     buf.refs = 1;
     return buf;
-  } else return this.checkAlloc(() => {
+  }
+
+  this.poolStats.misses++;
+  if (this.bufferBudget > 0)
+    while ((this.poolBytes + numBytes > this.bufferBudget) && this.evictBuffer());
+  return this.checkAlloc(() => {
     this.checkContext();
     // this.logger.log(`new ${this.bufIndex}: ${owner} ${numBytes} bytes`);
     const bufIndex = this.bufIndex;
@@ -128,24 +259,55 @@ clContext.prototype.createBuffer = async function(numBytes, bufDir, bufType, ima
         buf.timestamp = 0;
         buf.id = id;
         buf.refs = 1;
+        buf.poolKey = key;
+        buf.pooled = false;
         buf.addRef = () => addReference(buf, this.buffers);
-        buf.release = () => releaseReference(buf);
-        if (owner) this.buffers.push(buf);
+        buf.release = () => {
+          releaseReference(buf);
+          this.poolAdd(buf);
+        };
+        if (owner) {
+          buf.pooled = true;
+          this.buffers.push(buf);
+          this.poolBytes += numBytes;
+        }
         return buf;
       });
   });
 };
 
+clContext.prototype.wrapBuffer = async function(nodeBuffer, bufDir) {
+  this.checkContext();
+  if (!bufDir) bufDir = 'readwrite';
+  const buf = await this.context.wrapBuffer(nodeBuffer, bufDir);
+  buf.bufDir = bufDir;
+  buf.imageDims = {};
+  buf.loadstamp = 0;
+  buf.timestamp = 0;
+  return buf;
+};
+
 clContext.prototype.releaseBuffers = function(owner) {
   this.buffers = this.buffers.filter(el => {
-    if (el.owner === owner) el.freeAllocation();
+    if (el.owner === owner) this.freeBuffer(el);
     return el.owner !== owner; 
   });
 };
 
+clContext.prototype.getPoolStats = function() {
+  return Object.assign({
+    allocatedBytes: this.poolBytes,
+    freeBuffers: this.poolLRU.size,
+    bufferBudget: this.bufferBudget
+  }, this.poolStats);
+};
+
 clContext.prototype.createProgram = async function(kernel, options) {
   this.checkContext();
-  return this.context.createProgram(kernel, options);
+  const program = await this.context.createProgram(kernel, options);
+  if (options && options.specialise)
+    return specialiseProgram(this.context, kernel, options, program);
+  return program;
 };
 
 clContext.prototype.runProgram = async function(program, params, owner) {
@@ -176,6 +338,9 @@ clContext.prototype.close = async function(done) {
       this.logger.warn('Timed out waiting for release of OpenCL allocations');
       this.buffers = this.buffers.map(el => el.freeAllocation());
       this.buffers.length = 0;
+      this.pool.clear();
+      this.poolLRU.clear();
+      this.poolBytes = 0;
       this.context = null;
       if (done) done();
       resolve();
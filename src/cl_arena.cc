@@ -0,0 +1,122 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "cl_arena.h"
+#include "noden_util.h"
+#include <algorithm>
+#include <iterator>
+
+clArena::~clArena() {
+  for (auto& s: mSlabs) {
+    cl_int error = clReleaseMemObject(s.buffer);
+    if (CL_SUCCESS != error)
+      printf("OpenCL error in subroutine. Location %s(%d). Error %i: %s\n",
+        __FILE__, __LINE__, error, clGetErrorString(error));
+  }
+}
+
+cl_int clArena::reserve() {
+  std::lock_guard<std::mutex> lk(mMutex);
+  return mSlabs.empty() ? addSlab(mSlabSize) : CL_SUCCESS;
+}
+
+cl_int clArena::addSlab(size_t size) {
+  cl_int error = CL_SUCCESS;
+  slab s;
+  s.buffer = clCreateBuffer(mContext, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, nullptr, &error);
+  PASS_CL_ERROR;
+  s.size = size;
+  s.freeRanges.emplace(0, size);
+  mSlabs.push_back(s);
+  return error;
+}
+
+bool clArena::take(size_t size, size_t &slabIndex, size_t &offset) {
+  for (size_t i = 0; i < mSlabs.size(); ++i) {
+    auto& freeRanges = mSlabs[i].freeRanges;
+    for (auto r = freeRanges.begin(); r != freeRanges.end(); ++r) {
+      if (r->second < size) continue;
+      slabIndex = i;
+      offset = r->first;
+      size_t remaining = r->second - size;
+      freeRanges.erase(r);
+      if (remaining)
+        freeRanges.emplace(offset + size, remaining);
+      return true;
+    }
+  }
+  return false;
+}
+
+void clArena::give(size_t slabIndex, size_t offset, size_t size) {
+  std::lock_guard<std::mutex> lk(mMutex);
+  auto& freeRanges = mSlabs[slabIndex].freeRanges;
+  auto next = freeRanges.lower_bound(offset);
+  if ((next != freeRanges.end()) && (offset + size == next->first)) {
+    size += next->second;
+    next = freeRanges.erase(next);
+  }
+  if (next != freeRanges.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      prev->second += size;
+      return;
+    }
+  }
+  freeRanges.emplace(offset, size);
+}
+
+cl_int clArena::createSubBuffer(size_t numBytes, cl_mem_flags memFlags, cl_mem &subBuffer) {
+  cl_int error = CL_SUCCESS;
+  subBuffer = nullptr;
+  // sub-buffer origins must meet the device base address alignment
+  size_t size = (std::max<size_t>(numBytes, 1) + mAlignment - 1) / mAlignment * mAlignment;
+  size_t slabIndex = 0;
+  size_t offset = 0;
+  cl_mem slabBuffer = nullptr;
+  {
+    std::lock_guard<std::mutex> lk(mMutex);
+    if (!take(size, slabIndex, offset)) {
+      error = addSlab(std::max(size, mSlabSize));
+      PASS_CL_ERROR;
+      take(size, slabIndex, offset);
+    }
+    slabBuffer = mSlabs[slabIndex].buffer;
+  }
+
+  cl_buffer_region bufRegion = { offset, std::max<size_t>(numBytes, 1) };
+  subBuffer = clCreateSubBuffer(slabBuffer, memFlags, CL_BUFFER_CREATE_TYPE_REGION, &bufRegion, &error);
+  if (CL_SUCCESS != error) {
+    give(slabIndex, offset, size);
+    subBuffer = nullptr;
+    return error;
+  }
+
+  region *r = new region { shared_from_this(), slabIndex, offset, size };
+  error = clSetMemObjectDestructorCallback(subBuffer, regionDestructor, r);
+  if (CL_SUCCESS != error) {
+    clReleaseMemObject(subBuffer);
+    give(slabIndex, offset, size);
+    delete r;
+    subBuffer = nullptr;
+  }
+  return error;
+}
+
+void CL_CALLBACK clArena::regionDestructor(cl_mem memobj, void *userData) {
+  region *r = (region *)userData;
+  r->arena->give(r->slabIndex, r->offset, r->size);
+  delete r;
+}
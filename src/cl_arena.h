@@ -0,0 +1,70 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef CL_ARENA_H
+#define CL_ARENA_H
+
+#include "cl_include.h"
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Large slabs of device memory, allocated with the host pointer flags used for
+// plain buffers, that buffers are carved out of as aligned sub-buffers. The
+// region of a sub-buffer returns to the arena from the OpenCL destructor
+// callback, so it cannot be reused while commands still reference it.
+class clArena : public std::enable_shared_from_this<clArena> {
+public:
+  clArena(cl_context context, size_t slabSize, size_t alignment)
+    : mContext(context), mSlabSize(slabSize), mAlignment(alignment) {}
+  ~clArena();
+
+  // Allocate the first slab up front
+  cl_int reserve();
+
+  // Create a sub-buffer of numBytes with the given access flags, adding a slab if none has room
+  cl_int createSubBuffer(size_t numBytes, cl_mem_flags memFlags, cl_mem &subBuffer);
+
+  size_t slabSize() const { return mSlabSize; }
+
+private:
+  struct slab {
+    cl_mem buffer;
+    size_t size;
+    std::map<size_t, size_t> freeRanges; // offset -> size
+  };
+  struct region {
+    std::shared_ptr<clArena> arena;
+    size_t slabIndex;
+    size_t offset;
+    size_t size;
+  };
+
+  cl_context mContext;
+  const size_t mSlabSize;
+  const size_t mAlignment;
+  std::mutex mMutex;
+  std::vector<slab> mSlabs;
+
+  cl_int addSlab(size_t size);
+  bool take(size_t size, size_t &slabIndex, size_t &offset);
+  void give(size_t slabIndex, size_t offset, size_t size);
+
+  static void CL_CALLBACK regionDestructor(cl_mem memobj, void *userData);
+};
+
+#endif
@@ -0,0 +1,207 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "cl_events.h"
+#include "noden_util.h"
+
+cl_event *clEvents::record(const char *name) {
+  if (!mProfiling) return nullptr;
+  namedEvent ne;
+  ne.name = name;
+  ne.event = nullptr;
+  mEvents.push_back(ne);
+  return &mEvents.back().event;
+}
+
+cl_int clEvents::wait() {
+  std::vector<cl_event> waitEvents;
+  for (auto& ne: mEvents)
+    if (ne.event) waitEvents.push_back(ne.event);
+  if (waitEvents.empty()) return CL_SUCCESS;
+  return clWaitForEvents((cl_uint)waitEvents.size(), waitEvents.data());
+}
+
+napi_status clEvents::profile(napi_env env, napi_value *result) {
+  napi_status status;
+  status = napi_create_array(env, result);
+  PASS_STATUS;
+
+  const cl_profiling_info params[] = { CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+                                       CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END };
+  const char *paramNames[] = { "queued", "submit", "start", "end" };
+
+  uint32_t index = 0;
+  for (auto& ne: mEvents) {
+    if (!ne.event) continue;
+    napi_value entry;
+    status = napi_create_object(env, &entry);
+    PASS_STATUS;
+
+    napi_value nameValue;
+    status = napi_create_string_utf8(env, ne.name.c_str(), NAPI_AUTO_LENGTH, &nameValue);
+    PASS_STATUS;
+    status = napi_set_named_property(env, entry, "name", nameValue);
+    PASS_STATUS;
+
+    for (size_t i = 0; i < 4; ++i) {
+      cl_ulong nanos = 0;
+      cl_int error = clGetEventProfilingInfo(ne.event, params[i], sizeof(cl_ulong), &nanos, nullptr);
+      napi_value timeValue;
+      if (CL_SUCCESS == error)
+        status = napi_create_bigint_uint64(env, (uint64_t)nanos, &timeValue);
+      else
+        status = napi_get_undefined(env, &timeValue);
+      PASS_STATUS;
+      status = napi_set_named_property(env, entry, paramNames[i], timeValue);
+      PASS_STATUS;
+    }
+
+    status = napi_set_element(env, *result, index++, entry);
+    PASS_STATUS;
+  }
+  return napi_ok;
+}
+
+void clEvents::addWait(cl_event event) {
+  clRetainEvent(event);
+  mWaitList.push_back(event);
+}
+
+static void CL_CALLBACK releaseInFlight(cl_event event, cl_int eventStatus, void* data) {
+  std::shared_ptr<std::atomic<uint32_t>> *inFlight = (std::shared_ptr<std::atomic<uint32_t>>*)data;
+  --**inFlight;
+  delete inFlight;
+}
+
+cl_int clEvents::markCompletion(cl_command_queue commandQueue, std::shared_ptr<std::atomic<uint32_t>> inFlight) {
+  if (mCompletion) clReleaseEvent(mCompletion);
+  mCompletion = nullptr;
+  cl_int error = clEnqueueMarkerWithWaitList(commandQueue, numWaits(), waitList(), &mCompletion);
+  PASS_CL_ERROR;
+  if (inFlight) {
+    // the queue stays busy for the sync fast path until the device reaches the marker
+    ++*inFlight;
+    std::shared_ptr<std::atomic<uint32_t>> *held = new std::shared_ptr<std::atomic<uint32_t>>(inFlight);
+    error = clSetEventCallback(mCompletion, CL_COMPLETE, releaseInFlight, held);
+    if (CL_SUCCESS != error) {
+      --*inFlight;
+      delete held;
+    }
+  }
+  // make sure the commands are submitted so that work waiting on other queues can progress
+  return clFlush(commandQueue);
+}
+
+cl_event clEvents::takeCompletion() {
+  cl_event event = mCompletion;
+  mCompletion = nullptr;
+  return event;
+}
+
+void clEvents::release() {
+  for (auto& ne: mEvents)
+    if (ne.event) clReleaseEvent(ne.event);
+  mEvents.clear();
+  for (auto& event: mWaitList)
+    clReleaseEvent(event);
+  mWaitList.clear();
+  if (mCompletion) clReleaseEvent(mCompletion);
+  mCompletion = nullptr;
+}
+
+void finalizeEvent(napi_env env, void* data, void* hint) {
+  clReleaseEvent((cl_event)data);
+}
+
+napi_status createEventHandle(napi_env env, cl_event event, napi_value *result) {
+  napi_status status;
+  status = napi_create_object(env, result);
+  PASS_STATUS;
+  napi_value eventValue;
+  status = napi_create_external(env, event, finalizeEvent, nullptr, &eventValue);
+  if (status != napi_ok) {
+    clReleaseEvent(event);
+    return status;
+  }
+  return napi_set_named_property(env, *result, "clEvent", eventValue);
+}
+
+napi_status getWaitEvent(napi_env env, napi_value handle, clEvents &events) {
+  napi_status status;
+  napi_valuetype t;
+  status = napi_typeof(env, handle, &t);
+  PASS_STATUS;
+  bool hasEvent = false;
+  if (napi_object == t) {
+    status = napi_has_named_property(env, handle, "clEvent", &hasEvent);
+    PASS_STATUS;
+  }
+  if (!hasEvent) {
+    napi_throw_type_error(env, nullptr, "Option waitFor must be an event or an array of events.");
+    return napi_pending_exception;
+  }
+
+  napi_value eventValue;
+  status = napi_get_named_property(env, handle, "clEvent", &eventValue);
+  PASS_STATUS;
+  cl_event event;
+  status = napi_get_value_external(env, eventValue, (void**)&event);
+  PASS_STATUS;
+  events.addWait(event);
+  return napi_ok;
+}
+
+napi_status getWaitEvents(napi_env env, napi_value waitFor, clEvents &events) {
+  napi_status status;
+  bool isArray = false;
+  status = napi_is_array(env, waitFor, &isArray);
+  PASS_STATUS;
+  if (!isArray)
+    return getWaitEvent(env, waitFor, events);
+
+  uint32_t numEvents = 0;
+  status = napi_get_array_length(env, waitFor, &numEvents);
+  PASS_STATUS;
+  for (uint32_t e = 0; e < numEvents; ++e) {
+    napi_value handle;
+    status = napi_get_element(env, waitFor, e, &handle);
+    PASS_STATUS;
+    status = getWaitEvent(env, handle, events);
+    PASS_STATUS;
+  }
+  return napi_ok;
+}
+
+napi_status getEventOptions(napi_env env, napi_value options, clEvents &events) {
+  napi_status status;
+  napi_valuetype t;
+  status = napi_typeof(env, options, &t);
+  PASS_STATUS;
+  if (napi_undefined == t)
+    return napi_ok;
+  if (napi_object != t) {
+    napi_throw_type_error(env, nullptr, "Optional options parameter must be an object.");
+    return napi_pending_exception;
+  }
+
+  napi_value waitForValue;
+  status = napi_get_named_property(env, options, "waitFor", &waitForValue);
+  PASS_STATUS;
+  status = napi_typeof(env, waitForValue, &t);
+  PASS_STATUS;
+  if (napi_undefined == t)
+    return napi_ok;
+  return getWaitEvents(env, waitForValue, events);
+}
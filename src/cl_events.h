@@ -0,0 +1,82 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef CL_EVENTS_H
+#define CL_EVENTS_H
+
+#include "cl_include.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "node_api.h"
+
+// Collects the events of the OpenCL commands enqueued by one operation, such
+// as a run or a host access. Events are only recorded when profiling so that
+// the normal path does not create and release an event per command.
+// Also holds the events that the operation must wait for, which may come from
+// other queues, and the event that signals completion of the operation.
+class clEvents {
+public:
+  clEvents() : mProfiling(false), mCompletion(nullptr) {}
+  ~clEvents() { release(); }
+
+  void setProfiling(bool profiling) { mProfiling = profiling; }
+  bool profiling() const { return mProfiling; }
+
+  // Returns the event argument to pass to a clEnqueue call, or nullptr if not recording
+  cl_event *record(const char *name);
+
+  // Wait for recorded commands to complete so that their profiling info is available
+  cl_int wait();
+
+  // Array of { name, queued, submit, start, end } objects with device timestamps in nanoseconds
+  napi_status profile(napi_env env, napi_value *result);
+
+  // Wait list to pass to every clEnqueue call of the operation
+  void addWait(cl_event event);
+  cl_uint numWaits() const { return (cl_uint)mWaitList.size(); }
+  const cl_event *waitList() const { return mWaitList.empty() ? nullptr : mWaitList.data(); }
+
+  // Enqueue a marker that completes when all the commands of the operation on this
+  // in-order queue, and everything they waited for, have completed. Any in-flight
+  // count of the queue is held until then, as the operation may finish before the device.
+  cl_int markCompletion(cl_command_queue commandQueue,
+    std::shared_ptr<std::atomic<uint32_t>> inFlight = nullptr);
+  cl_event completion() const { return mCompletion; }
+  // Hands over ownership of the completion event, if any
+  cl_event takeCompletion();
+
+  void release();
+
+private:
+  struct namedEvent {
+    std::string name;
+    cl_event event;
+  };
+  bool mProfiling;
+  std::vector<namedEvent> mEvents;
+  std::vector<cl_event> mWaitList;
+  cl_event mCompletion;
+};
+
+// Event handles are JS objects with a clEvent external that releases the event when collected
+napi_status createEventHandle(napi_env env, cl_event event, napi_value *result);
+// Adds the events from a waitFor value, a handle or an array of handles, to the wait list
+napi_status getWaitEvents(napi_env env, napi_value waitFor, clEvents &events);
+// Reads the waitFor property of an optional run or host access options argument
+napi_status getEventOptions(napi_env env, napi_value options, clEvents &events);
+
+#endif
@@ -17,14 +17,16 @@
 #include "noden_context.h"
 #include "noden_program.h"
 #include "noden_util.h"
+#include "noden_copy.h"
 #include <cstring>
+#include <algorithm>
 
 class iGpuAccess {
 public:
   virtual ~iGpuAccess() {}
-  virtual cl_int unmapMem(uint32_t queueNum) = 0;
+  virtual cl_int unmapMem(uint32_t queueNum, clEvents &events) = 0;
   virtual cl_int getKernelMem(iRunParams *runParams, bool isImageParam,
-                              iKernelArg::eAccess access, bool &isSVM, void *&kernelMem, uint32_t queueNum) = 0;
+                              iKernelArg::eAccess access, bool &isSVM, void *&kernelMem, uint32_t queueNum, clEvents &events) = 0;
   virtual void onGpuReturn() = 0;
 };
 
@@ -37,14 +39,14 @@ public:
   }
 
   cl_int setKernelParam(cl_kernel kernel, uint32_t paramIndex, bool isImageParam,
-                        iKernelArg::eAccess access, iRunParams *runParams, uint32_t queueNum) {
+                        iKernelArg::eAccess access, iRunParams *runParams, uint32_t queueNum, clEvents &events) {
     cl_int error = CL_SUCCESS;
-    error = mGpuAccess->unmapMem(queueNum);
+    error = mGpuAccess->unmapMem(queueNum, events);
     PASS_CL_ERROR;
 
     bool isSVM = false;
     void *kernelMem = nullptr;
-    error = mGpuAccess->getKernelMem(runParams, isImageParam, access, isSVM, kernelMem, queueNum);
+    error = mGpuAccess->getKernelMem(runParams, isImageParam, access, isSVM, kernelMem, queueNum, events);
     PASS_CL_ERROR;
 
     if (isSVM)
@@ -61,11 +63,13 @@ private:
 class clMemory : public iClMemory, public iGpuAccess {
 public:
   clMemory(cl_context context, std::vector<cl_command_queue> commandQueues, eMemFlags memFlags, eSvmType svmType, 
-           uint32_t numBytes, deviceInfo *devInfo, const std::array<uint32_t, 3>& imageDims)
+           size_t numBytes, deviceInfo *devInfo, const std::array<uint32_t, 3>& imageDims,
+           const cl_image_format& imageFormat, std::shared_ptr<clArena> arena, bool deviceResident, void *wrapPtr = nullptr)
     : mContext(context), mCommandQueues(commandQueues), mMemFlags(memFlags), mSvmType(svmType),
-      mNumBytes(numBytes), mDevInfo(devInfo), mImageDims(imageDims),
-      mPinnedMem(nullptr), mImageMem(nullptr), mHostBuf(nullptr), mGpuLocked(false), mHostMapped(false),
-      mMapFlags(eMemFlags::NONE), mMemLatest(eMemLatest::BUFFER) {}
+      mNumBytes(numBytes), mDevInfo(devInfo), mImageDims(imageDims), mImageFormat(imageFormat), mArena(arena), mWrapPtr(wrapPtr),
+      mDeviceResident(deviceResident), mPinnedMem(nullptr), mDeviceMem(nullptr), mImageMem(nullptr), mImageAliased(false),
+      mHostBuf(nullptr), mGpuLocked(false), mHostMapped(false), mMapOffset(0), mMapBytes(0),
+      mMapFlags(eMemFlags::NONE), mMemLatest(eMemLatest::BUFFER), mDevLatest(eDevLatest::STAGING) {}
   ~clMemory() {
     freeAllocation();
   }
@@ -82,12 +86,18 @@ public:
     switch (mSvmType) {
     case eSvmType::FINE:
     case eSvmType::COARSE:
-      mHostBuf = clSVMAlloc(mContext, clSvmMemFlags, mNumBytes, 0);
+      // wrapped memory is only fine grain when the device supports system SVM
+      mHostBuf = mWrapPtr ? mWrapPtr : clSVMAlloc(mContext, clSvmMemFlags, mNumBytes, 0);
       mPinnedMem = clCreateBuffer(mContext, clMemFlags | CL_MEM_USE_HOST_PTR, mNumBytes, mHostBuf, &error);
       break;
     case eSvmType::NONE:
     default:
-      mPinnedMem = clCreateBuffer(mContext, clMemFlags | CL_MEM_ALLOC_HOST_PTR, mNumBytes, nullptr, &error);
+      if (mWrapPtr)
+        mPinnedMem = clCreateBuffer(mContext, clMemFlags | CL_MEM_USE_HOST_PTR, mNumBytes, mWrapPtr, &error);
+      else if (mArena)
+        error = mArena->createSubBuffer(mNumBytes, clMemFlags, mPinnedMem);
+      else
+        mPinnedMem = clCreateBuffer(mContext, clMemFlags | CL_MEM_ALLOC_HOST_PTR, mNumBytes, nullptr, &error);
       if (CL_SUCCESS == error) {
         cl_map_flags clMapFlags = (eMemFlags::READONLY == mMemFlags) ? CL_MAP_WRITE_INVALIDATE_REGION : 
                                   (eMemFlags::WRITEONLY == mMemFlags) ? CL_MAP_READ :
@@ -97,7 +107,18 @@ public:
         printf("OpenCL error in subroutine. Location %s(%d). Error %i: %s\n",
           __FILE__, __LINE__, error, clGetErrorString(error));
       mHostMapped = true;
+      mMapOffset = 0;
+      mMapBytes = mNumBytes;
       mMapFlags = (eMemFlags::READONLY == mMemFlags) ? eMemFlags::WRITEONLY : eMemFlags::READWRITE;
+      if (mDeviceResident && (CL_SUCCESS == error)) {
+        // kernels use device local memory, the mapped buffer above is the host staging copy
+        mDeviceMem = clCreateBuffer(mContext, clMemFlags, mNumBytes, nullptr, &error);
+        if (CL_SUCCESS != error) {
+          printf("OpenCL error in subroutine. Location %s(%d). Error %i: %s\n",
+            __FILE__, __LINE__, error, clGetErrorString(error));
+          return false;
+        }
+      }
       break;
     }
 
@@ -105,21 +126,31 @@ public:
   }
 
   std::shared_ptr<iGpuMemory> getGPUMemory() {
-    // printf("getGpuMemory type %d, host mapped %s, numBytes %d\n", mSvmType, mHostMapped?"true":"false", mNumBytes);
+    // printf("getGpuMemory type %d, host mapped %s, numBytes %zd\n", mSvmType, mHostMapped?"true":"false", mNumBytes);
     mGpuLocked = true;
     return std::make_shared<gpuMemory>(this);
   }
 
-  cl_int setHostAccess(eMemFlags haFlags, uint32_t queueNum) {
+  cl_int setHostAccess(eMemFlags haFlags, uint32_t queueNum, clEvents &events,
+                       size_t offset, size_t numBytes) {
     cl_int error = CL_SUCCESS;
     if (mGpuLocked) {
-      printf("GPU buffer access must be released before host access - %d\n", mNumBytes);
+      printf("GPU buffer access must be released before host access - %zd\n", mNumBytes);
       error = CL_MAP_FAILURE;
       return error;
     }
+    if (0 == numBytes) {
+      offset = 0;
+      numBytes = mNumBytes;
+    }
+    if ((offset >= mNumBytes) || (numBytes > mNumBytes - offset)) {
+      printf("Host access range %zd+%zd is outside buffer of size %zd\n", offset, numBytes, mNumBytes);
+      return CL_INVALID_VALUE;
+    }
 
-    if (mHostMapped && (haFlags != mMapFlags)) {
-      error = unmapMem(queueNum); // must unmap if host access flags don't match
+    // must unmap if host access flags don't match or the mapping doesn't cover the range
+    if (mHostMapped && ((haFlags != mMapFlags) || (offset < mMapOffset) || (offset + numBytes > mMapOffset + mMapBytes))) {
+      error = unmapMem(queueNum, events);
       PASS_CL_ERROR;
     }
 
@@ -127,55 +158,134 @@ public:
       cl_map_flags mapFlags = (eMemFlags::READWRITE == haFlags) ? CL_MAP_WRITE | CL_MAP_READ :
                               (eMemFlags::WRITEONLY == haFlags) ? CL_MAP_WRITE_INVALIDATE_REGION :
                               CL_MAP_READ;
-      if (mImageMem) { // && (mDevInfo->oclVer < clVersion(2,0))) {
-        if (eMemFlags::WRITEONLY == haFlags)
+      if (mImageMem && !mImageAliased) {
+        bool wholeBuffer = numBytes == mNumBytes;
+        if ((eMemFlags::WRITEONLY == haFlags) && wholeBuffer)
           mMemLatest = eMemLatest::BUFFER;
-        else {
-          error = copyImageToBuffer(queueNum);
+        else if (wholeBuffer || (eMemFlags::READONLY == haFlags)) {
+          error = copyImageToBuffer(queueNum, events, offset, wholeBuffer ? 0 : numBytes);
           PASS_CL_ERROR;
+        } else {
+          // a write to part of the buffer makes it the latest copy, so the rest must be up to date first
+          if (eMemLatest::IMAGE == mMemLatest) {
+            error = copyImageToBuffer(queueNum, events);
+            PASS_CL_ERROR;
+          }
+          mMemLatest = eMemLatest::BUFFER;
         }
       }
 
+      if (mDeviceResident) {
+        if (eMemFlags::READONLY == haFlags)
+          error = syncToStaging(queueNum, events, offset, numBytes);
+        else if (!((eMemFlags::WRITEONLY == haFlags) && (numBytes == mNumBytes)))
+          error = syncToStaging(queueNum, events, 0, mNumBytes);
+        PASS_CL_ERROR;
+        if (eMemFlags::READONLY != haFlags)
+          mDevLatest = eDevLatest::STAGING;
+      }
+
       cl_bool blockingMap = mCommandQueues.size() > 1 ? CL_NON_BLOCKING : CL_BLOCKING;
       if (eSvmType::NONE == mSvmType) {
-        void *hostBuf = clEnqueueMapBuffer(getCommandQueue(queueNum), mPinnedMem, blockingMap, mapFlags, 0, mNumBytes, 0, nullptr, nullptr, &error);
+        void *hostBuf = clEnqueueMapBuffer(getCommandQueue(queueNum), mPinnedMem, blockingMap, mapFlags, offset, numBytes, events.numWaits(), events.waitList(), events.record("map"), &error);
         PASS_CL_ERROR;
-        if (mHostBuf != hostBuf) {
-          printf("Unexpected behaviour - mapped buffer address is not the same: %p != %p\n", mHostBuf, hostBuf);
+        if ((uint8_t *)mHostBuf + offset != hostBuf) {
+          printf("Unexpected behaviour - mapped buffer address is not the same: %p != %p\n", (uint8_t *)mHostBuf + offset, hostBuf);
           error = CL_MAP_FAILURE;
           return error;
         }
         mHostMapped = true;
       } else if (eSvmType::COARSE == mSvmType) {
-        error = clEnqueueSVMMap(getCommandQueue(queueNum), blockingMap, mapFlags, mHostBuf, mNumBytes, 0, nullptr, nullptr);
+        error = clEnqueueSVMMap(getCommandQueue(queueNum), blockingMap, mapFlags, (uint8_t *)mHostBuf + offset, numBytes, events.numWaits(), events.waitList(), events.record("svmMap"));
         PASS_CL_ERROR;
         mHostMapped = true;
       }
 
+      mMapOffset = offset;
+      mMapBytes = numBytes;
       mMapFlags = haFlags;
     }
     return error;
   }
 
-  cl_int copyFrom(const void *srcBuf, size_t numBytes, uint32_t queueNum) {
+  cl_int copyFrom(const void *srcBuf, size_t numBytes, uint32_t queueNum, size_t offset) {
     cl_int error = CL_SUCCESS;
 
     // if (eSvmType::NONE == mSvmType)
-      memcpy(mHostBuf, srcBuf, numBytes);
+      parallelCopy((uint8_t *)mHostBuf + offset, srcBuf, numBytes);
     // else
     //   error = clEnqueueSVMMemcpy(getCommandQueue(queueNum), CL_BLOCKING, mHostBuf, srcBuf, numBytes, 0, nullptr, nullptr);
     // PASS_CL_ERROR;
     return error;
   }
 
+  cl_int transfer(bool toBuffer, void *hostPtr, size_t offset, size_t numBytes,
+                  uint32_t queueNum, clEvents &events, cl_event *event) {
+    cl_int error = CL_SUCCESS;
+    if (mGpuLocked) {
+      printf("GPU buffer access must be released before transfers - %zd\n", mNumBytes);
+      return CL_INVALID_OPERATION;
+    }
+    if ((offset >= mNumBytes) || (numBytes > mNumBytes - offset))
+      return CL_INVALID_VALUE;
+
+    // the device must own the memory, as for a kernel
+    error = unmapMem(queueNum, events);
+    PASS_CL_ERROR;
+
+    if (mImageMem && !mImageAliased) {
+      if (!toBuffer)
+        error = copyImageToBuffer(queueNum, events, offset, numBytes);
+      else {
+        if ((numBytes < mNumBytes) && (eMemLatest::IMAGE == mMemLatest))
+          error = copyImageToBuffer(queueNum, events);
+        mMemLatest = eMemLatest::BUFFER;
+      }
+      PASS_CL_ERROR;
+    }
+
+    // device resident buffers transfer directly to device memory unless the staging copy is newer
+    cl_mem transferMem = mPinnedMem;
+    if (mDeviceResident) {
+      if (toBuffer) {
+        if (numBytes < mNumBytes)
+          error = syncToDevice(queueNum, events);
+        PASS_CL_ERROR;
+        mDevLatest = eDevLatest::DEVICE;
+        transferMem = mDeviceMem;
+      } else if (eDevLatest::STAGING != mDevLatest)
+        transferMem = mDeviceMem;
+    }
+
+    cl_command_queue commandQueue = getCommandQueue(queueNum);
+    cl_event *profileEvent = events.record(toBuffer ? "write" : "read");
+    if (eSvmType::NONE == mSvmType) {
+      if (toBuffer)
+        error = clEnqueueWriteBuffer(commandQueue, transferMem, CL_NON_BLOCKING, offset, numBytes, hostPtr, events.numWaits(), events.waitList(), event);
+      else
+        error = clEnqueueReadBuffer(commandQueue, transferMem, CL_NON_BLOCKING, offset, numBytes, hostPtr, events.numWaits(), events.waitList(), event);
+    } else {
+      void *svmPtr = (uint8_t *)mHostBuf + offset;
+      error = clEnqueueSVMMemcpy(commandQueue, CL_NON_BLOCKING, toBuffer ? svmPtr : hostPtr, toBuffer ? hostPtr : svmPtr,
+                                 numBytes, events.numWaits(), events.waitList(), event);
+    }
+    PASS_CL_ERROR;
+    if (profileEvent) {
+      clRetainEvent(*event);
+      *profileEvent = *event;
+    }
+    return error;
+  }
+
   void freeAllocation() {
     cl_int error = CL_SUCCESS;
-    error = unmapMem(0);
+    clEvents events;
+    error = unmapMem(0, events);
     if (CL_SUCCESS != error)
       printf("OpenCL error in subroutine. Location %s(%d). Error %i: %s\n",
         __FILE__, __LINE__, error, clGetErrorString(error));
 
-    if (mHostBuf && (eSvmType::NONE != mSvmType))
+    if (mHostBuf && (eSvmType::NONE != mSvmType) && !mWrapPtr)
       clSVMFree(mContext, mHostBuf);
 
     if (mImageMem) {
@@ -185,6 +295,13 @@ public:
           __FILE__, __LINE__, error, clGetErrorString(error));
     }
 
+    if (mDeviceMem) {
+      error = clReleaseMemObject(mDeviceMem);
+      if (CL_SUCCESS != error)
+        printf("OpenCL error in subroutine. Location %s(%d). Error %i: %s\n",
+          __FILE__, __LINE__, error, clGetErrorString(error));
+    }
+
     if (mPinnedMem) {
       error = clReleaseMemObject(mPinnedMem);
       if (CL_SUCCESS != error)
@@ -193,14 +310,16 @@ public:
     }
 
     mPinnedMem = nullptr;
+    mDeviceMem = nullptr;
     mImageMem = nullptr;
     mHostBuf = nullptr;
   }
 
-  uint32_t numBytes() const { return mNumBytes; }
+  size_t numBytes() const { return mNumBytes; }
   eMemFlags memFlags() const { return mMemFlags; }
   eSvmType svmType() const { return mSvmType; }
   std::string svmTypeName() const {
+    if (mDeviceResident) return "device";
     switch (mSvmType) {
     case eSvmType::FINE: return "fine";
     case eSvmType::COARSE: return "coarse";
@@ -209,52 +328,129 @@ public:
     }
   }
   void* hostBuf() const { return mHostBuf; }
+
+  bool rectRange(const uint32_t origin[2], const uint32_t region[2], size_t &offset, size_t &numBytes) const {
+    size_t pixelBytes = imagePixelBytes(mImageFormat);
+    size_t width = mImageDims[0];
+    size_t height = std::max<size_t>(mImageDims[1], 1);
+    if ((0 == width) || (0 == region[0]) || (0 == region[1]) ||
+        ((size_t)origin[0] + region[0] > width) || ((size_t)origin[1] + region[1] > height))
+      return false;
+    size_t rowBytes = width * pixelBytes;
+    offset = origin[1] * rowBytes + origin[0] * pixelBytes;
+    numBytes = (region[1] - 1) * rowBytes + region[0] * pixelBytes;
+    return offset + numBytes <= mNumBytes;
+  }
   bool hasDimensions() const { return mImageDims[0] > 0; }
+  uint32_t numQueues() const { return (uint32_t)mCommandQueues.size(); }
+
+  cl_command_queue getCommandQueue(uint32_t queueNum) {
+    uint32_t q = queueNum;
+    if (queueNum >= (uint32_t)mCommandQueues.size()) {
+      printf("Invalid queue \'%d\', defaulting to 0\n", queueNum);
+      q = 0;
+    }
+    return mCommandQueues.at(q);
+  }
 
   enum class eMemLatest : uint8_t { BUFFER = 0, SAME = 1, IMAGE = 2 };
+  enum class eDevLatest : uint8_t { STAGING = 0, SAME = 1, DEVICE = 2 };
 
 private:
   cl_context mContext;
   std::vector<cl_command_queue> mCommandQueues;
   const eMemFlags mMemFlags;
   const eSvmType mSvmType;
-  const uint32_t mNumBytes;
+  const size_t mNumBytes;
   deviceInfo *mDevInfo;
   const std::array<uint32_t, 3> mImageDims;
+  const cl_image_format mImageFormat;
+  std::shared_ptr<clArena> mArena;
+  void *mWrapPtr;
+  const bool mDeviceResident;
   cl_mem mPinnedMem;
+  // Device local memory used by kernels when device resident, with mPinnedMem as the host staging copy
+  cl_mem mDeviceMem;
   cl_mem mImageMem;
+  bool mImageAliased;
   void *mHostBuf;
   bool mGpuLocked;
   bool mHostMapped;
+  size_t mMapOffset;
+  size_t mMapBytes;
   eMemFlags mMapFlags;
   eMemLatest mMemLatest;
+  eDevLatest mDevLatest;
+  // Byte ranges of the buffer already copied back while the image holds the latest data
+  std::vector<std::pair<size_t, size_t> > mSyncedRanges;
 
-  cl_command_queue getCommandQueue(uint32_t queueNum) {
-    uint32_t q = queueNum;
-    if (queueNum >= (uint32_t)mCommandQueues.size()) {
-      printf("Invalid queue \'%d\', defaulting to 0\n", queueNum);
-      q = 0;
-    }
-    return mCommandQueues.at(q);
-  }
-
-  cl_int unmapMem(uint32_t queueNum) {
+  cl_int unmapMem(uint32_t queueNum, clEvents &events) {
     cl_int error = CL_SUCCESS;
     if (mHostMapped) {
+      void *mappedPtr = (uint8_t *)mHostBuf + mMapOffset;
       if (eSvmType::NONE == mSvmType)
-        error = clEnqueueUnmapMemObject(getCommandQueue(queueNum), mPinnedMem, mHostBuf, 0, nullptr, nullptr);
+        error = clEnqueueUnmapMemObject(getCommandQueue(queueNum), mPinnedMem, mappedPtr, events.numWaits(), events.waitList(), events.record("unmap"));
       else if (eSvmType::COARSE == mSvmType)
-        error = clEnqueueSVMUnmap(getCommandQueue(queueNum), mHostBuf, 0, 0, nullptr);
+        error = clEnqueueSVMUnmap(getCommandQueue(queueNum), mappedPtr, events.numWaits(), events.waitList(), events.record("svmUnmap"));
       mHostMapped = false;
+      mMapOffset = 0;
+      mMapBytes = 0;
       mMapFlags = eMemFlags::NONE;
     }
     return error;
   }
 
-  cl_int copyImageToBuffer(uint32_t queueNum) {
+  // Buffer used on the device by kernels, images and transfers
+  cl_mem gpuBuffer() const { return mDeviceMem ? mDeviceMem : mPinnedMem; }
+
+  cl_int syncToDevice(uint32_t queueNum, clEvents &events) {
+    cl_int error = CL_SUCCESS;
+    if (mDeviceResident && (eDevLatest::STAGING == mDevLatest)) {
+      error = unmapMem(queueNum, events);
+      PASS_CL_ERROR;
+      error = clEnqueueCopyBuffer(getCommandQueue(queueNum), mPinnedMem, mDeviceMem, 0, 0, mNumBytes, events.numWaits(), events.waitList(), events.record("stagingToDevice"));
+      PASS_CL_ERROR;
+      mDevLatest = eDevLatest::SAME;
+    }
+    return error;
+  }
+
+  // Must be called with the staging buffer unmapped
+  cl_int syncToStaging(uint32_t queueNum, clEvents &events, size_t offset, size_t numBytes) {
+    cl_int error = CL_SUCCESS;
+    if (mDeviceResident && (eDevLatest::DEVICE == mDevLatest)) {
+      error = clEnqueueCopyBuffer(getCommandQueue(queueNum), mDeviceMem, mPinnedMem, offset, offset, numBytes, events.numWaits(), events.waitList(), events.record("deviceToStaging"));
+      PASS_CL_ERROR;
+      if (numBytes == mNumBytes)
+        mDevLatest = eDevLatest::SAME;
+    }
+    return error;
+  }
+
+  // Images can share the memory of the buffer on OpenCL 2.0 devices when the buffer is large
+  // enough and its start and the rows of the image meet the device alignment requirements
+  bool canAliasImage(const cl_image_desc& imageDesc) const {
+    if ((CL_MEM_OBJECT_IMAGE2D != imageDesc.image_type) || (0 == mDevInfo->imagePitchAlignment))
+      return false;
+    size_t pixelBytes = imagePixelBytes(mImageFormat);
+    size_t rowPitch = imageDesc.image_width * pixelBytes;
+    if ((0 == pixelBytes) || (0 != rowPitch % (mDevInfo->imagePitchAlignment * pixelBytes)) ||
+        (rowPitch * imageDesc.image_height > mNumBytes))
+      return false;
+
+    size_t baseBytes = std::max<size_t>(mDevInfo->imageBaseAlignment, 1) * pixelBytes;
+    size_t offset = 0; // set for sub-buffers of an arena
+    if (CL_SUCCESS != clGetMemObjectInfo(gpuBuffer(), CL_MEM_OFFSET, sizeof(offset), &offset, nullptr))
+      return false;
+    bool hostPtr = !mDeviceResident && (mWrapPtr || (eSvmType::NONE != mSvmType));
+    return (0 == offset % baseBytes) && !(hostPtr && ((uintptr_t)mHostBuf % baseBytes));
+  }
+
+  // Copies the image rows holding numBytes from offset, or the whole image if numBytes is zero
+  cl_int copyImageToBuffer(uint32_t queueNum, clEvents &events, size_t offset = 0, size_t numBytes = 0) {
     cl_int error = CL_SUCCESS;
     if (mImageMem) {
-      const size_t origin[3] = { 0, 0, 0 };
+      size_t origin[3] = { 0, 0, 0 };
       size_t region[3] = { 1, 1, 1 };
       error = clGetImageInfo(mImageMem, CL_IMAGE_WIDTH, sizeof(size_t), &region[0], NULL);
       PASS_CL_ERROR;
@@ -267,27 +463,52 @@ private:
       PASS_CL_ERROR;
       if (depth) region[2] = depth;
 
+      size_t dstOffset = 0;
+      size_t rowBytes = region[0] * imagePixelBytes(mImageFormat);
+      bool partial = (numBytes > 0) && (region[2] == 1) && (rowBytes > 0);
+      if (partial) {
+        // whole rows are copied as the rows of the buffer are contiguous
+        size_t firstRow = offset / rowBytes;
+        size_t endRow = (offset + numBytes + rowBytes - 1) / rowBytes;
+        dstOffset = firstRow * rowBytes;
+        if (rangeSynced(dstOffset, (endRow - firstRow) * rowBytes))
+          return error;
+        origin[1] = firstRow;
+        region[1] = endRow - firstRow;
+      }
+
       // printf("Copying image memory to buffer size %zdx%zd\n", region[0], region[1]);
-      error = clEnqueueCopyImageToBuffer(getCommandQueue(queueNum), mImageMem, mPinnedMem, origin, region, 0, 0, nullptr, nullptr);
+      error = clEnqueueCopyImageToBuffer(getCommandQueue(queueNum), mImageMem, gpuBuffer(), origin, region, dstOffset, events.numWaits(), events.waitList(), events.record("imageToBuffer"));
       PASS_CL_ERROR;
-      mMemLatest = eMemLatest::SAME;
+      if (mDeviceResident)
+        mDevLatest = eDevLatest::DEVICE;
+      if (partial && (region[1] * rowBytes < mNumBytes))
+        mSyncedRanges.push_back(std::make_pair(dstOffset, dstOffset + region[1] * rowBytes));
+      else {
+        mMemLatest = eMemLatest::SAME;
+        mSyncedRanges.clear();
+      }
     }
     return error;
   }
 
+  bool rangeSynced(size_t offset, size_t numBytes) const {
+    if (eMemLatest::IMAGE != mMemLatest) return true;
+    for (auto& r: mSyncedRanges)
+      if ((r.first <= offset) && (offset + numBytes <= r.second)) return true;
+    return false;
+  }
+
   cl_int getKernelMem(iRunParams *runParams, bool isImageParam,
-                      iKernelArg::eAccess access, bool &isSVM, void *&kernelMem, uint32_t queueNum) {
-    kernelMem = mImageMem ? &mImageMem : &mPinnedMem;
+                      iKernelArg::eAccess access, bool &isSVM, void *&kernelMem, uint32_t queueNum, clEvents &events) {
+    kernelMem = mImageMem ? &mImageMem : mDeviceMem ? &mDeviceMem : &mPinnedMem;
     const size_t origin[3] = { 0, 0, 0 };
     cl_int error = CL_SUCCESS;
 
     if (isImageParam) {
       if (!mImageMem) {
         // create new image object
-        cl_image_format clImageFormat;
-        memset(&clImageFormat, 0, sizeof(clImageFormat));
-        clImageFormat.image_channel_order = CL_RGBA;
-        clImageFormat.image_channel_data_type = CL_FLOAT;
+        cl_image_format clImageFormat = mImageFormat;
 
         cl_image_desc clImageDesc;
         memset(&clImageDesc, 0, sizeof(clImageDesc));
@@ -295,37 +516,58 @@ private:
         clImageDesc.image_width = mImageDims[0];
         clImageDesc.image_height = runParams->numDims() > 1 ? mImageDims[1] : 1;
         clImageDesc.image_depth = runParams->numDims() > 2 ? mImageDims[2] : 1;
-        // if (mDevInfo->oclVer >= clVersion(2,0))
-        //   clImageDesc.mem_object = mPinnedMem;
 
         cl_mem_flags clMemFlags = (eMemFlags::READONLY == mMemFlags) ? CL_MEM_READ_ONLY :
                                   (eMemFlags::WRITEONLY == mMemFlags) ? CL_MEM_WRITE_ONLY :
                                   CL_MEM_READ_WRITE;
-        mImageMem = clCreateImage(mContext, clMemFlags | CL_MEM_HOST_NO_ACCESS, &clImageFormat, &clImageDesc, nullptr, &error);
-        PASS_CL_ERROR;
+        if (canAliasImage(clImageDesc)) {
+          // a 2D image over the buffer shares its memory so no copies are needed
+          clImageDesc.mem_object = gpuBuffer();
+          mImageMem = clCreateImage(mContext, clMemFlags, &clImageFormat, &clImageDesc, nullptr, &error);
+          mImageAliased = CL_SUCCESS == error;
+          if (!mImageAliased) {
+            printf("Failed to create image over buffer (%s) - using a copy.\n", clGetErrorString(error));
+            clImageDesc.mem_object = nullptr;
+          }
+        }
+        if (!mImageMem) {
+          mImageMem = clCreateImage(mContext, clMemFlags | CL_MEM_HOST_NO_ACCESS, &clImageFormat, &clImageDesc, nullptr, &error);
+          PASS_CL_ERROR;
+        }
 
         kernelMem = &mImageMem;
       }
 
-      // if (mDevInfo->oclVer < clVersion(2,0)) {
-        if (iKernelArg::eAccess::WRITEONLY == access)
+      if (mImageAliased) {
+        error = updateDeviceMem(access, queueNum, events);
+        PASS_CL_ERROR;
+      } else {
+        if (iKernelArg::eAccess::WRITEONLY == access) {
           mMemLatest = eMemLatest::IMAGE;
+          mSyncedRanges.clear();
+        }
         else if (eMemLatest::BUFFER == mMemLatest) {
           // printf("Copying image memory from buffer size %dx%d\n", mImageDims[0], mImageDims[1]);
           size_t region[3] = { 1, 1, 1 };
           for (size_t i = 0; i < runParams->numDims(); ++i)
             region[i] = mImageDims[i];
-          error = clEnqueueCopyBufferToImage(getCommandQueue(queueNum), mPinnedMem, mImageMem, 0, origin, region, 0, nullptr, nullptr);
+          error = syncToDevice(queueNum, events);
+          PASS_CL_ERROR;
+          error = clEnqueueCopyBufferToImage(getCommandQueue(queueNum), gpuBuffer(), mImageMem, 0, origin, region, events.numWaits(), events.waitList(), events.record("bufferToImage"));
           PASS_CL_ERROR;
         }
-      // }
+      }
     } else if (mImageMem) {
       // copy back from image if required, leave image allocation allocated
-      if (/*(mDevInfo->oclVer < clVersion(2,0)) &&*/ (eMemLatest::IMAGE == mMemLatest)) {
-        error = copyImageToBuffer(queueNum);
+      if (!mImageAliased && (eMemLatest::IMAGE == mMemLatest)) {
+        error = copyImageToBuffer(queueNum, events);
         PASS_CL_ERROR;
       }
-      kernelMem = &mPinnedMem;
+      kernelMem = mDeviceMem ? &mDeviceMem : &mPinnedMem;
+    }
+    if (!isImageParam) {
+      error = updateDeviceMem(access, queueNum, events);
+      PASS_CL_ERROR;
     }
 
     isSVM = (eSvmType::NONE != mSvmType) && !isImageParam;
@@ -335,12 +577,70 @@ private:
     return error;
   }
 
+  // Brings device memory up to date for a kernel unless it only writes, then records whether the kernel
+  // leaves the device with the latest data. Buffer parameters have no access qualifier so use the buffer direction.
+  cl_int updateDeviceMem(iKernelArg::eAccess access, uint32_t queueNum, clEvents &events) {
+    cl_int error = CL_SUCCESS;
+    if (!mDeviceResident) return error;
+    if (iKernelArg::eAccess::NONE == access)
+      access = (eMemFlags::READONLY == mMemFlags) ? iKernelArg::eAccess::READONLY :
+               (eMemFlags::WRITEONLY == mMemFlags) ? iKernelArg::eAccess::WRITEONLY :
+               iKernelArg::eAccess::NONE;
+    if (iKernelArg::eAccess::WRITEONLY != access) {
+      error = syncToDevice(queueNum, events);
+      PASS_CL_ERROR;
+    }
+    if (iKernelArg::eAccess::READONLY != access)
+      mDevLatest = eDevLatest::DEVICE;
+    return error;
+  }
+
   void onGpuReturn() {
     mGpuLocked = false;
   }
 };
 
 iClMemory *iClMemory::create(cl_context context, std::vector<cl_command_queue> commandQueues, eMemFlags memFlags, eSvmType svmType,
-                             uint32_t numBytes, deviceInfo *devInfo, const std::array<uint32_t, 3>& imageDims) {
-  return new clMemory(context, commandQueues, memFlags, svmType, numBytes, devInfo, imageDims);
+                             size_t numBytes, deviceInfo *devInfo, const std::array<uint32_t, 3>& imageDims,
+                             const cl_image_format& imageFormat, std::shared_ptr<clArena> arena, bool deviceResident) {
+  return new clMemory(context, commandQueues, memFlags, svmType, numBytes, devInfo, imageDims, imageFormat, arena, deviceResident);
+}
+
+iClMemory *iClMemory::wrap(cl_context context, std::vector<cl_command_queue> commandQueues, eMemFlags memFlags, eSvmType svmType,
+                           size_t numBytes, deviceInfo *devInfo, void *hostPtr) {
+  return new clMemory(context, commandQueues, memFlags, svmType, numBytes, devInfo, {0, 0, 0}, defaultImageFormat, nullptr, false, hostPtr);
+}
+
+size_t imagePixelBytes(const cl_image_format& imageFormat) {
+  size_t channels = (CL_R == imageFormat.image_channel_order) ? 1 :
+                    (CL_RG == imageFormat.image_channel_order) ? 2 : 4;
+  switch (imageFormat.image_channel_data_type) {
+  case CL_FLOAT: return channels * 4;
+  case CL_HALF_FLOAT:
+  case CL_UNORM_INT16: return channels * 2;
+  case CL_UNORM_INT8: return channels;
+  default: return 0;
+  }
+}
+
+cl_int checkImageFormat(cl_context context, eMemFlags memFlags, bool is3D,
+                        const cl_image_format& imageFormat, bool &supported) {
+  cl_mem_flags clMemFlags = (eMemFlags::READONLY == memFlags) ? CL_MEM_READ_ONLY :
+                            (eMemFlags::WRITEONLY == memFlags) ? CL_MEM_WRITE_ONLY :
+                            CL_MEM_READ_WRITE;
+  cl_mem_object_type imageType = is3D ? CL_MEM_OBJECT_IMAGE3D : CL_MEM_OBJECT_IMAGE2D;
+  supported = false;
+  cl_uint numFormats = 0;
+  cl_int error = clGetSupportedImageFormats(context, clMemFlags, imageType, 0, nullptr, &numFormats);
+  PASS_CL_ERROR;
+  std::vector<cl_image_format> formats(numFormats);
+  if (numFormats > 0) {
+    error = clGetSupportedImageFormats(context, clMemFlags, imageType, numFormats, formats.data(), nullptr);
+    PASS_CL_ERROR;
+  }
+  for (auto& f: formats)
+    if ((f.image_channel_order == imageFormat.image_channel_order) &&
+        (f.image_channel_data_type == imageFormat.image_channel_data_type))
+      supported = true;
+  return error;
 }
@@ -23,6 +23,8 @@
 #include <vector>
 #include <array>
 #include "run_params.h"
+#include "cl_events.h"
+#include "cl_arena.h"
 
 class iRunParams;
 struct deviceInfo;
@@ -34,7 +36,7 @@ class iGpuMemory {
 public:
   virtual ~iGpuMemory() {}
   virtual cl_int setKernelParam(cl_kernel kernel, uint32_t paramIndex, bool isImageParam,
-                                iKernelArg::eAccess access, iRunParams *runParams, uint32_t queueNum) = 0;
+                                iKernelArg::eAccess access, iRunParams *runParams, uint32_t queueNum, clEvents &events) = 0;
 };
 
 class iClMemory {
@@ -42,20 +44,45 @@ public:
   virtual ~iClMemory() {}
 
   static iClMemory *create(cl_context context, std::vector<cl_command_queue> commandQueues, eMemFlags memFlags, eSvmType svmType, 
-                           uint32_t numBytes, deviceInfo *devInfo, const std::array<uint32_t, 3>& imageDims);
+                           size_t numBytes, deviceInfo *devInfo, const std::array<uint32_t, 3>& imageDims,
+                           const cl_image_format& imageFormat, std::shared_ptr<clArena> arena = nullptr,
+                           bool deviceResident = false);
+  // Use existing host memory, that must outlive the returned object, for the buffer
+  static iClMemory *wrap(cl_context context, std::vector<cl_command_queue> commandQueues, eMemFlags memFlags, eSvmType svmType,
+                         size_t numBytes, deviceInfo *devInfo, void *hostPtr);
 
   virtual bool allocate() = 0;
   virtual std::shared_ptr<iGpuMemory> getGPUMemory() = 0;
-  virtual cl_int setHostAccess(eMemFlags haFlags, uint32_t queueNum) = 0;
-  virtual cl_int copyFrom(const void *srcBuf, size_t numBytes, uint32_t queueNum) = 0;
+  // Maps numBytes from offset for host access, or the whole buffer if numBytes is zero
+  virtual cl_int setHostAccess(eMemFlags haFlags, uint32_t queueNum, clEvents &events,
+                               size_t offset = 0, size_t numBytes = 0) = 0;
+  virtual cl_int copyFrom(const void *srcBuf, size_t numBytes, uint32_t queueNum, size_t offset = 0) = 0;
+  // Enqueue a non-blocking copy between host memory and numBytes of the buffer from offset,
+  // returning the event of the copy. The host memory must stay valid until the event completes.
+  virtual cl_int transfer(bool toBuffer, void *hostPtr, size_t offset, size_t numBytes,
+                          uint32_t queueNum, clEvents &events, cl_event *event) = 0;
+  // Byte range of the buffer holding a rectangle of the image rows, false if outside the image
+  virtual bool rectRange(const uint32_t origin[2], const uint32_t region[2], size_t &offset, size_t &numBytes) const = 0;
   virtual void freeAllocation() = 0;
 
-  virtual uint32_t numBytes() const = 0;
+  virtual size_t numBytes() const = 0;
   virtual eMemFlags memFlags() const = 0;
   virtual eSvmType svmType() const = 0;
   virtual std::string svmTypeName() const = 0;
   virtual void* hostBuf() const = 0;
   virtual bool hasDimensions() const = 0;
+  virtual uint32_t numQueues() const = 0;
+  virtual cl_command_queue getCommandQueue(uint32_t queueNum) = 0;
 };
 
+// Default format of images created for kernel image parameters
+const cl_image_format defaultImageFormat = { CL_RGBA, CL_FLOAT };
+
+// Number of bytes per pixel of an image format
+size_t imagePixelBytes(const cl_image_format& imageFormat);
+
+// Checks that the context supports images of a format for kernel access with the given flags
+cl_int checkImageFormat(cl_context context, eMemFlags memFlags, bool is3D,
+                        const cl_image_format& imageFormat, bool &supported);
+
 #endif
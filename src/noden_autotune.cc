@@ -0,0 +1,352 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "noden_autotune.h"
+#include "noden_context.h"
+#include "noden_cache.h"
+#include "noden_submit.h"
+#include "run_params.h"
+#include <sstream>
+
+cl_int autotuneCandidates(autotuneCarrier* c) {
+  cl_int error = CL_SUCCESS;
+  size_t multiple = 1;
+  error = clGetKernelWorkGroupInfo(c->kernel, c->deviceId, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+    sizeof(size_t), &multiple, nullptr);
+  PASS_CL_ERROR;
+  if (0 == multiple) multiple = 1;
+
+  cl_uint maxDims = 0;
+  error = clGetDeviceInfo(c->deviceId, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(cl_uint), &maxDims, nullptr);
+  PASS_CL_ERROR;
+  std::vector<size_t> maxItems(maxDims, 1);
+  error = clGetDeviceInfo(c->deviceId, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(size_t) * maxDims, maxItems.data(), nullptr);
+  PASS_CL_ERROR;
+
+  size_t numDims = c->runParams->numDims();
+  const size_t *global = c->runParams->globalWorkItems();
+  size_t maxGroup = c->runParams->kernelWorkGroupSize();
+  if ((0 == numDims) || (numDims > maxItems.size()))
+    return CL_INVALID_WORK_DIMENSION;
+
+  c->candidates.push_back(std::vector<size_t>());
+  for (size_t x = multiple; (x <= maxGroup) && (x <= maxItems[0]); x += multiple) {
+    if (0 != global[0] % x) continue;
+    if (1 == numDims) {
+      c->candidates.push_back(std::vector<size_t>(1, x));
+      continue;
+    }
+    // powers of two in the second dimension keep the number of 2D candidates small
+    for (size_t y = 1; (x * y <= maxGroup) && (y <= maxItems[1]); y *= 2) {
+      if (0 != global[1] % y) continue;
+      std::vector<size_t> candidate(numDims, 1);
+      candidate[0] = x;
+      candidate[1] = y;
+      c->candidates.push_back(candidate);
+    }
+  }
+
+  // always compare with the size the program was created with
+  std::vector<size_t> current;
+  std::shared_ptr<const std::vector<size_t>> programLocal = c->runParams->workItemsPerGroup();
+  if (programLocal)
+    current = *programLocal;
+  bool found = false;
+  for (auto& candidate: c->candidates)
+    found = found || (candidate == current);
+  if (!found)
+    c->candidates.push_back(current);
+  return error;
+}
+
+void autotuneExecute(napi_env env, void* data) {
+  autotuneCarrier* c = (autotuneCarrier*) data;
+  cl_int error = CL_SUCCESS;
+  HR_TIME_POINT start = NOW;
+
+  size_t numDims = c->runParams->numDims();
+  if (!c->tunePath.empty() && !c->force && readTuneFile(c->tunePath, c->best)) {
+    size_t groupSize = 1;
+    for (auto& wig: c->best)
+      groupSize *= wig;
+    c->fromCache = (c->best.empty() || (c->best.size() == numDims)) &&
+                   (groupSize <= c->runParams->kernelWorkGroupSize());
+    if (c->fromCache) {
+      c->totalTime = microTime(start);
+      return;
+    }
+    c->best.clear();
+  }
+
+  error = autotuneCandidates(c);
+  ASYNC_CL_ERROR;
+
+  cl_command_queue commandQueue = runQueue(c);
+  long long bestTime = -1;
+  for (size_t i = 0; i < c->candidates.size(); ++i) {
+    c->workItemsPerGroup = c->candidates[i];
+    c->nullWorkItemsPerGroup = c->candidates[i].empty();
+    long long candidateTime = -1;
+    // the first run is not timed so that one-off costs such as buffer copies are excluded
+    for (uint32_t r = 0; r <= c->iterations; ++r) {
+      HR_TIME_POINT runStart = NOW;
+      runEnqueue(c);
+      if (NODEN_SUCCESS == c->status)
+        c->status = clFinish(commandQueue);
+      if (NODEN_SUCCESS != c->status)
+        break;
+      long long runTime = microTime(runStart);
+      if ((r > 0) && ((candidateTime < 0) || (runTime < candidateTime)))
+        candidateTime = runTime;
+    }
+    if (NODEN_SUCCESS != c->status) {
+      // sizes the device rejects are skipped
+      c->status = NODEN_SUCCESS;
+      c->errorMsg.clear();
+      candidateTime = -1;
+    }
+    c->times.push_back(candidateTime);
+    if ((candidateTime >= 0) && ((bestTime < 0) || (candidateTime < bestTime))) {
+      bestTime = candidateTime;
+      c->bestIndex = i;
+    }
+  }
+
+  if (bestTime < 0) {
+    c->status = NODEN_OUT_OF_RANGE;
+    c->errorMsg = "Autotune failed to run the program with any of the candidate work group sizes.";
+    return;
+  }
+  c->best = c->candidates[c->bestIndex];
+  if (!c->tunePath.empty())
+    writeTuneFile(c->tunePath, c->best);
+
+  c->totalTime = microTime(start);
+}
+
+napi_status createDimsValue(napi_env env, const std::vector<size_t>& dims, size_t numDims, napi_value* result) {
+  napi_status status;
+  napi_value arrayBuffer;
+  uint32_t* data = nullptr;
+  status = napi_create_arraybuffer(env, numDims * sizeof(uint32_t), (void**)&data, &arrayBuffer);
+  PASS_STATUS;
+  for (size_t i = 0; i < numDims; ++i)
+    data[i] = dims.empty() ? 0 : (uint32_t)dims[i];
+  return napi_create_typedarray(env, napi_uint32_array, numDims, arrayBuffer, 0, result);
+}
+
+void autotuneComplete(napi_env env, napi_status asyncStatus, void* data) {
+  autotuneCarrier* c = (autotuneCarrier*) data;
+
+  if (asyncStatus != napi_ok) {
+    c->status = asyncStatus;
+    c->errorMsg = "Async autotune of program failed to complete.";
+  }
+  REJECT_STATUS;
+
+  // later runs of the program use the chosen size
+  c->runParams->setWorkItemsPerGroup(c->best);
+
+  size_t numDims = c->runParams->numDims();
+  napi_value result;
+  c->status = napi_create_object(env, &result);
+  REJECT_STATUS;
+
+  napi_value bestValue;
+  c->status = createDimsValue(env, c->best, numDims, &bestValue);
+  REJECT_STATUS;
+  c->status = napi_set_named_property(env, result, "workItemsPerGroup", bestValue);
+  REJECT_STATUS;
+
+  napi_value fromCacheValue;
+  c->status = napi_get_boolean(env, c->fromCache, &fromCacheValue);
+  REJECT_STATUS;
+  c->status = napi_set_named_property(env, result, "fromCache", fromCacheValue);
+  REJECT_STATUS;
+
+  napi_value timingsValue;
+  c->status = napi_create_array_with_length(env, c->candidates.size(), &timingsValue);
+  REJECT_STATUS;
+  for (uint32_t i = 0; i < (uint32_t)c->candidates.size(); ++i) {
+    napi_value timingValue;
+    c->status = napi_create_object(env, &timingValue);
+    REJECT_STATUS;
+    napi_value wigValue;
+    c->status = createDimsValue(env, c->candidates[i], numDims, &wigValue);
+    REJECT_STATUS;
+    c->status = napi_set_named_property(env, timingValue, "workItemsPerGroup", wigValue);
+    REJECT_STATUS;
+    napi_value timeValue;
+    if (c->times[i] >= 0)
+      c->status = napi_create_int64(env, c->times[i], &timeValue);
+    else
+      c->status = napi_get_null(env, &timeValue);
+    REJECT_STATUS;
+    c->status = napi_set_named_property(env, timingValue, "time", timeValue);
+    REJECT_STATUS;
+    c->status = napi_set_element(env, timingsValue, i, timingValue);
+    REJECT_STATUS;
+  }
+  c->status = napi_set_named_property(env, result, "timings", timingsValue);
+  REJECT_STATUS;
+
+  napi_value totalValue;
+  c->status = napi_create_int64(env, (int64_t) c->totalTime, &totalValue);
+  REJECT_STATUS;
+  c->status = napi_set_named_property(env, result, "totalTime", totalValue);
+  REJECT_STATUS;
+
+  napi_status status;
+  status = napi_resolve_deferred(env, c->_deferred, result);
+  FLOATING_STATUS;
+
+  tidyCarrier(env, c);
+}
+
+napi_status getTunePath(napi_env env, autotuneCarrier* c) {
+  const std::string& cacheDir = c->ctx->cacheDir;
+  if (cacheDir.empty())
+    return napi_ok;
+
+  size_t nameLength = 0;
+  cl_int error = clGetKernelInfo(c->kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr, &nameLength);
+  std::vector<char> name(nameLength + 1, '\0');
+  if (CL_SUCCESS == error)
+    error = clGetKernelInfo(c->kernel, CL_KERNEL_FUNCTION_NAME, nameLength, name.data(), nullptr);
+  if (CL_SUCCESS != error)
+    return napi_ok; // tune without storing the result
+
+  // programs built with different options or defines are tuned separately
+  cl_program program;
+  error = clGetKernelInfo(c->kernel, CL_KERNEL_PROGRAM, sizeof(cl_program), &program, nullptr);
+  size_t optionsLength = 0;
+  if (CL_SUCCESS == error)
+    error = clGetProgramBuildInfo(program, c->deviceId, CL_PROGRAM_BUILD_OPTIONS, 0, nullptr, &optionsLength);
+  std::vector<char> options(optionsLength + 1, '\0');
+  if (CL_SUCCESS == error)
+    error = clGetProgramBuildInfo(program, c->deviceId, CL_PROGRAM_BUILD_OPTIONS, optionsLength, options.data(), nullptr);
+  if (CL_SUCCESS != error)
+    return napi_ok;
+
+  std::stringstream ss;
+  ss << "autotune " << name.data() << " " << options.data();
+  for (size_t i = 0; i < c->runParams->numDims(); ++i)
+    ss << " " << c->runParams->globalWorkItems()[i];
+  uint64_t key = 0;
+  if (CL_SUCCESS == programCacheKey(c->deviceId, c->kernelSource, ss.str(), key))
+    c->tunePath = programCachePath(cacheDir, key, ".tune");
+  return napi_ok;
+}
+
+napi_value autotune(napi_env env, napi_callback_info info) {
+  napi_status status;
+  autotuneCarrier* c = new autotuneCarrier;
+
+  napi_value args[3];
+  size_t argc = 3;
+  napi_value programValue;
+  status = napi_get_cb_info(env, info, &argc, args, &programValue, nullptr);
+  CHECK_STATUS;
+
+  if (!((argc > 0) && (argc <= 3))) {
+    status = napi_throw_error(env, nullptr, "Wrong number of arguments. One to three expected.");
+    delete c;
+    return nullptr;
+  }
+
+  status = parseRun(env, programValue, args[0], c);
+  if (napi_pending_exception == status) {
+    delete c;
+    return nullptr;
+  }
+  CHECK_STATUS;
+  // only the total time of each run is measured
+  c->events.setProfiling(false);
+
+  if (argc > 1) {
+    status = parseQueueNum(env, args[1], (uint32_t)c->commandQueues.size(), &c->queueNum);
+    if (napi_pending_exception == status) {
+      delete c;
+      return nullptr;
+    }
+    CHECK_STATUS;
+  }
+
+  if (argc > 2) {
+    napi_valuetype t;
+    status = napi_typeof(env, args[2], &t);
+    CHECK_STATUS;
+    if (napi_object != t) {
+      status = napi_throw_type_error(env, nullptr, "Optional autotune options must be an object.");
+      delete c;
+      return nullptr;
+    }
+
+    napi_value iterationsValue;
+    status = napi_get_named_property(env, args[2], "iterations", &iterationsValue);
+    CHECK_STATUS;
+    status = napi_typeof(env, iterationsValue, &t);
+    CHECK_STATUS;
+    if (napi_number == t) {
+      status = napi_get_value_uint32(env, iterationsValue, &c->iterations);
+      CHECK_STATUS;
+      if (0 == c->iterations) {
+        status = napi_throw_range_error(env, nullptr, "Autotune iterations must be at least one.");
+        delete c;
+        return nullptr;
+      }
+    }
+
+    napi_value forceValue;
+    status = napi_get_named_property(env, args[2], "force", &forceValue);
+    CHECK_STATUS;
+    status = napi_typeof(env, forceValue, &t);
+    CHECK_STATUS;
+    if (napi_boolean == t) {
+      status = napi_get_value_bool(env, forceValue, &c->force);
+      CHECK_STATUS;
+    }
+  }
+
+  c->deviceId = c->ctx->deviceId;
+
+  napi_value sourceValue;
+  status = napi_get_named_property(env, programValue, "kernelSource", &sourceValue);
+  CHECK_STATUS;
+  size_t sourceLength;
+  status = napi_get_value_string_utf8(env, sourceValue, nullptr, 0, &sourceLength);
+  CHECK_STATUS;
+  c->kernelSource.resize(sourceLength + 1);
+  status = napi_get_value_string_utf8(env, sourceValue, &c->kernelSource[0], sourceLength + 1, nullptr);
+  CHECK_STATUS;
+  c->kernelSource.resize(sourceLength);
+
+  status = getTunePath(env, c);
+  CHECK_STATUS;
+
+  status = napi_create_reference(env, programValue, 1, &c->passthru);
+  CHECK_STATUS;
+
+  napi_value promise;
+  status = napi_create_promise(env, &c->_deferred, &promise);
+  CHECK_STATUS;
+
+  // timing waits for each run to finish so never runs on the JS thread
+  c->ctx->trackWork(c->queueNum, c);
+  status = queueWork(env, c->ctx->engine, c->queueNum, "Autotune", autotuneExecute, autotuneComplete, c);
+  CHECK_STATUS;
+
+  return promise;
+}
@@ -0,0 +1,48 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef NODEN_AUTOTUNE_H
+#define NODEN_AUTOTUNE_H
+
+#include "cl_include.h"
+#include <string>
+#include <vector>
+#include "node_api.h"
+#include "noden_util.h"
+#include "noden_run.h"
+
+// Runs a program with each candidate local size in turn and keeps the fastest
+// as the program's workItemsPerGroup. Candidates in the first dimension are all
+// multiples of the kernel's preferred work group size multiple within the device
+// limits that divide the global size, with powers of two in the second dimension,
+// plus the implementation's own choice. When the context has a
+// cacheDir the choice is stored, keyed by device, kernel source and name and
+// global size, so that later autotunes of the same program are not timed again.
+struct autotuneCarrier : runCarrier {
+  cl_device_id deviceId;
+  std::string kernelSource;
+  std::string tunePath;
+  uint32_t iterations = 5;
+  bool force = false;
+  bool fromCache = false;
+  std::vector<std::vector<size_t> > candidates; // empty for the implementation's choice
+  std::vector<long long> times; // best run time in microseconds of each candidate, negative if it failed
+  std::vector<size_t> best;
+  size_t bestIndex = 0;
+};
+
+napi_value autotune(napi_env env, napi_callback_info info);
+
+#endif
@@ -15,40 +15,239 @@
 
 #include "noden_buffer.h"
 #include "noden_util.h"
+#include "noden_context.h"
 #include "cl_memory.h"
+#include "noden_submit.h"
 #include <cstring>
 #include <vector>
 #include <sstream>
 
 struct deviceInfo;
 
+struct imageFormatName {
+  const char *name;
+  cl_uint value;
+};
+
+static const imageFormatName channelOrders[] = {
+  { "R", CL_R }, { "RG", CL_RG }, { "RGBA", CL_RGBA }, { "BGRA", CL_BGRA } };
+static const imageFormatName channelTypes[] = {
+  { "FLOAT", CL_FLOAT }, { "HALF_FLOAT", CL_HALF_FLOAT },
+  { "UNORM_INT8", CL_UNORM_INT8 }, { "UNORM_INT16", CL_UNORM_INT16 } };
+
+// Reads an optional image format property, returning false if it is present but not a known name
+template <size_t N>
+bool getImageFormatValue(napi_env env, napi_value dimsValue, const char *propName,
+  const imageFormatName (&names)[N], cl_uint &value) {
+  napi_status status;
+  bool hasProp = false;
+  status = napi_has_named_property(env, dimsValue, propName, &hasProp);
+  if ((napi_ok != status) || !hasProp) return napi_ok == status;
+  napi_value propValue;
+  status = napi_get_named_property(env, dimsValue, propName, &propValue);
+  if (napi_ok != status) return false;
+  char name[16];
+  status = napi_get_value_string_utf8(env, propValue, name, 16, nullptr);
+  if (napi_ok != status) return false;
+  for (size_t i = 0; i < N; ++i)
+    if (0 == strcmp(names[i].name, name)) {
+      value = names[i].value;
+      return true;
+    }
+  return false;
+}
+
 struct createBufCarrier : carrier {
+  contextState *ctx = nullptr;
   napi_ref contextRef = nullptr;
   iClMemory *clMem = nullptr;
-  uint32_t numQueues = 1;
+  napi_ref sourceRef = nullptr;
+  void *wrapPtr = nullptr; // host memory of a wrapped Node buffer
+  bool zeroCopy = false;
 };
 
+static const napi_type_tag bufferTag = { 0x6e6f64656e636c01ULL, 0x6275666665720001ULL };
+
+void finalizeBuffer(napi_env env, void* data, void* hint) {
+  bufferState *buf = (bufferState*)data;
+  printf("Finalizing OpenCL memory of type %s, size %zd.\n", buf->clMem->svmTypeName().c_str(), buf->clMem->numBytes());
+  delete buf->clMem;
+  napi_status status;
+  // the wrapped Node buffer can be collected once the OpenCL memory no longer uses it
+  if (buf->sourceRef) {
+    status = napi_delete_reference(env, buf->sourceRef);
+    checkStatus(env, status, __FILE__, __LINE__ - 1);
+  }
+  status = napi_delete_reference(env, buf->contextRef);
+  checkStatus(env, status, __FILE__, __LINE__ - 1);
+  delete buf;
+}
+
+napi_status getBufferState(napi_env env, napi_value bufferValue, bufferState **state) {
+  return unwrapState(env, bufferValue, &bufferTag, "an OpenCL buffer", (void**)state);
+}
+
 struct hostAccessCarrier : carrier {
   iClMemory *clMem = nullptr;
   eMemFlags haFlags = eMemFlags::READWRITE;
   uint32_t queueNum = 0;
   void* srcBuf = nullptr;
   size_t srcBufSize = 0;
+  size_t offset = 0;
+  size_t numBytes = 0; // zero for the whole buffer
+  clEvents events;
 };
 
+// Reads an optional host access range, either { offset, length } in bytes or
+// { origin: [x, y], region: [width, height] } in pixels of the image dimensions
+napi_status getRangeOptions(napi_env env, napi_value options, hostAccessCarrier *c) {
+  napi_status status;
+  napi_valuetype t;
+  status = napi_typeof(env, options, &t);
+  PASS_STATUS;
+  if (napi_object != t)
+    return napi_ok;
+
+  napi_value offsetValue, lengthValue, originValue, regionValue;
+  napi_valuetype offsetType, lengthType, originType, regionType;
+  status = napi_get_named_property(env, options, "offset", &offsetValue);
+  PASS_STATUS;
+  status = napi_typeof(env, offsetValue, &offsetType);
+  PASS_STATUS;
+  status = napi_get_named_property(env, options, "length", &lengthValue);
+  PASS_STATUS;
+  status = napi_typeof(env, lengthValue, &lengthType);
+  PASS_STATUS;
+  status = napi_get_named_property(env, options, "origin", &originValue);
+  PASS_STATUS;
+  status = napi_typeof(env, originValue, &originType);
+  PASS_STATUS;
+  status = napi_get_named_property(env, options, "region", &regionValue);
+  PASS_STATUS;
+  status = napi_typeof(env, regionValue, &regionType);
+  PASS_STATUS;
+
+  size_t bufBytes = c->clMem->numBytes();
+  if ((napi_undefined != originType) || (napi_undefined != regionType)) {
+    uint32_t rect[2][2];
+    napi_value rectValues[2] = { originValue, regionValue };
+    for (int r = 0; r < 2; ++r) {
+      bool isArray = false;
+      uint32_t arrayLen = 0;
+      status = napi_is_array(env, rectValues[r], &isArray);
+      PASS_STATUS;
+      if (isArray) {
+        status = napi_get_array_length(env, rectValues[r], &arrayLen);
+        PASS_STATUS;
+      }
+      if (2 != arrayLen) {
+        napi_throw_type_error(env, nullptr, "Host access origin and region must both be arrays of two numbers.");
+        return napi_pending_exception;
+      }
+      for (uint32_t i = 0; i < 2; ++i) {
+        napi_value element;
+        status = napi_get_element(env, rectValues[r], i, &element);
+        PASS_STATUS;
+        status = napi_get_value_uint32(env, element, &rect[r][i]);
+        if (napi_number_expected == status) {
+          napi_throw_type_error(env, nullptr, "Host access origin and region must both be arrays of two numbers.");
+          return napi_pending_exception;
+        }
+        PASS_STATUS;
+      }
+    }
+    if (!c->clMem->rectRange(rect[0], rect[1], c->offset, c->numBytes)) {
+      napi_throw_range_error(env, nullptr, "Host access region must be within the image dimensions of the buffer.");
+      return napi_pending_exception;
+    }
+  } else if ((napi_undefined != offsetType) || (napi_undefined != lengthType)) {
+    int64_t offset = 0;
+    int64_t length = 0;
+    if (((napi_undefined != offsetType) && (napi_number != offsetType)) ||
+        ((napi_undefined != lengthType) && (napi_number != lengthType))) {
+      napi_throw_type_error(env, nullptr, "Host access offset and length must be numbers.");
+      return napi_pending_exception;
+    }
+    if (napi_number == offsetType) {
+      status = napi_get_value_int64(env, offsetValue, &offset);
+      PASS_STATUS;
+    }
+    if (napi_number == lengthType) {
+      status = napi_get_value_int64(env, lengthValue, &length);
+      PASS_STATUS;
+    } else
+      length = (int64_t)bufBytes - offset;
+    if ((offset < 0) || (length <= 0) || (offset + length > (int64_t)bufBytes)) {
+      napi_throw_range_error(env, nullptr, "Host access offset and length must be within the buffer.");
+      return napi_pending_exception;
+    }
+    c->offset = (size_t)offset;
+    c->numBytes = (size_t)length;
+  }
+  return napi_ok;
+}
+
 void hostAccessExecute(napi_env env, void* data) {
   hostAccessCarrier* c = (hostAccessCarrier*) data;
   cl_int error;
 
-  error = c->clMem->setHostAccess(c->haFlags, c->queueNum);
+  error = c->clMem->setHostAccess(c->haFlags, c->queueNum, c->events, c->offset, c->numBytes);
   ASYNC_CL_ERROR;
 
+  if (c->clMem->numQueues() > 1) {
+    error = c->events.markCompletion(c->clMem->getCommandQueue(c->queueNum), c->inFlight);
+    ASYNC_CL_ERROR;
+  } else if (c->events.numWaits() > 0) {
+    // host access must not be given before the work it waits for is complete
+    error = clWaitForEvents(c->events.numWaits(), c->events.waitList());
+    ASYNC_CL_ERROR;
+  }
+
+  if (c->events.profiling()) {
+    error = c->events.wait();
+    ASYNC_CL_ERROR;
+  }
+
   if (c->srcBuf) {
-    error = c->clMem->copyFrom(c->srcBuf, c->srcBufSize, c->queueNum);
+    // the host copies the source data so must wait for any map that waits on other work
+    if (c->events.completion() && (c->events.numWaits() > 0)) {
+      cl_event completion = c->events.completion();
+      error = clWaitForEvents(1, &completion);
+      ASYNC_CL_ERROR;
+    }
+    error = c->clMem->copyFrom(c->srcBuf, c->srcBufSize, c->queueNum, c->offset);
     ASYNC_CL_ERROR;
   }
 }
 
+// Host access resolves to undefined unless there is a profile or completion event to report
+napi_status hostAccessResult(napi_env env, hostAccessCarrier* c, napi_value* result) {
+  napi_status status;
+  cl_event completion = c->events.takeCompletion();
+  if (c->events.profiling() || completion) {
+    status = napi_create_object(env, result);
+    PASS_STATUS;
+  } else
+    return napi_get_undefined(env, result);
+
+  if (c->events.profiling()) {
+    napi_value profileValue;
+    status = c->events.profile(env, &profileValue);
+    PASS_STATUS;
+    status = napi_set_named_property(env, *result, "profile", profileValue);
+    PASS_STATUS;
+  }
+
+  if (completion) {
+    napi_value eventValue;
+    status = createEventHandle(env, completion, &eventValue);
+    PASS_STATUS;
+    status = napi_set_named_property(env, *result, "event", eventValue);
+    PASS_STATUS;
+  }
+  return napi_ok;
+}
+
 void hostAccessComplete(napi_env env, napi_status asyncStatus, void* data) {
   hostAccessCarrier* c = (hostAccessCarrier*) data;
   if (asyncStatus != napi_ok) {
@@ -58,7 +257,7 @@ void hostAccessComplete(napi_env env, napi_status asyncStatus, void* data) {
   REJECT_STATUS;
 
   napi_value result;
-  c->status = napi_get_undefined(env, &result);
+  c->status = hostAccessResult(env, c, &result);
   REJECT_STATUS;
 
   napi_status status;
@@ -68,44 +267,63 @@ void hostAccessComplete(napi_env env, napi_status asyncStatus, void* data) {
   tidyCarrier(env, c);
 }
 
-napi_value hostAccess(napi_env env, napi_callback_info info) {
+// Fill a host access carrier from the arguments of hostAccess or hostAccessSync - the
+// direction, an optional queue number, source buffer and options, that are returned
+napi_status parseHostAccess(napi_env env, napi_callback_info info, hostAccessCarrier* c,
+  bufferState** buf, napi_value* optionsValue) {
   napi_status status;
-  hostAccessCarrier* c = new hostAccessCarrier;
-
-  napi_value args[3];
-  size_t argc = 3;
+  napi_value args[4];
+  size_t argc = 4;
   napi_value bufferValue;
   status = napi_get_cb_info(env, info, &argc, args, &bufferValue, nullptr);
-  CHECK_STATUS;
+  PASS_STATUS;
 
-  if (argc > 3) {
-    status = napi_throw_error(env, nullptr, "Wrong number of arguments to hostAccess.");
-    delete c;
-    return nullptr;
+  if (argc > 4) {
+    napi_throw_error(env, nullptr, "Wrong number of arguments to hostAccess.");
+    return napi_pending_exception;
   }
 
+  status = getBufferState(env, bufferValue, buf);
+  PASS_STATUS;
+  c->clMem = (*buf)->clMem;
+  c->events.setProfiling((*buf)->ctx->profiling);
+
   napi_valuetype t;
+  // an options object, if any, is the last argument - it follows the queue number unless it is a range
+  *optionsValue = nullptr;
+  if (argc > 1) {
+    bool isBuffer = false;
+    status = napi_is_buffer(env, args[argc-1], &isBuffer);
+    PASS_STATUS;
+    status = napi_typeof(env, args[argc-1], &t);
+    PASS_STATUS;
+    if (!isBuffer && ((argc > 2) || (napi_object == t))) {
+      *optionsValue = args[argc-1];
+      status = getEventOptions(env, args[argc-1], c->events);
+      PASS_STATUS;
+      --argc;
+    }
+  }
+
   napi_value hostDirValue;
   if (argc > 0) {
     status = napi_typeof(env, args[0], &t);
-    CHECK_STATUS;
+    PASS_STATUS;
     if (t != napi_string) {
-      status = napi_throw_type_error(env, nullptr, "First argument must be a string.");
-      delete c;
-      return nullptr;
+      napi_throw_type_error(env, nullptr, "First argument must be a string.");
+      return napi_pending_exception;
     }
     hostDirValue = args[0];
   } else {
     status = napi_create_string_utf8(env, "readwrite", 10, &hostDirValue);
-    CHECK_STATUS;
+    PASS_STATUS;
   }
   char haflag[10];
   status = napi_get_value_string_utf8(env, hostDirValue, haflag, 10, nullptr);
-  CHECK_STATUS;
+  PASS_STATUS;
   if ((strcmp(haflag, "readwrite") != 0) && (strcmp(haflag, "writeonly") != 0) && (strcmp(haflag, "readonly") != 0) && (strcmp(haflag, "none") != 0)) {
-    status = napi_throw_error(env, nullptr, "Host access direction must be one of 'none', 'readwrite', 'writeonly' or 'readonly'.");
-    delete c;
-    return nullptr;
+    napi_throw_error(env, nullptr, "Host access direction must be one of 'none', 'readwrite', 'writeonly' or 'readonly'.");
+    return napi_pending_exception;
   }
   c->haFlags = (0==strcmp("readwrite", haflag)) ? eMemFlags::READWRITE :
                (0==strcmp("writeonly", haflag)) ? eMemFlags::WRITEONLY :
@@ -118,26 +336,18 @@ napi_value hostAccess(napi_env env, napi_callback_info info) {
     napi_value srcBufVal = nullptr;
     napi_valuetype t;
     status = napi_typeof(env, args[1], &t);
-    CHECK_STATUS;
+    PASS_STATUS;
     if (t == napi_number) {
       int32_t checkValue;
       status = napi_get_value_int32(env, args[1], &checkValue);
-      CHECK_STATUS;
+      PASS_STATUS;
 
-      napi_value numQueuesValue;
-      uint32_t numQueues = 1;
-      status = napi_get_named_property(env, bufferValue, "numQueues", &numQueuesValue);
-      CHECK_STATUS;
-      status = napi_get_value_uint32(env, numQueuesValue, &numQueues);
-      CHECK_STATUS;
-
-      if (!((checkValue >= 0) && (checkValue < (int32_t)numQueues))) {
-        status = napi_throw_range_error(env, nullptr, "Optional parameter queueNum out of range.");
-        delete c;
-        return nullptr;
+      if (!((checkValue >= 0) && ((uint32_t)checkValue < c->clMem->numQueues()))) {
+        napi_throw_range_error(env, nullptr, "Optional parameter queueNum out of range.");
+        return napi_pending_exception;
       }
       status = napi_get_value_uint32(env, args[1], &c->queueNum);
-      CHECK_STATUS;
+      PASS_STATUS;
 
       if (argc > 2) 
         srcBufVal = args[2];
@@ -150,65 +360,322 @@ napi_value hostAccess(napi_env env, napi_callback_info info) {
     if (srcBufVal) {
       bool isBuffer;
       status = napi_is_buffer(env, srcBufVal, &isBuffer);
-      CHECK_STATUS;
+      PASS_STATUS;
       if (!isBuffer) {
         napi_throw_type_error(env, nullptr, "Optional third argument must be a buffer - the source data.");
-        delete c;
-        return nullptr;
+        return napi_pending_exception;
       }
 
       status = napi_get_buffer_info(env, srcBufVal, &data, &dataSize);
-      CHECK_STATUS;
+      PASS_STATUS;
     }
   }
 
   if (dataSize && (c->haFlags == eMemFlags::READONLY)) {
     napi_throw_type_error(env, nullptr, "Optional third argument source buffer provided when access is readonly.");
-    delete c;
-    return nullptr;
+    return napi_pending_exception;
   }
 
-  napi_value clMemValue;
-  status = napi_get_named_property(env, bufferValue, "clMemory", &clMemValue);
-  CHECK_STATUS;
-  status = napi_get_value_external(env, clMemValue, (void**)&c->clMem);
-  CHECK_STATUS;
+  if (*optionsValue) {
+    status = getRangeOptions(env, *optionsValue, c);
+    PASS_STATUS;
+  }
 
   if (data) {
-    if (dataSize > c->clMem->numBytes()) {
+    size_t rangeBytes = c->numBytes ? c->numBytes : c->clMem->numBytes();
+    if (dataSize > rangeBytes) {
       printf("Source buffer is larger than requested OpenCL allocation - trimming.\n");
-      dataSize = c->clMem->numBytes();
+      dataSize = rangeBytes;
     }
     c->srcBuf = data;
     c->srcBufSize = dataSize;
   }
 
-  napi_value promise, resource_name;
+  return napi_ok;
+}
+
+// Queue a parsed host access, returning its promise
+napi_value queueHostAccess(napi_env env, bufferState* buf, hostAccessCarrier* c) {
+  napi_status status;
+  napi_value promise;
   status = napi_create_promise(env, &c->_deferred, &promise);
   CHECK_STATUS;
 
-  status = napi_create_string_utf8(env, "HostAccess", NAPI_AUTO_LENGTH, &resource_name);
+  buf->ctx->trackWork(c->queueNum, c);
+  status = queueWork(env, buf->ctx->engine, c->queueNum, "HostAccess", hostAccessExecute, hostAccessComplete, c);
+  CHECK_STATUS;
+
+  return promise;
+}
+
+napi_value hostAccess(napi_env env, napi_callback_info info) {
+  napi_status status;
+  hostAccessCarrier* c = new hostAccessCarrier;
+
+  bufferState *buf;
+  napi_value optionsValue;
+  status = parseHostAccess(env, info, c, &buf, &optionsValue);
+  if (napi_pending_exception == status) {
+    delete c;
+    return nullptr;
+  }
+  CHECK_STATUS;
+
+  return queueHostAccess(env, buf, c);
+}
+
+// Host access to a small range of a buffer on an idle queue is given on the JS thread,
+// returning the result directly. Other host access is queued as for hostAccess.
+napi_value hostAccessSync(napi_env env, napi_callback_info info) {
+  napi_status status;
+  hostAccessCarrier* c = new hostAccessCarrier;
+
+  bufferState *buf;
+  napi_value optionsValue;
+  status = parseHostAccess(env, info, c, &buf, &optionsValue);
+  uint32_t syncBytes = NODEN_SYNC_BYTES;
+  if (napi_ok == status)
+    status = getSyncLimit(env, optionsValue, "syncBytes", &syncBytes);
+  if (napi_pending_exception == status) {
+    delete c;
+    return nullptr;
+  }
   CHECK_STATUS;
-  status = napi_create_async_work(env, NULL, resource_name, hostAccessExecute,
-    hostAccessComplete, c, &c->_request);
+
+  // waiting for other work, or for a busy queue, would block the JS thread
+  size_t rangeBytes = c->numBytes ? c->numBytes : c->clMem->numBytes();
+  if (!buf->ctx->queueIdle(c->queueNum) || (c->events.numWaits() > 0) || (rangeBytes > syncBytes))
+    return queueHostAccess(env, buf, c);
+
+  hostAccessExecute(env, c);
+  if ((NODEN_SUCCESS == c->status) && c->events.completion()) {
+    // with several queues the access is only marked, so wait for it before returning
+    cl_event completion = c->events.completion();
+    cl_int error = clWaitForEvents(1, &completion);
+    if (CL_SUCCESS != error) {
+      c->status = error;
+      c->errorMsg = "Failed to wait for host access to complete.";
+    }
+  }
+  THROW_STATUS;
+
+  napi_value result;
+  status = hostAccessResult(env, c, &result);
+  delete c;
   CHECK_STATUS;
-  status = napi_queue_async_work(env, c->_request);
+  return result;
+}
+
+struct transferCarrier : carrier {
+  ~transferCarrier() {
+    if (transfer) clReleaseEvent(transfer);
+  }
+  iClMemory *clMem = nullptr;
+  bool toBuffer = true;
+  void *hostPtr = nullptr;
+  size_t offset = 0;
+  size_t numBytes = 0;
+  uint32_t queueNum = 0;
+  bool eventCompletion = false;
+  clEvents events;
+  cl_event transfer = nullptr;
+};
+
+void transferExecute(napi_env env, void* data) {
+  transferCarrier* c = (transferCarrier*) data;
+  cl_int error;
+
+  error = c->clMem->transfer(c->toBuffer, c->hostPtr, c->offset, c->numBytes, c->queueNum, c->events, &c->transfer);
+  ASYNC_CL_ERROR;
+  error = clFlush(c->clMem->getCommandQueue(c->queueNum));
+  ASYNC_CL_ERROR;
+
+  if (!c->eventCompletion) {
+    // the host memory must not be released or reused until the copy is complete
+    error = clWaitForEvents(1, &c->transfer);
+    ASYNC_CL_ERROR;
+
+    if (c->events.profiling()) {
+      error = c->events.wait();
+      ASYNC_CL_ERROR;
+    }
+  }
+}
+
+void transferComplete(napi_env env, napi_status asyncStatus, void* data) {
+  transferCarrier* c = (transferCarrier*) data;
+  if (asyncStatus != napi_ok) {
+    c->status = asyncStatus;
+    c->errorMsg = "Async buffer transfer failed to complete.";
+  }
+  REJECT_STATUS;
+
+  napi_value result;
+  c->status = napi_create_object(env, &result);
+  REJECT_STATUS;
+
+  if (c->events.profiling()) {
+    napi_value profileValue;
+    c->status = c->events.profile(env, &profileValue);
+    REJECT_STATUS;
+    c->status = napi_set_named_property(env, result, "profile", profileValue);
+    REJECT_STATUS;
+  }
+
+  napi_value eventValue;
+  c->status = createEventHandle(env, c->transfer, &eventValue);
+  REJECT_STATUS;
+  c->transfer = nullptr;
+  c->status = napi_set_named_property(env, result, "event", eventValue);
+  REJECT_STATUS;
+
+  napi_status status;
+  status = napi_resolve_deferred(env, c->_deferred, result);
+  FLOATING_STATUS;
+
+  tidyCarrier(env, c);
+}
+
+// Shared by writeFrom and readInto - arguments are a Node buffer and an optional
+// options object with offset, queueNum and waitFor properties
+napi_value transfer(napi_env env, napi_callback_info info, bool toBuffer) {
+  napi_status status;
+  transferCarrier* c = new transferCarrier;
+  c->toBuffer = toBuffer;
+
+  napi_value args[2];
+  size_t argc = 2;
+  napi_value bufferValue;
+  status = napi_get_cb_info(env, info, &argc, args, &bufferValue, nullptr);
   CHECK_STATUS;
 
+  if (argc < 1) {
+    status = napi_throw_error(env, nullptr, "Wrong number of arguments to buffer transfer.");
+    delete c;
+    return nullptr;
+  }
+
+  bool isBuffer = false;
+  status = napi_is_buffer(env, args[0], &isBuffer);
+  CHECK_STATUS;
+  if (!isBuffer) {
+    status = napi_throw_type_error(env, nullptr, "First argument must be a buffer - the host data.");
+    delete c;
+    return nullptr;
+  }
+  status = napi_get_buffer_info(env, args[0], &c->hostPtr, &c->numBytes);
+  CHECK_STATUS;
+
+  bufferState *buf;
+  status = getBufferState(env, bufferValue, &buf);
+  if (napi_pending_exception == status) {
+    delete c;
+    return nullptr;
+  }
+  CHECK_STATUS;
+  c->clMem = buf->clMem;
+
+  if (argc > 1) {
+    status = getEventOptions(env, args[1], c->events);
+    if (napi_pending_exception == status) {
+      delete c;
+      return nullptr;
+    }
+    CHECK_STATUS;
+
+    napi_valuetype t;
+    status = napi_typeof(env, args[1], &t);
+    CHECK_STATUS;
+    if (napi_object == t) {
+      napi_value offsetValue, queueNumValue;
+      status = napi_get_named_property(env, args[1], "offset", &offsetValue);
+      CHECK_STATUS;
+      status = napi_typeof(env, offsetValue, &t);
+      CHECK_STATUS;
+      if (napi_number == t) {
+        int64_t offset = 0;
+        status = napi_get_value_int64(env, offsetValue, &offset);
+        CHECK_STATUS;
+        if (offset < 0) {
+          status = napi_throw_range_error(env, nullptr, "Transfer offset cannot be negative.");
+          delete c;
+          return nullptr;
+        }
+        c->offset = (size_t)offset;
+      } else if (napi_undefined != t) {
+        status = napi_throw_type_error(env, nullptr, "Transfer offset must be a number.");
+        delete c;
+        return nullptr;
+      }
+
+      status = napi_get_named_property(env, args[1], "queueNum", &queueNumValue);
+      CHECK_STATUS;
+      status = napi_typeof(env, queueNumValue, &t);
+      CHECK_STATUS;
+      if (napi_number == t) {
+        int32_t checkValue;
+        status = napi_get_value_int32(env, queueNumValue, &checkValue);
+        CHECK_STATUS;
+        if (!((checkValue >= 0) && ((uint32_t)checkValue < c->clMem->numQueues()))) {
+          status = napi_throw_range_error(env, nullptr, "Optional parameter queueNum out of range.");
+          delete c;
+          return nullptr;
+        }
+        c->queueNum = (uint32_t)checkValue;
+      } else if (napi_undefined != t) {
+        status = napi_throw_type_error(env, nullptr, "Transfer queueNum must be a number.");
+        delete c;
+        return nullptr;
+      }
+    }
+  }
+
+  if ((0 == c->numBytes) || (c->offset + c->numBytes > c->clMem->numBytes())) {
+    status = napi_throw_range_error(env, nullptr, "Transfer must be within the OpenCL buffer.");
+    delete c;
+    return nullptr;
+  }
+
+  c->events.setProfiling(buf->ctx->profiling);
+
+  // hold the host data until the transfer is complete
+  status = napi_create_reference(env, args[0], 1, &c->passthru);
+  CHECK_STATUS;
+
+  napi_value promise;
+  status = napi_create_promise(env, &c->_deferred, &promise);
+  CHECK_STATUS;
+
+  buf->ctx->trackWork(c->queueNum, c);
+  completionQueue *completion = buf->ctx->completion;
+  if (completion) {
+    // enqueueing is non-blocking so is done on the JS thread, with no thread waiting for the device
+    c->eventCompletion = true;
+    transferExecute(env, c);
+    if (NODEN_SUCCESS == c->status) {
+      cl_int error = completion->completeOnEvent(c->transfer, transferComplete, c);
+      if (CL_SUCCESS != error) {
+        c->status = error;
+        c->errorMsg = "Failed to set a callback for completion of the transfer.";
+      }
+    }
+    if (NODEN_SUCCESS != c->status)
+      transferComplete(env, napi_ok, c);
+  } else {
+    status = queueWork(env, buf->ctx->engine, c->queueNum, toBuffer ? "WriteFrom" : "ReadInto",
+      transferExecute, transferComplete, c);
+    CHECK_STATUS;
+  }
+
   return promise;
 }
 
-void finalizeClMemory(napi_env env, void* data, void* hint) {
-  iClMemory *clMem = (iClMemory*)data;
-  printf("Finalizing OpenCL memory of type %s, size %d.\n", clMem->svmTypeName().c_str(), clMem->numBytes());
-  delete clMem;
+napi_value writeFrom(napi_env env, napi_callback_info info) {
+  return transfer(env, info, true);
 }
 
-void finalizeContextRef(napi_env env, void* data, void* hint) {
-  printf("Finalizing OpenCL context reference.\n");
-  napi_ref contextRef = (napi_ref)data;
-  napi_status status = napi_delete_reference(env, contextRef);
-  checkStatus(env, status, __FILE__, __LINE__ - 1);
+napi_value readInto(napi_env env, napi_callback_info info) {
+  return transfer(env, info, false);
 }
 
 napi_value freeAllocation(napi_env env, napi_callback_info info) {
@@ -216,12 +683,16 @@ napi_value freeAllocation(napi_env env, napi_callback_info info) {
   napi_value args[1];
   size_t argc = 1;
   napi_value bufferValue;
-  iClMemory *clMem = nullptr;
-  status = napi_get_cb_info(env, info, &argc, args, &bufferValue, (void**)&clMem);
+  status = napi_get_cb_info(env, info, &argc, args, &bufferValue, nullptr);
+  CHECK_STATUS;
+
+  bufferState *buf;
+  status = getBufferState(env, bufferValue, &buf);
+  if (napi_pending_exception == status) return nullptr;
   CHECK_STATUS;
 
-  // printf("Freeing OpenCL memory of type %s, size %d.\n", clMem->svmTypeName().c_str(), clMem->numBytes());
-  clMem->freeAllocation();
+  // printf("Freeing OpenCL memory of type %s, size %zd.\n", buf->clMem->svmTypeName().c_str(), buf->clMem->numBytes());
+  buf->clMem->freeAllocation();
 
   napi_value result;
   status = napi_get_undefined(env, &result);
@@ -231,14 +702,16 @@ napi_value freeAllocation(napi_env env, napi_callback_info info) {
 
 void createBufferExecute(napi_env env, void* data) {
   createBufCarrier* c = (createBufCarrier*) data;
-  // printf("Create a buffer of type %s, size %d.\n", c->clMem->svmTypeName().c_str(), c->clMem->numBytes());
+  // printf("Create a buffer of type %s, size %zd.\n", c->clMem->svmTypeName().c_str(), c->clMem->numBytes());
 
   HR_TIME_POINT start = NOW;
 
   if (!c->clMem->allocate()) {
     c->status = NODEN_ALLOCATION_FAILURE;
     c->errorMsg = "Failed to allocate memory for buffer.";
-  }
+  } else if (c->wrapPtr)
+    // the driver shares wrapped memory with the device when mapping gives back the same pointer
+    c->zeroCopy = (c->clMem->hostBuf() == c->wrapPtr);
 
   c->totalTime = microTime(start);
 }
@@ -255,28 +728,35 @@ void createBufferComplete(napi_env env, napi_status asyncStatus, void* data) {
   c->status = napi_create_external_buffer(env, c->clMem->numBytes(), c->clMem->hostBuf(), nullptr, nullptr, &result);
   REJECT_STATUS;
 
-  napi_value clMemValue;
-  c->status = napi_create_external(env, c->clMem, finalizeClMemory, nullptr, &clMemValue);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "clMemory", clMemValue);
+  // the state holds the context, so that it is not collected while the buffer is in use
+  bufferState *buf = new bufferState;
+  buf->clMem = c->clMem;
+  buf->ctx = c->ctx;
+  buf->contextRef = c->contextRef;
+  buf->sourceRef = c->sourceRef;
+  c->status = wrapState(env, result, &bufferTag, buf, finalizeBuffer);
+  if (napi_ok != c->status) delete buf;
   REJECT_STATUS;
+  c->clMem = nullptr;
+  c->contextRef = nullptr;
+  c->sourceRef = nullptr;
 
   napi_value numQueuesValue;
-  c->status = napi_create_uint32(env, c->numQueues, &numQueuesValue);
+  c->status = napi_create_uint32(env, buf->clMem->numQueues(), &numQueuesValue);
   REJECT_STATUS;
   c->status = napi_set_named_property(env, result, "numQueues", numQueuesValue);
   REJECT_STATUS;
 
-  napi_value contextRefValue;
-  c->status = napi_create_external(env, c->contextRef, finalizeContextRef, nullptr, &contextRefValue);
+  napi_value numBytesValue;
+  c->status = napi_create_int64(env, (int64_t)buf->clMem->numBytes(), &numBytesValue);
   REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "contextRef", contextRefValue);
+  c->status = napi_set_named_property(env, result, "numBytes", numBytesValue);
   REJECT_STATUS;
 
-  napi_value numBytesValue;
-  c->status = napi_create_uint32(env, (int32_t) c->clMem->numBytes(), &numBytesValue);
+  napi_value zeroCopyValue;
+  c->status = napi_get_boolean(env, c->zeroCopy, &zeroCopyValue);
   REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "numBytes", numBytesValue);
+  c->status = napi_set_named_property(env, result, "zeroCopy", zeroCopyValue);
   REJECT_STATUS;
 
   napi_value creationValue;
@@ -285,19 +765,17 @@ void createBufferComplete(napi_env env, napi_status asyncStatus, void* data) {
   c->status = napi_set_named_property(env, result, "creationTime", creationValue);
   REJECT_STATUS;
 
-  napi_value hostAccessValue;
-  c->status = napi_create_function(env, "hostAccess", NAPI_AUTO_LENGTH,
-    hostAccess, nullptr, &hostAccessValue);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "hostAccess", hostAccessValue);
-  REJECT_STATUS;
-
-  napi_value freeAllocValue;
-  c->status = napi_create_function(env, "freeAllocation", NAPI_AUTO_LENGTH,
-    freeAllocation, c->clMem, &freeAllocValue);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "freeAllocation", freeAllocValue);
+  // buffers are Node buffers, so share one function for each method rather than a class prototype
+  nodenClasses *classes;
+  c->status = getClasses(env, &classes);
   REJECT_STATUS;
+  for (auto& method: classes->bufferMethods) {
+    napi_value methodValue;
+    c->status = napi_get_reference_value(env, method.second, &methodValue);
+    REJECT_STATUS;
+    c->status = napi_set_named_property(env, result, method.first.c_str(), methodValue);
+    REJECT_STATUS;
+  }
 
   napi_status status;
   status = napi_resolve_deferred(env, c->_deferred, result);
@@ -330,15 +808,21 @@ napi_value createBuffer(napi_env env, napi_callback_info info) {
     delete c;
     return nullptr;
   }
-  int32_t paramSize;
-  status = napi_get_value_int32(env, args[0], &paramSize);
+  double paramSize;
+  status = napi_get_value_double(env, args[0], &paramSize);
   CHECK_STATUS;
   if (paramSize < 0) {
     status = napi_throw_error(env, nullptr, "Size of the buffer cannot be negative.");
     delete c;
     return nullptr;
   }
-  uint32_t numBytes = (uint32_t)paramSize;
+  // sizes above 2^53 cannot be represented exactly as numbers, and are beyond any device anyway
+  if ((paramSize > 9007199254740991.0) || ((double)(size_t)paramSize != paramSize)) {
+    status = napi_throw_range_error(env, nullptr, "Size of the buffer must be a whole number of bytes that the host can address.");
+    delete c;
+    return nullptr;
+  }
+  size_t numBytes = (size_t)paramSize;
 
   status = napi_typeof(env, args[1], &t);
   CHECK_STATUS;
@@ -378,23 +862,28 @@ napi_value createBuffer(napi_env env, napi_callback_info info) {
   status = napi_get_value_string_utf8(env, bufTypeValue, svmFlag, 10, nullptr);
   CHECK_STATUS;
 
-  napi_value svmCapsValue;
-  status = napi_get_named_property(env, contextValue, "svmCaps", &svmCapsValue);
-  CHECK_STATUS;
-  cl_ulong svmCaps;
-  status = napi_get_value_int64(env, svmCapsValue, (int64_t*)&svmCaps);
+  status = getContextState(env, contextValue, &c->ctx);
+  if (napi_pending_exception == status) {
+    delete c;
+    return nullptr;
+  }
   CHECK_STATUS;
+  cl_ulong svmCaps = c->ctx->svmCaps;
+  deviceInfo *devInfo = c->ctx->devInfo;
 
   if ((strcmp(svmFlag, "fine") != 0) &&
     (strcmp(svmFlag, "coarse") != 0) &&
-    (strcmp(svmFlag, "none") != 0)) {
-    status = napi_throw_error(env, nullptr, "Buffer type must be one of 'fine', 'coarse' or 'none'.");
+    (strcmp(svmFlag, "none") != 0) &&
+    (strcmp(svmFlag, "device") != 0)) {
+    status = napi_throw_error(env, nullptr, "Buffer type must be one of 'fine', 'coarse', 'none' or 'device'.");
     delete c;
     return nullptr;
   }
   eSvmType svmType = (0 == strcmp(svmFlag, "fine")) ? eSvmType::FINE :
                      (0 == strcmp(svmFlag, "coarse")) ? eSvmType::COARSE :
                      eSvmType::NONE;
+  // device buffers keep their data in device memory with a host staging buffer that is not SVM
+  bool deviceResident = 0 == strcmp(svmFlag, "device");
 
   if (((eSvmType::FINE == svmType) && ((svmCaps & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) == 0)) ||
       ((eSvmType::COARSE == svmType) && ((svmCaps & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER) == 0))) {
@@ -404,6 +893,7 @@ napi_value createBuffer(napi_env env, napi_callback_info info) {
   }
 
   std::array<uint32_t, 3> imageDims = {0, 0, 0};
+  cl_image_format imageFormat = defaultImageFormat;
   if (argc == 4) {
     napi_value dimsValue = args[3];
     status = napi_typeof(env, dimsValue, &t);
@@ -441,62 +931,181 @@ napi_value createBuffer(napi_env env, napi_callback_info info) {
       status = napi_get_value_uint32(env, depthValue, &imageDims[2]);
       CHECK_STATUS;
     }
+
+    if (!getImageFormatValue(env, dimsValue, "channelOrder", channelOrders, imageFormat.image_channel_order)) {
+      status = napi_throw_type_error(env, nullptr, "Image channelOrder must be one of 'R', 'RG', 'RGBA' or 'BGRA'.");
+      delete c;
+      return nullptr;
+    }
+    if (!getImageFormatValue(env, dimsValue, "channelType", channelTypes, imageFormat.image_channel_data_type)) {
+      status = napi_throw_type_error(env, nullptr, "Image channelType must be one of 'FLOAT', 'HALF_FLOAT', 'UNORM_INT8' or 'UNORM_INT16'.");
+      delete c;
+      return nullptr;
+    }
+  }
+
+  if (devInfo->maxMemAllocSize && (numBytes > devInfo->maxMemAllocSize)) {
+    std::stringstream ss;
+    ss << "Buffer size " << numBytes << " is larger than the device maximum allocation of " << devInfo->maxMemAllocSize << " bytes.";
+    status = napi_throw_range_error(env, nullptr, ss.str().c_str());
+    delete c;
+    return nullptr;
+  }
+
+  if ((imageFormat.image_channel_order != defaultImageFormat.image_channel_order) ||
+      (imageFormat.image_channel_data_type != defaultImageFormat.image_channel_data_type)) {
+    bool supported = false;
+    cl_int error = checkImageFormat(c->ctx->context, memFlags, imageDims[2] > 1, imageFormat, supported);
+    CHECK_CL_ERROR;
+    if (!supported) {
+      status = napi_throw_error(env, nullptr, "Image format requested is not supported by device.");
+      delete c;
+      return nullptr;
+    }
+  }
+
+  // SVM allocations cannot be sub-buffers so are always allocated individually
+  std::shared_ptr<clArena> arena;
+  if (eSvmType::NONE == svmType) {
+    arena = c->ctx->arena;
   }
 
-  // Extract externals into variables
-  napi_value jsContext;
-  void* contextData;
-  status = napi_get_named_property(env, contextValue, "context", &jsContext);
+  // Create holder for host and gpu buffers
+  c->clMem = iClMemory::create(c->ctx->context, c->ctx->commandQueues, memFlags, svmType, numBytes, devInfo, imageDims, imageFormat, arena, deviceResident);
+
+  status = napi_create_reference(env, contextValue, 1, &c->contextRef);
   CHECK_STATUS;
-  status = napi_get_value_external(env, jsContext, &contextData);
+
+  status = napi_create_reference(env, contextValue, 1, &c->passthru);
   CHECK_STATUS;
-  cl_context context = (cl_context) contextData;
 
-  napi_value numQueuesVal;
-  status = napi_get_named_property(env, contextValue, "numQueues", &numQueuesVal);
+  napi_value promise;
+  status = napi_create_promise(env, &c->_deferred, &promise);
   CHECK_STATUS;
-  status = napi_get_value_uint32(env, numQueuesVal, &c->numQueues);
+
+  // allocation maps the buffer on queue 0
+  c->ctx->trackWork(0, c);
+  status = queueWork(env, c->ctx->engine, 0, "CreateBuffer", createBufferExecute, createBufferComplete, c);
   CHECK_STATUS;
 
-  std::vector<cl_command_queue> commandQueues;
-  commandQueues.resize(c->numQueues);
-  for (uint32_t i = 0; i < c->numQueues; ++i) {
-    std::stringstream ss;
-    ss << "commands_" << i;
-    napi_value commandQueue;
-    status = napi_get_named_property(env, contextValue, ss.str().c_str(), &commandQueue);
+  return promise;
+}
+
+napi_value wrapBuffer(napi_env env, napi_callback_info info) {
+  napi_status status;
+  createBufCarrier* c = new createBufCarrier;
+
+  napi_value args[2];
+  size_t argc = 2;
+  napi_value contextValue;
+  status = napi_get_cb_info(env, info, &argc, args, &contextValue, nullptr);
+  CHECK_STATUS;
+
+  if (argc < 1 || argc > 2) {
+    status = napi_throw_error(env, nullptr, "Wrong number of arguments to wrap buffer.");
+    delete c;
+    return nullptr;
+  }
+
+  bool isBuffer = false;
+  status = napi_is_buffer(env, args[0], &isBuffer);
+  CHECK_STATUS;
+  if (!isBuffer) {
+    status = napi_throw_type_error(env, nullptr, "First argument must be a buffer - the memory to wrap.");
+    delete c;
+    return nullptr;
+  }
+  void *hostPtr = nullptr;
+  size_t hostSize = 0;
+  status = napi_get_buffer_info(env, args[0], &hostPtr, &hostSize);
+  CHECK_STATUS;
+  if (0 == hostSize) {
+    status = napi_throw_range_error(env, nullptr, "Buffer to wrap cannot be empty.");
+    delete c;
+    return nullptr;
+  }
+
+  eMemFlags memFlags = eMemFlags::READWRITE;
+  if (argc > 1) {
+    napi_valuetype t;
+    status = napi_typeof(env, args[1], &t);
     CHECK_STATUS;
-    status = napi_get_value_external(env, commandQueue, (void**)&commandQueues.at(i));
+    if (t != napi_string) {
+      status = napi_throw_type_error(env, nullptr, "Second argument must be a string - the buffer direction.");
+      delete c;
+      return nullptr;
+    }
+    char memflag[10];
+    status = napi_get_value_string_utf8(env, args[1], memflag, 10, nullptr);
     CHECK_STATUS;
+    if ((strcmp(memflag, "readwrite") != 0) && (strcmp(memflag, "writeonly") != 0) && (strcmp(memflag, "readonly") != 0)) {
+      status = napi_throw_error(env, nullptr, "Buffer direction must be one of 'readwrite', 'writeonly' or 'readonly'.");
+      delete c;
+      return nullptr;
+    }
+    memFlags = (0==strcmp("readwrite", memflag)) ? eMemFlags::READWRITE :
+               (0==strcmp("writeonly", memflag)) ? eMemFlags::WRITEONLY :
+               eMemFlags::READONLY;
   }
 
-  napi_value jsDevInfo;
-  deviceInfo *devInfo;
-  status = napi_get_named_property(env, contextValue, "deviceInfo", &jsDevInfo);
-  CHECK_STATUS;
-  status = napi_get_value_external(env, jsDevInfo, (void**)&devInfo);
+  status = getContextState(env, contextValue, &c->ctx);
+  if (napi_pending_exception == status) {
+    delete c;
+    return nullptr;
+  }
   CHECK_STATUS;
+  cl_ulong svmCaps = c->ctx->svmCaps;
+  deviceInfo *devInfo = c->ctx->devInfo;
+
+  // With system SVM kernels can use any host pointer directly. Otherwise the memory is used as the
+  // host pointer of a buffer, which the driver may share with the device or stage copies of itself.
+  eSvmType svmType = eSvmType::NONE;
+  if (svmCaps & CL_DEVICE_SVM_FINE_GRAIN_SYSTEM)
+    svmType = eSvmType::FINE;
+  c->wrapPtr = hostPtr;
+
+  if (devInfo->maxMemAllocSize && (hostSize > devInfo->maxMemAllocSize)) {
+    status = napi_throw_range_error(env, nullptr, "Buffer to wrap is larger than the device maximum allocation.");
+    delete c;
+    return nullptr;
+  }
+
+  c->clMem = iClMemory::wrap(c->ctx->context, c->ctx->commandQueues, memFlags, svmType, hostSize, devInfo, hostPtr);
 
   status = napi_create_reference(env, contextValue, 1, &c->contextRef);
   CHECK_STATUS;
 
-  // Create holder for host and gpu buffers
-  c->clMem = iClMemory::create(context, commandQueues, memFlags, svmType, numBytes, devInfo, imageDims);
+  status = napi_create_reference(env, args[0], 1, &c->sourceRef);
+  CHECK_STATUS;
 
   status = napi_create_reference(env, contextValue, 1, &c->passthru);
   CHECK_STATUS;
 
-  napi_value promise, resource_name;
+  napi_value promise;
   status = napi_create_promise(env, &c->_deferred, &promise);
   CHECK_STATUS;
 
-  status = napi_create_string_utf8(env, "CreateBuffer", NAPI_AUTO_LENGTH, &resource_name);
-  CHECK_STATUS;
-  status = napi_create_async_work(env, NULL, resource_name, createBufferExecute,
-    createBufferComplete, c, &c->_request);
-  CHECK_STATUS;
-  status = napi_queue_async_work(env, c->_request);
+  // allocation maps the buffer on queue 0
+  c->ctx->trackWork(0, c);
+  status = queueWork(env, c->ctx->engine, 0, "WrapBuffer", createBufferExecute, createBufferComplete, c);
   CHECK_STATUS;
 
   return promise;
 }
+
+napi_status defineBufferMethods(napi_env env, nodenClasses *classes) {
+  napi_status status;
+  const std::pair<const char*, napi_callback> methods[] = {
+    { "hostAccess", hostAccess }, { "hostAccessSync", hostAccessSync }, { "writeFrom", writeFrom },
+    { "readInto", readInto }, { "freeAllocation", freeAllocation } };
+  for (auto& method: methods) {
+    napi_value methodValue;
+    status = napi_create_function(env, method.first, NAPI_AUTO_LENGTH, method.second, nullptr, &methodValue);
+    PASS_STATUS;
+    napi_ref methodRef;
+    status = napi_create_reference(env, methodValue, 1, &methodRef);
+    PASS_STATUS;
+    classes->bufferMethods.emplace_back(method.first, methodRef);
+  }
+  return napi_ok;
+}
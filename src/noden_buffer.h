@@ -17,7 +17,23 @@
 #define NODEN_BUFFER_H
 
 #include "node_api.h"
+#include "noden_util.h"
+
+class iClMemory;
+struct contextState;
+
+// Native state of a buffer, wrapped in the Node buffer that views its host memory
+struct bufferState {
+  iClMemory *clMem;
+  contextState *ctx;
+  napi_ref contextRef;
+  napi_ref sourceRef;
+};
 
 napi_value createBuffer(napi_env env, napi_callback_info info);
+napi_value wrapBuffer(napi_env env, napi_callback_info info);
+napi_status defineBufferMethods(napi_env env, nodenClasses *classes);
+// The native state of a buffer, throwing a TypeError if the value is not an OpenCL buffer
+napi_status getBufferState(napi_env env, napi_value bufferValue, bufferState **state);
 
 #endif
@@ -0,0 +1,342 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "noden_cache.h"
+#include "noden_util.h"
+#include <stdio.h>
+#include <cstring>
+#include <functional>
+#include <thread>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+static const char cacheMagic[4] = { 'N', 'C', 'L', 'B' };
+static const uint32_t cacheVersion = 1;
+
+cl_int getArgInfo(cl_kernel kernel, cl_uint arg, cl_uint param, std::string& info) {
+  size_t paramLen = 0;
+  cl_int error = clGetKernelArgInfo(kernel, arg, param, 0, nullptr, &paramLen);
+  PASS_CL_ERROR;
+  char* paramStr = (char *)malloc(sizeof(char) * paramLen);
+  error = clGetKernelArgInfo(kernel, arg, param, paramLen, paramStr, NULL);
+  if (error != CL_SUCCESS) free(paramStr);
+  PASS_CL_ERROR;
+  info = std::string(paramStr);
+  free(paramStr);
+  return error;
+}
+
+cl_int getKernelArgInfos(cl_kernel kernel, tArgInfos& argInfos) {
+  cl_uint numArgs = 0;
+  cl_int error = clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(numArgs), &numArgs, NULL);
+  PASS_CL_ERROR;
+
+  argInfos.clear();
+  for (cl_uint p=0; p<numArgs; ++p) {
+    argInfo ai;
+    error = getArgInfo(kernel, p, CL_KERNEL_ARG_NAME, ai.name);
+    PASS_CL_ERROR;
+
+    error = getArgInfo(kernel, p, CL_KERNEL_ARG_TYPE_NAME, ai.type);
+    PASS_CL_ERROR;
+
+    cl_kernel_arg_access_qualifier accessQualifier;
+    error = clGetKernelArgInfo(kernel, p, CL_KERNEL_ARG_ACCESS_QUALIFIER, sizeof(accessQualifier), &accessQualifier, NULL);
+    PASS_CL_ERROR;
+    ai.access = CL_KERNEL_ARG_ACCESS_READ_ONLY == accessQualifier ? iKernelArg::eAccess::READONLY :
+                CL_KERNEL_ARG_ACCESS_WRITE_ONLY == accessQualifier ? iKernelArg::eAccess::WRITEONLY :
+                iKernelArg::eAccess::NONE;
+    argInfos.push_back(ai);
+  }
+  return error;
+}
+
+cl_int getDeviceString(cl_device_id deviceId, cl_device_info param, std::string& info) {
+  size_t paramLen = 0;
+  cl_int error = clGetDeviceInfo(deviceId, param, 0, nullptr, &paramLen);
+  PASS_CL_ERROR;
+  std::vector<char> paramStr(paramLen + 1, '\0');
+  error = clGetDeviceInfo(deviceId, param, paramLen, paramStr.data(), nullptr);
+  PASS_CL_ERROR;
+  info = std::string(paramStr.data());
+  return error;
+}
+
+// 64-bit FNV-1a, with a separator between each part so that moving text
+// between the source and the options changes the key
+void hashPart(uint64_t& hash, const std::string& part) {
+  for (size_t i = 0; i < part.length(); ++i) {
+    hash ^= (uint8_t)part[i];
+    hash *= 0x100000001b3ULL;
+  }
+  hash ^= 0xff;
+  hash *= 0x100000001b3ULL;
+}
+
+cl_int programCacheKey(cl_device_id deviceId, const std::string& source,
+  const std::string& buildOptions, uint64_t& key) {
+  cl_int error = CL_SUCCESS;
+  std::string deviceName, driverVersion, deviceVersion;
+  error = getDeviceString(deviceId, CL_DEVICE_NAME, deviceName);
+  PASS_CL_ERROR;
+  error = getDeviceString(deviceId, CL_DRIVER_VERSION, driverVersion);
+  PASS_CL_ERROR;
+  error = getDeviceString(deviceId, CL_DEVICE_VERSION, deviceVersion);
+  PASS_CL_ERROR;
+
+  key = 0xcbf29ce484222325ULL;
+  hashPart(key, source);
+  hashPart(key, buildOptions);
+  hashPart(key, deviceName);
+  hashPart(key, driverVersion);
+  hashPart(key, deviceVersion);
+  return error;
+}
+
+std::string programCachePath(const std::string& cacheDir, uint64_t key, const char* ext) {
+  char keyStr[20];
+  snprintf(keyStr, 20, "%016llx", (unsigned long long)key);
+  std::string path(cacheDir);
+  if (!path.empty() && (path.back() != '/') && (path.back() != '\\'))
+    path += '/';
+  return path + keyStr + ext;
+}
+
+bool writeString(FILE* f, const std::string& str) {
+  uint32_t len = (uint32_t)str.length();
+  return (1 == fwrite(&len, sizeof(len), 1, f)) &&
+         (len == fwrite(str.data(), 1, len, f));
+}
+
+bool readString(FILE* f, std::string& str) {
+  uint32_t len = 0;
+  if (1 != fread(&len, sizeof(len), 1, f)) return false;
+  if (len > 65536) return false;
+  str.resize(len);
+  return len == fread(&str[0], 1, len, f);
+}
+
+// Bytes from the current position to the end of the file
+static long remainingBytes(FILE* f) {
+  long pos = ftell(f);
+  if ((pos < 0) || (0 != fseek(f, 0, SEEK_END))) return -1;
+  long end = ftell(f);
+  if (0 != fseek(f, pos, SEEK_SET)) return -1;
+  return end - pos;
+}
+
+// Temporary file to write an entry to before renaming it into place, unique to
+// the process and thread so that concurrent writers of one entry do not mix
+static std::string tempPath(const std::string& path) {
+  size_t threadId = std::hash<std::thread::id>()(std::this_thread::get_id());
+  return path + "." + std::to_string((long long)getpid()) + "." + std::to_string(threadId) + ".tmp";
+}
+
+bool readCacheFile(const std::string& path, uint64_t key,
+  std::vector<unsigned char>& binary, tKernelInfos& kernelInfos) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) return false;
+
+  bool ok = true;
+  char magic[4];
+  uint32_t version = 0;
+  uint64_t fileKey = 0;
+  uint32_t numKernels = 0;
+  ok = (1 == fread(magic, sizeof(magic), 1, f)) && (0 == memcmp(magic, cacheMagic, sizeof(magic))) &&
+       (1 == fread(&version, sizeof(version), 1, f)) && (cacheVersion == version) &&
+       (1 == fread(&fileKey, sizeof(fileKey), 1, f)) && (key == fileKey) &&
+       (1 == fread(&numKernels, sizeof(numKernels), 1, f));
+
+  for (uint32_t k = 0; ok && (k < numKernels); ++k) {
+    std::string kernelName;
+    uint32_t numArgs = 0;
+    ok = readString(f, kernelName) && (1 == fread(&numArgs, sizeof(numArgs), 1, f));
+    tArgInfos argInfos;
+    for (uint32_t a = 0; ok && (a < numArgs); ++a) {
+      argInfo ai;
+      uint8_t access = 0;
+      ok = readString(f, ai.name) && readString(f, ai.type) && (1 == fread(&access, sizeof(access), 1, f));
+      ai.access = (iKernelArg::eAccess)access;
+      argInfos.push_back(ai);
+    }
+    kernelInfos.emplace(kernelName, argInfos);
+  }
+
+  uint64_t binarySize = 0;
+  ok = ok && (1 == fread(&binarySize, sizeof(binarySize), 1, f)) && (binarySize > 0);
+  if (ok) {
+    // a corrupt size must not be trusted for the allocation
+    long remaining = remainingBytes(f);
+    ok = (remaining >= 0) && (binarySize <= (uint64_t)remaining);
+  }
+  if (ok) {
+    binary.resize((size_t)binarySize);
+    ok = binarySize == fread(binary.data(), 1, (size_t)binarySize, f);
+  }
+  fclose(f);
+  return ok;
+}
+
+bool loadProgramBinary(cl_context context, cl_device_id deviceId, const std::string& path,
+  uint64_t key, const std::string& buildOptions, cl_program& program, tKernelInfos& kernelInfos) {
+  program = nullptr;
+  std::vector<unsigned char> binary;
+  if (!readCacheFile(path, key, binary, kernelInfos))
+    return false;
+
+  cl_int error = CL_SUCCESS;
+  cl_int binaryStatus = CL_SUCCESS;
+  const size_t binarySize = binary.size();
+  const unsigned char* binaries[1] = { binary.data() };
+  program = clCreateProgramWithBinary(context, 1, &deviceId, &binarySize, binaries, &binaryStatus, &error);
+  if ((CL_SUCCESS == error) && (CL_SUCCESS == binaryStatus))
+    error = clBuildProgram(program, 1, &deviceId, buildOptions.c_str(), nullptr, nullptr);
+  else if (CL_SUCCESS == error)
+    error = binaryStatus;
+
+  if (CL_SUCCESS != error) {
+    printf("Cached program binary %s could not be used (%s) - building from source.\n",
+      path.c_str(), clGetErrorString(error));
+    if (program) clReleaseProgram(program);
+    program = nullptr;
+    kernelInfos.clear();
+    return false;
+  }
+  return true;
+}
+
+bool saveProgramBinary(cl_program program, const std::string& path, uint64_t key) {
+  cl_int error = CL_SUCCESS;
+  cl_uint numDevices = 0;
+  error = clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(numDevices), &numDevices, nullptr);
+  if ((CL_SUCCESS != error) || (1 != numDevices)) return false;
+
+  size_t binarySize = 0;
+  error = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binarySize), &binarySize, nullptr);
+  if ((CL_SUCCESS != error) || (0 == binarySize)) return false;
+  std::vector<unsigned char> binary(binarySize);
+  unsigned char* binaries[1] = { binary.data() };
+  error = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, nullptr);
+  if (CL_SUCCESS != error) return false;
+
+  cl_uint numKernels = 0;
+  error = clCreateKernelsInProgram(program, 0, nullptr, &numKernels);
+  if (CL_SUCCESS != error) return false;
+  std::vector<cl_kernel> kernels(numKernels);
+  if (numKernels > 0) {
+    error = clCreateKernelsInProgram(program, numKernels, kernels.data(), nullptr);
+    if (CL_SUCCESS != error) return false;
+  }
+
+  tKernelInfos kernelInfos;
+  for (cl_uint k = 0; k < numKernels; ++k) {
+    size_t nameLength = 0;
+    error = clGetKernelInfo(kernels[k], CL_KERNEL_FUNCTION_NAME, 0, nullptr, &nameLength);
+    std::vector<char> name(nameLength + 1, '\0');
+    if (CL_SUCCESS == error)
+      error = clGetKernelInfo(kernels[k], CL_KERNEL_FUNCTION_NAME, nameLength, name.data(), nullptr);
+    tArgInfos argInfos;
+    if (CL_SUCCESS == error)
+      error = getKernelArgInfos(kernels[k], argInfos);
+    clReleaseKernel(kernels[k]);
+    if (CL_SUCCESS != error) return false;
+    kernelInfos.emplace(std::string(name.data()), argInfos);
+  }
+
+  // write to a temporary file then rename so that readers never see a partial entry
+  std::string tmpPath = tempPath(path);
+  FILE* f = fopen(tmpPath.c_str(), "wb");
+  if (!f) {
+    printf("Failed to open program cache file %s for writing.\n", tmpPath.c_str());
+    return false;
+  }
+
+  uint32_t kernelCount = (uint32_t)kernelInfos.size();
+  bool ok = (1 == fwrite(cacheMagic, sizeof(cacheMagic), 1, f)) &&
+            (1 == fwrite(&cacheVersion, sizeof(cacheVersion), 1, f)) &&
+            (1 == fwrite(&key, sizeof(key), 1, f)) &&
+            (1 == fwrite(&kernelCount, sizeof(kernelCount), 1, f));
+  for (auto& kernelIter: kernelInfos) {
+    uint32_t numArgs = (uint32_t)kernelIter.second.size();
+    ok = ok && writeString(f, kernelIter.first) && (1 == fwrite(&numArgs, sizeof(numArgs), 1, f));
+    for (auto& ai: kernelIter.second) {
+      uint8_t access = (uint8_t)ai.access;
+      ok = ok && writeString(f, ai.name) && writeString(f, ai.type) && (1 == fwrite(&access, sizeof(access), 1, f));
+    }
+  }
+  uint64_t binarySize64 = binarySize;
+  ok = ok && (1 == fwrite(&binarySize64, sizeof(binarySize64), 1, f)) &&
+       (binarySize == fwrite(binary.data(), 1, binarySize, f));
+  ok = (0 == fclose(f)) && ok;
+
+  if (ok) {
+#ifdef _WIN32
+    remove(path.c_str()); // rename does not replace an existing file on Windows
+#endif
+    ok = 0 == rename(tmpPath.c_str(), path.c_str());
+  }
+  if (!ok) {
+    printf("Failed to write program cache file %s.\n", path.c_str());
+    remove(tmpPath.c_str());
+  }
+  return ok;
+}
+
+bool readTuneFile(const std::string& path, std::vector<size_t>& workItemsPerGroup) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (!f) return false;
+  workItemsPerGroup.clear();
+  unsigned long long dim = 0;
+  while ((workItemsPerGroup.size() < 3) && (1 == fscanf(f, "%llu", &dim)))
+    workItemsPerGroup.push_back((size_t)dim);
+  fclose(f);
+  if (workItemsPerGroup.empty()) return false;
+  if ((1 == workItemsPerGroup.size()) && (0 == workItemsPerGroup[0]))
+    workItemsPerGroup.clear();
+  for (auto& wig: workItemsPerGroup)
+    if (0 == wig) return false;
+  return true;
+}
+
+bool writeTuneFile(const std::string& path, const std::vector<size_t>& workItemsPerGroup) {
+  std::string tmpPath = tempPath(path);
+  FILE* f = fopen(tmpPath.c_str(), "w");
+  if (!f) {
+    printf("Failed to open autotune cache file %s for writing.\n", tmpPath.c_str());
+    return false;
+  }
+  bool ok = true;
+  if (workItemsPerGroup.empty())
+    ok = fprintf(f, "0\n") > 0;
+  for (size_t i = 0; ok && (i < workItemsPerGroup.size()); ++i)
+    ok = fprintf(f, i + 1 < workItemsPerGroup.size() ? "%llu " : "%llu\n", (unsigned long long)workItemsPerGroup[i]) > 0;
+  ok = (0 == fclose(f)) && ok;
+
+  if (ok) {
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    ok = 0 == rename(tmpPath.c_str(), path.c_str());
+  }
+  if (!ok) {
+    printf("Failed to write autotune cache file %s.\n", path.c_str());
+    remove(tmpPath.c_str());
+  }
+  return ok;
+}
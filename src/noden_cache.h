@@ -0,0 +1,57 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef NODEN_CACHE_H
+#define NODEN_CACHE_H
+
+#include "cl_include.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "run_params.h"
+
+// Kernel argument details as reported by clGetKernelArgInfo. These are stored
+// alongside cached program binaries because drivers are not required to
+// provide argument info for programs created from binaries.
+struct argInfo {
+  std::string name;
+  std::string type;
+  iKernelArg::eAccess access;
+};
+typedef std::vector<argInfo> tArgInfos;
+typedef std::map<std::string, tArgInfos> tKernelInfos;
+
+cl_int getKernelArgInfos(cl_kernel kernel, tArgInfos& argInfos);
+
+// Key for a program binary built from the given source and options on a device
+cl_int programCacheKey(cl_device_id deviceId, const std::string& source,
+  const std::string& buildOptions, uint64_t& key);
+std::string programCachePath(const std::string& cacheDir, uint64_t key, const char* ext);
+
+// Try to create and build a program from a cached binary. Returns false if
+// there is no usable cache entry, in which case program is left null.
+bool loadProgramBinary(cl_context context, cl_device_id deviceId, const std::string& path,
+  uint64_t key, const std::string& buildOptions, cl_program& program, tKernelInfos& kernelInfos);
+
+// Store the binary of a successfully built program with its kernel argument details
+bool saveProgramBinary(cl_program program, const std::string& path, uint64_t key);
+
+// Local size chosen by autotuning, stored as text with a number per dimension and
+// a single zero when the implementation's choice was fastest
+bool readTuneFile(const std::string& path, std::vector<size_t>& workItemsPerGroup);
+bool writeTuneFile(const std::string& path, const std::vector<size_t>& workItemsPerGroup);
+
+#endif
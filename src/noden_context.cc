@@ -17,29 +17,51 @@
 #include "noden_info.h"
 #include "noden_program.h"
 #include "noden_buffer.h"
+#include "noden_submit.h"
+#include "cl_events.h"
 #include <sstream>
+#include <algorithm>
 
-void finalizeContext(napi_env env, void* data, void* hint) {
-  printf("Context finalizer called.\n");
+static const napi_type_tag contextTag = { 0x6e6f64656e636c01ULL, 0x636f6e7465787401ULL };
+
+contextState::~contextState() {
+  if (engine) engine->close();
+  if (completion) completion->close();
   cl_int error = CL_SUCCESS;
-  error = clReleaseContext((cl_context) data);
-  if (error != CL_SUCCESS) printf("Failed to release CL context.\n");
+  for (auto& commandQueue: commandQueues) {
+    error = clReleaseCommandQueue(commandQueue);
+    if (error != CL_SUCCESS) printf("Failed to release CL queue.\n");
+  }
+  arena.reset();
+  if (context) {
+    error = clReleaseContext(context);
+    if (error != CL_SUCCESS) printf("Failed to release CL context.\n");
+  }
+  delete devInfo;
 }
 
-void finalizeCommands(napi_env env, void* data, void* hint) {
-  printf("Command Queue finalizer called.\n");
-  cl_int error = CL_SUCCESS;
-  error = clReleaseCommandQueue((cl_command_queue) data);
-  if (error != CL_SUCCESS) printf("Failed to release CL queue.\n");
+void contextState::trackWork(uint32_t queueNum, carrier *c) {
+  if (queueNum >= inFlight.size()) return;
+  c->inFlight = inFlight[queueNum];
+  ++*c->inFlight;
 }
 
-void finalizeDevInfo(napi_env env, void* data, void* hint) {
-  printf("Device Info finalizer called.\n");
-  delete (deviceInfo *)data;
+bool contextState::queueIdle(uint32_t queueNum) const {
+  return (queueNum < inFlight.size()) && (0 == *inFlight[queueNum]);
+}
+
+void finalizeContext(napi_env env, void* data, void* hint) {
+  printf("Context finalizer called.\n");
+  delete (contextState*)data;
+}
+
+napi_status getContextState(napi_env env, napi_value contextValue, contextState **state) {
+  return unwrapState(env, contextValue, &contextTag, "an OpenCL context", (void**)state);
 }
 
 struct waitFinishCarrier : carrier {
   cl_command_queue commandQueue;
+  clEvents events;
 };
 
 void waitFinishExecute(napi_env env, void* data) {
@@ -71,7 +93,6 @@ void waitFinishComplete(napi_env env, napi_status asyncStatus, void* data) {
 napi_value waitFinish(napi_env env, napi_callback_info info) {
   napi_status status;
   napi_value promise;
-  napi_value resource_name;
   waitFinishCarrier* c = new waitFinishCarrier;
 
   napi_value args[1];
@@ -82,15 +103,18 @@ napi_value waitFinish(napi_env env, napi_callback_info info) {
 
   if (argc >= 2) {
     status = napi_throw_error(env, nullptr, "Wrong number of arguments.");
+    delete c;
     return nullptr;
   }
 
-  uint32_t numQueues;
-  napi_value numQueuesVal;
-  status = napi_get_named_property(env, contextValue, "numQueues", &numQueuesVal);
-  CHECK_STATUS;
-  status = napi_get_value_uint32(env, numQueuesVal, &numQueues);
+  contextState *ctx;
+  status = getContextState(env, contextValue, &ctx);
+  if (napi_pending_exception == status) {
+    delete c;
+    return nullptr;
+  }
   CHECK_STATUS;
+  uint32_t numQueues = (uint32_t)ctx->commandQueues.size();
 
   uint32_t queueNum = 0;
   napi_valuetype t;
@@ -102,19 +126,13 @@ napi_value waitFinish(napi_env env, napi_callback_info info) {
     CHECK_STATUS;
     if (!((checkValue >= 0) && (checkValue < (int32_t)numQueues))) {
       status = napi_throw_range_error(env, nullptr, "Optional parameter queueNum out of range.");
+      delete c;
       return nullptr;
     }
     status = napi_get_value_uint32(env, args[0], &queueNum);
     CHECK_STATUS;
   }
-
-  std::stringstream ss;
-  ss << "commands_" << queueNum;
-  napi_value commandQueueVal;
-  status = napi_get_named_property(env, contextValue, ss.str().c_str(), &commandQueueVal);
-  CHECK_STATUS;
-  status = napi_get_value_external(env, commandQueueVal, (void**)&c->commandQueue);
-  CHECK_STATUS;
+  c->commandQueue = ctx->commandQueues.at(queueNum);
 
   status = napi_create_reference(env, contextValue, 1, &c->passthru);
   CHECK_STATUS;
@@ -122,13 +140,22 @@ napi_value waitFinish(napi_env env, napi_callback_info info) {
   status = napi_create_promise(env, &c->_deferred, &promise);
   CHECK_STATUS;
 
-  status = napi_create_string_utf8(env, "WaitFinish", NAPI_AUTO_LENGTH, &resource_name);
-  CHECK_STATUS;
-  status = napi_create_async_work(env, NULL, resource_name, waitFinishExecute,
-    waitFinishComplete, c, &c->_request);
-  CHECK_STATUS;
-  status = napi_queue_async_work(env, c->_request);
-  CHECK_STATUS;
+  ctx->trackWork(queueNum, c);
+  completionQueue *completion = ctx->completion;
+  if (completion) {
+    // a marker completes when all previous commands in the queue have completed
+    cl_int error = c->events.markCompletion(c->commandQueue);
+    if (CL_SUCCESS == error)
+      error = completion->completeOnEvent(c->events.completion(), waitFinishComplete, c);
+    if (CL_SUCCESS != error) {
+      c->status = error;
+      c->errorMsg = "Failed to wait for completion of queue.";
+      waitFinishComplete(env, napi_ok, c);
+    }
+  } else {
+    status = queueWork(env, ctx->engine, queueNum, "WaitFinish", waitFinishExecute, waitFinishComplete, c);
+    CHECK_STATUS;
+  }
 
   return promise;
 }
@@ -148,17 +175,44 @@ void createContextExecute(napi_env env, void* data) {
 
   cl_queue_properties props[] = {
     // CL_QUEUE_PROPERTIES, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_ON_DEVICE | CL_QUEUE_ON_DEVICE_DEFAULT,
-    0 };
+    0, 0, 0 };
+  if (c->profiling) {
+    props[0] = CL_QUEUE_PROPERTIES;
+    props[1] = CL_QUEUE_PROFILING_ENABLE;
+  }
   for (uint32_t i = 0; i < c->numQueues; ++i) {
     c->commandQueues.push_back(clCreateCommandQueueWithProperties(c->context, c->deviceId, props, &error));
     ASYNC_CL_ERROR;
   }
 
+  if (c->arenaSize > 0) {
+    cl_uint alignBits = 0;
+    error = clGetDeviceInfo(c->deviceId, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(alignBits), &alignBits, nullptr);
+    ASYNC_CL_ERROR;
+    c->arena = std::make_shared<clArena>(c->context, c->arenaSize, std::max<size_t>(alignBits / 8, 1));
+    error = c->arena->reserve();
+    ASYNC_CL_ERROR;
+  }
+
   char version[30];
   error = clGetDeviceInfo(c->deviceId, CL_DEVICE_VERSION, 30, version, nullptr);
   ASYNC_CL_ERROR;
   c->deviceVersion = std::string(version);
 
+  error = clGetDeviceInfo(c->deviceId, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &c->maxMemAllocSize, nullptr);
+  ASYNC_CL_ERROR;
+
+  // images can only be created over buffers from OpenCL 2.0, where these queries were added
+  if (clVersion(c->deviceVersion) >= clVersion(2,0)) {
+    error = clGetDeviceInfo(c->deviceId, CL_DEVICE_IMAGE_PITCH_ALIGNMENT, sizeof(cl_uint), &c->imagePitchAlignment, nullptr);
+    if (CL_SUCCESS == error)
+      error = clGetDeviceInfo(c->deviceId, CL_DEVICE_IMAGE_BASE_ADDRESS_ALIGNMENT, sizeof(cl_uint), &c->imageBaseAlignment, nullptr);
+    if (CL_SUCCESS != error) {
+      c->imagePitchAlignment = 0;
+      c->imageBaseAlignment = 0;
+    }
+  }
+
   c->totalTime = microTime(start);
 }
 
@@ -177,10 +231,25 @@ void createContextComplete(napi_env env, napi_status asyncStatus, void* data) {
   c->status = napi_get_reference_value(env, c->passthru, &result);
   REJECT_STATUS;
 
-  napi_value context;
-  c->status = napi_create_external(env, c->context, finalizeContext, nullptr, &context);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "context", context);
+  // the state owns the OpenCL objects from here, releasing them when the context is collected
+  contextState *ctx = new contextState;
+  ctx->context = c->context;
+  ctx->deviceId = c->deviceId;
+  ctx->platformIndex = c->platformIndex;
+  ctx->deviceIndex = c->deviceIndex;
+  ctx->commandQueues = c->commandQueues;
+  ctx->profiling = c->profiling;
+  ctx->svmCaps = c->svmCaps;
+  ctx->cacheDir = c->cacheDir;
+  ctx->arena = c->arena;
+  for (uint32_t i = 0; i < c->numQueues; ++i)
+    ctx->inFlight.push_back(std::make_shared<std::atomic<uint32_t>>(0));
+  ctx->devInfo = new deviceInfo(clVersion(c->deviceVersion));
+  ctx->devInfo->imagePitchAlignment = c->imagePitchAlignment;
+  ctx->devInfo->imageBaseAlignment = c->imageBaseAlignment;
+  ctx->devInfo->maxMemAllocSize = c->maxMemAllocSize;
+  c->status = wrapState(env, result, &contextTag, ctx, finalizeContext);
+  if (napi_ok != c->status) delete ctx;
   REJECT_STATUS;
 
   napi_value numQueuesVal;
@@ -189,43 +258,15 @@ void createContextComplete(napi_env env, napi_status asyncStatus, void* data) {
   c->status = napi_set_named_property(env, result, "numQueues", numQueuesVal);
   REJECT_STATUS;
 
-  napi_value commandQueue;
-  for (uint32_t i = 0; i < c->numQueues; ++i) {
-    c->status = napi_create_external(env, c->commandQueues.at(i), finalizeCommands, nullptr, &commandQueue);
-    REJECT_STATUS;
-    std::stringstream ss;
-    ss << "commands_" << i;
-    c->status = napi_set_named_property(env, result, ss.str().c_str(), commandQueue);
+  if (c->submitThreads) {
+    c->status = submitEngine::create(env, c->numQueues, &ctx->engine);
     REJECT_STATUS;
   }
 
-  deviceInfo *devInfo = new deviceInfo(clVersion(c->deviceVersion));
-  napi_value deviceInfoValue;
-  c->status = napi_create_external(env, devInfo, finalizeDevInfo, nullptr, &deviceInfoValue);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "deviceInfo", deviceInfoValue);
-  REJECT_STATUS;
-
-  napi_value createProgramValue;
-  c->status = napi_create_function(env, "createProgram", NAPI_AUTO_LENGTH,
-    createProgram, nullptr, &createProgramValue);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "createProgram", createProgramValue);
-  REJECT_STATUS;
-
-  napi_value createBufValue;
-  c->status = napi_create_function(env, "createBuffer", NAPI_AUTO_LENGTH,
-    createBuffer, nullptr, &createBufValue);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "createBuffer", createBufValue);
-  REJECT_STATUS;
-
-  napi_value waitFinishValue;
-  c->status = napi_create_function(env, "waitFinish", NAPI_AUTO_LENGTH,
-    waitFinish, nullptr, &waitFinishValue);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "waitFinish", waitFinishValue);
-  REJECT_STATUS;
+  if (c->eventCompletion) {
+    c->status = completionQueue::create(env, &ctx->completion);
+    REJECT_STATUS;
+  }
 
   napi_status status;
   status = napi_resolve_deferred(env, c->_deferred, result);
@@ -346,6 +387,8 @@ napi_value createContext(napi_env env, napi_callback_info info) {
     return nullptr;
   }
 
+  carrier->platformIndex = platformIndex;
+  carrier->deviceIndex = deviceIndex;
   carrier->platformId = platformIds[platformIndex];
   carrier->deviceId = deviceIds[deviceIndex];
 
@@ -376,6 +419,101 @@ napi_value createContext(napi_env env, napi_callback_info info) {
     CHECK_STATUS;
   }
 
+  napi_value cacheDirValue = nullptr;
+  status = napi_has_named_property(env, config, "cacheDir", &hasProp);
+  CHECK_STATUS;
+  if (hasProp) {
+    status = napi_get_named_property(env, config, "cacheDir", &cacheDirValue);
+    CHECK_STATUS;
+
+    status = napi_typeof(env, cacheDirValue, &t);
+    CHECK_STATUS;
+    if (t == napi_undefined)
+      cacheDirValue = nullptr;
+    else if (t != napi_string) {
+      status = napi_throw_type_error(env, nullptr, "Configuration parameter cacheDir must be a string.");
+      return nullptr;
+    }
+  }
+
+  status = napi_has_named_property(env, config, "profiling", &hasProp);
+  CHECK_STATUS;
+  if (hasProp) {
+    napi_value profilingValue;
+    status = napi_get_named_property(env, config, "profiling", &profilingValue);
+    CHECK_STATUS;
+
+    status = napi_typeof(env, profilingValue, &t);
+    CHECK_STATUS;
+    if (t == napi_boolean) {
+      status = napi_get_value_bool(env, profilingValue, &carrier->profiling);
+      CHECK_STATUS;
+    } else if (t != napi_undefined) {
+      status = napi_throw_type_error(env, nullptr, "Configuration parameter profiling must be a boolean.");
+      return nullptr;
+    }
+  }
+
+  status = napi_has_named_property(env, config, "submitThreads", &hasProp);
+  CHECK_STATUS;
+  if (hasProp) {
+    napi_value submitThreadsValue;
+    status = napi_get_named_property(env, config, "submitThreads", &submitThreadsValue);
+    CHECK_STATUS;
+
+    status = napi_typeof(env, submitThreadsValue, &t);
+    CHECK_STATUS;
+    if (t == napi_boolean) {
+      status = napi_get_value_bool(env, submitThreadsValue, &carrier->submitThreads);
+      CHECK_STATUS;
+    } else if (t != napi_undefined) {
+      status = napi_throw_type_error(env, nullptr, "Configuration parameter submitThreads must be a boolean.");
+      return nullptr;
+    }
+  }
+
+  status = napi_has_named_property(env, config, "eventCompletion", &hasProp);
+  CHECK_STATUS;
+  if (hasProp) {
+    napi_value eventCompletionValue;
+    status = napi_get_named_property(env, config, "eventCompletion", &eventCompletionValue);
+    CHECK_STATUS;
+
+    status = napi_typeof(env, eventCompletionValue, &t);
+    CHECK_STATUS;
+    if (t == napi_boolean) {
+      status = napi_get_value_bool(env, eventCompletionValue, &carrier->eventCompletion);
+      CHECK_STATUS;
+    } else if (t != napi_undefined) {
+      status = napi_throw_type_error(env, nullptr, "Configuration parameter eventCompletion must be a boolean.");
+      return nullptr;
+    }
+  }
+
+  status = napi_has_named_property(env, config, "arenaSize", &hasProp);
+  CHECK_STATUS;
+  if (hasProp) {
+    napi_value arenaSizeValue;
+    status = napi_get_named_property(env, config, "arenaSize", &arenaSizeValue);
+    CHECK_STATUS;
+
+    status = napi_typeof(env, arenaSizeValue, &t);
+    CHECK_STATUS;
+    if (t == napi_number) {
+      int64_t checkValue;
+      status = napi_get_value_int64(env, arenaSizeValue, &checkValue);
+      CHECK_STATUS;
+      if (checkValue < 0) {
+        status = napi_throw_range_error(env, nullptr, "Configuration parameter arenaSize cannot be negative.");
+        return nullptr;
+      }
+      carrier->arenaSize = (size_t)checkValue;
+    } else if (t != napi_undefined) {
+      status = napi_throw_type_error(env, nullptr, "Configuration parameter arenaSize must be a number.");
+      return nullptr;
+    }
+  }
+
   cl_ulong svmCaps;
   error = clGetDeviceInfo(carrier->deviceId, CL_DEVICE_SVM_CAPABILITIES, sizeof(cl_ulong), &svmCaps, nullptr);
   if (error == CL_INVALID_VALUE) {
@@ -384,8 +522,13 @@ napi_value createContext(napi_env env, napi_callback_info info) {
     CHECK_CL_ERROR;
   }
 
+  carrier->svmCaps = svmCaps;
+
+  nodenClasses *classes;
+  status = getClasses(env, &classes);
+  CHECK_STATUS;
   napi_value context;
-  status = napi_create_object(env, &context);
+  status = newInstance(env, classes->contextClass, &context);
   CHECK_STATUS;
 
   napi_value svmValue;
@@ -394,15 +537,27 @@ napi_value createContext(napi_env env, napi_callback_info info) {
   status = napi_set_named_property(env, context, "svmCaps", svmValue);
   CHECK_STATUS;
 
-  status = napi_set_named_property(env, context, "platformIndex", platformValue);
+  if (cacheDirValue) {
+    size_t cacheDirLength;
+    status = napi_get_value_string_utf8(env, cacheDirValue, nullptr, 0, &cacheDirLength);
+    CHECK_STATUS;
+    carrier->cacheDir.resize(cacheDirLength + 1);
+    status = napi_get_value_string_utf8(env, cacheDirValue, &carrier->cacheDir[0], cacheDirLength + 1, nullptr);
+    CHECK_STATUS;
+    carrier->cacheDir.resize(cacheDirLength);
+    status = napi_set_named_property(env, context, "cacheDir", cacheDirValue);
+    CHECK_STATUS;
+  }
+
+  napi_value profilingValue;
+  status = napi_get_boolean(env, carrier->profiling, &profilingValue);
   CHECK_STATUS;
-  status = napi_set_named_property(env, context, "deviceIndex", deviceValue);
+  status = napi_set_named_property(env, context, "profiling", profilingValue);
   CHECK_STATUS;
 
-  napi_value deviceIdValue;
-  status = napi_create_external(env, carrier->deviceId, nullptr, nullptr, &deviceIdValue);
+  status = napi_set_named_property(env, context, "platformIndex", platformValue);
   CHECK_STATUS;
-  status = napi_set_named_property(env, context, "deviceId", deviceIdValue);
+  status = napi_set_named_property(env, context, "deviceIndex", deviceValue);
   CHECK_STATUS;
 
   status = napi_create_reference(env, context, 1, &carrier->passthru);
@@ -423,3 +578,26 @@ napi_value createContext(napi_env env, napi_callback_info info) {
 
   return promise;
 }
+
+napi_value contextConstructor(napi_env env, napi_callback_info info) {
+  napi_status status;
+  napi_value thisValue;
+  status = napi_get_cb_info(env, info, nullptr, nullptr, &thisValue, nullptr);
+  CHECK_STATUS;
+  return thisValue;
+}
+
+napi_status defineContextClass(napi_env env, napi_ref *constructor) {
+  napi_status status;
+  napi_property_descriptor desc[] = {
+    DECLARE_NAPI_METHOD("createProgram", createProgram),
+    DECLARE_NAPI_METHOD("createBuffer", createBuffer),
+    DECLARE_NAPI_METHOD("wrapBuffer", wrapBuffer),
+    DECLARE_NAPI_METHOD("waitFinish", waitFinish)
+  };
+  napi_value contextClass;
+  status = napi_define_class(env, "nodenContext", NAPI_AUTO_LENGTH, contextConstructor, nullptr,
+    sizeof(desc) / sizeof(desc[0]), desc, &contextClass);
+  PASS_STATUS;
+  return napi_create_reference(env, contextClass, 1, constructor);
+}
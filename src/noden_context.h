@@ -23,6 +23,7 @@
 #include <tuple>
 #include "node_api.h"
 #include "noden_util.h"
+#include "cl_arena.h"
 
 class clVersion {
   public:
@@ -56,19 +57,66 @@ class clVersion {
 
 struct deviceInfo {
   clVersion oclVer;
+  // Alignments, in pixels, for images created over buffers - zero if not supported
+  cl_uint imagePitchAlignment;
+  cl_uint imageBaseAlignment;
+  // Largest single allocation, CL_DEVICE_MAX_MEM_ALLOC_SIZE
+  cl_ulong maxMemAllocSize;
 
-  deviceInfo(const clVersion& v) : oclVer(v) {}
+  deviceInfo(const clVersion& v) : oclVer(v), imagePitchAlignment(0), imageBaseAlignment(0), maxMemAllocSize(0) {}
+};
+
+class submitEngine;
+class completionQueue;
+
+// Native state of a context object, wrapped in it so that each method reaches it in one step
+struct contextState {
+  ~contextState();
+  cl_context context = nullptr;
+  cl_device_id deviceId = nullptr;
+  uint32_t platformIndex = 0;
+  uint32_t deviceIndex = 0;
+  std::vector<cl_command_queue> commandQueues;
+  bool profiling = false;
+  cl_ulong svmCaps = 0;
+  std::string cacheDir;
+  deviceInfo *devInfo = nullptr;
+  std::shared_ptr<clArena> arena;
+  submitEngine *engine = nullptr;
+  completionQueue *completion = nullptr;
+  // work queued on each command queue and not yet complete - carriers count until they are
+  // deleted and completion markers until the device reaches them
+  std::vector<std::shared_ptr<std::atomic<uint32_t>>> inFlight;
+
+  // Count the carrier's work as queued on the command queue until the carrier is deleted
+  void trackWork(uint32_t queueNum, carrier *c);
+  bool queueIdle(uint32_t queueNum) const;
 };
 
 struct createContextCarrier : carrier {
+  uint32_t platformIndex;
+  uint32_t deviceIndex;
+  cl_ulong svmCaps = 0;
+  std::string cacheDir;
   cl_platform_id platformId;
   cl_device_id deviceId;
   cl_context context;
   uint32_t numQueues;
+  bool profiling = false;
+  bool submitThreads = false;
+  bool eventCompletion = false;
+  size_t arenaSize = 0;
+  std::shared_ptr<clArena> arena;
   std::vector<cl_command_queue> commandQueues;
   std::string deviceVersion;
+  cl_uint imagePitchAlignment = 0;
+  cl_uint imageBaseAlignment = 0;
+  cl_ulong maxMemAllocSize = 0;
 };
 
 napi_value createContext(napi_env env, napi_callback_info info);
+napi_status defineContextClass(napi_env env, napi_ref *constructor);
+// The native state of a context object, throwing a TypeError if the value is not a context
+napi_status getContextState(napi_env env, napi_value contextValue, contextState **state);
 
 #endif
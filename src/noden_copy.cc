@@ -0,0 +1,145 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "noden_copy.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NODEN_COPY_STREAM
+#include <emmintrin.h>
+#endif
+
+// Below this size the cost of waking the helpers outweighs the gain
+static const size_t parallelMinBytes = 4 * 1024 * 1024;
+// Below this size the destination is likely to still be in cache, so normal stores are used
+static const size_t streamMinBytes = 1024 * 1024;
+// Chunks are small enough to balance the load between threads, and page aligned
+static const size_t chunkBytes = 2 * 1024 * 1024;
+
+static void streamCopy(uint8_t *dst, const uint8_t *src, size_t numBytes) {
+#ifdef NODEN_COPY_STREAM
+  size_t head = std::min<size_t>((16 - ((uintptr_t)dst & 15)) & 15, numBytes);
+  memcpy(dst, src, head);
+  dst += head;
+  src += head;
+  numBytes -= head;
+
+  size_t vecBytes = numBytes & ~(size_t)63;
+  for (size_t i = 0; i < vecBytes; i += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+    _mm_stream_si128((__m128i *)(dst + i), a);
+    _mm_stream_si128((__m128i *)(dst + i + 16), b);
+    _mm_stream_si128((__m128i *)(dst + i + 32), c);
+    _mm_stream_si128((__m128i *)(dst + i + 48), d);
+  }
+  memcpy(dst + vecBytes, src + vecBytes, numBytes - vecBytes);
+  // make the streamed stores visible before the copy is reported as done
+  _mm_sfence();
+#else
+  memcpy(dst, src, numBytes);
+#endif
+}
+
+copyEngine& copyEngine::get() {
+  // never destroyed, as helper threads cannot be joined safely while a module unloads
+  static copyEngine *engine = new copyEngine(
+    std::min<uint32_t>(std::max<uint32_t>(std::thread::hardware_concurrency() / 2, 2), 4) - 1);
+  return *engine;
+}
+
+copyEngine::copyEngine(uint32_t numHelpers) {
+  for (uint32_t t = 0; t < numHelpers; ++t) {
+    mThreads.push_back(std::thread(&copyEngine::helperLoop, this));
+    mThreads.back().detach();
+  }
+}
+
+void copyEngine::copy(void *dst, const void *src, size_t numBytes) {
+  copyJob job;
+  job.dst = (uint8_t *)dst;
+  job.src = (const uint8_t *)src;
+  job.numBytes = numBytes;
+  job.chunkBytes = chunkBytes;
+  job.numChunks = (numBytes + chunkBytes - 1) / chunkBytes;
+  job.next = 0;
+  job.done = 0;
+  job.active = 0;
+
+  // smaller copies run on the calling thread alone, streamed if large enough
+  if ((numBytes >= parallelMinBytes) && (job.numChunks > 1) && !mThreads.empty()) {
+    std::lock_guard<std::mutex> lk(mMutex);
+    mJobs.push_back(&job);
+    mWorkCv.notify_all();
+  }
+
+  while (runChunk(&job)) {}
+
+  // wait for the helpers to finish their chunks and let go of the job
+  std::unique_lock<std::mutex> lk(mMutex);
+  mDoneCv.wait(lk, [&job] { return (job.done.load() == job.numChunks) && (0 == job.active); });
+  auto it = std::find(mJobs.begin(), mJobs.end(), &job);
+  if (it != mJobs.end())
+    mJobs.erase(it);
+}
+
+bool copyEngine::runChunk(copyJob *job) {
+  size_t chunk = job->next.fetch_add(1);
+  if (chunk >= job->numChunks)
+    return false;
+  size_t offset = chunk * job->chunkBytes;
+  size_t bytes = std::min(job->chunkBytes, job->numBytes - offset);
+  if (job->numBytes >= streamMinBytes)
+    streamCopy(job->dst + offset, job->src + offset, bytes);
+  else
+    memcpy(job->dst + offset, job->src + offset, bytes);
+  if (job->done.fetch_add(1) + 1 == job->numChunks) {
+    std::lock_guard<std::mutex> lk(mMutex);
+    mDoneCv.notify_all();
+  }
+  return true;
+}
+
+void copyEngine::helperLoop() {
+  while (true) {
+    copyJob *job = nullptr;
+    {
+      std::unique_lock<std::mutex> lk(mMutex);
+      mWorkCv.wait(lk, [this] { return !mJobs.empty(); });
+      job = mJobs.front();
+      ++job->active;
+    }
+
+    while (runChunk(job)) {}
+
+    std::lock_guard<std::mutex> lk(mMutex);
+    // all chunks are claimed so no other helper needs to find the job
+    auto it = std::find(mJobs.begin(), mJobs.end(), job);
+    if (it != mJobs.end())
+      mJobs.erase(it);
+    --job->active;
+    mDoneCv.notify_all();
+  }
+}
+
+void parallelCopy(void *dst, const void *src, size_t numBytes) {
+  if (numBytes < streamMinBytes)
+    memcpy(dst, src, numBytes);
+  else
+    copyEngine::get().copy(dst, src, numBytes);
+}
@@ -0,0 +1,72 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef NODEN_COPY_H
+#define NODEN_COPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Copies large blocks of host memory, such as frames into pinned OpenCL buffers,
+// in chunks shared between the calling thread and a small pool of helper threads.
+// The destination is written with non-temporal stores where the CPU supports them
+// so that a copy larger than the caches does not evict the working set of other
+// threads, as the data is next read by the device rather than the CPU.
+class copyEngine {
+public:
+  // The engine shared by all contexts, with threads started on first use
+  static copyEngine& get();
+
+  // Returns once all of numBytes have been copied, using the helpers only for large copies.
+  // Safe to call from several threads at once.
+  void copy(void *dst, const void *src, size_t numBytes);
+
+  uint32_t numThreads() const { return (uint32_t)mThreads.size() + 1; }
+
+private:
+  struct copyJob {
+    uint8_t *dst;
+    const uint8_t *src;
+    size_t numBytes;
+    size_t chunkBytes;
+    size_t numChunks;
+    std::atomic<size_t> next;
+    std::atomic<size_t> done;
+    uint32_t active; // helper threads holding the job, guarded by mMutex
+  };
+
+  copyEngine(uint32_t numHelpers);
+  ~copyEngine() {}
+
+  void helperLoop();
+  bool runChunk(copyJob *job);
+
+  std::vector<std::thread> mThreads;
+  std::mutex mMutex;
+  std::condition_variable mWorkCv;
+  std::condition_variable mDoneCv;
+  std::deque<copyJob*> mJobs;
+};
+
+// Copy with the shared engine, falling back to memcpy for blocks small enough to stay in cache
+void parallelCopy(void *dst, const void *src, size_t numBytes);
+
+#endif
@@ -0,0 +1,329 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "noden_prepared.h"
+#include "noden_context.h"
+#include "noden_program.h"
+#include "cl_memory.h"
+#include "noden_submit.h"
+#include <cstring>
+
+void finalizePrepared(napi_env env, void* data, void* hint) {
+  printf("Prepared run finalizer called.\n");
+  preparedRun* pr = (preparedRun*) data;
+  for (auto& refIter: pr->bufferRefs)
+    napi_delete_reference(env, refIter.second);
+  for (auto& paramIter: pr->kernelParams)
+    delete paramIter.second;
+  if (pr->kernel) {
+    cl_int error = clReleaseKernel(pr->kernel);
+    if (error != CL_SUCCESS) printf("Failed to release CL kernel.\n");
+  }
+  if (pr->programRef)
+    napi_delete_reference(env, pr->programRef);
+  delete pr;
+}
+
+bool sameValue(const kernelParam* a, const kernelParam* b) {
+  if (a->valueType != b->valueType) return false;
+  if (eParamFlags::VALUE != a->valueType) return a->value.clMem == b->value.clMem;
+  switch (a->paramType) {
+  case iKernelArg::eType::UINT: return a->value.uint32 == b->value.uint32;
+  case iKernelArg::eType::INT: return a->value.int32 == b->value.int32;
+  case iKernelArg::eType::LONG: return a->value.int64 == b->value.int64;
+  case iKernelArg::eType::FLOAT: return 0 == memcmp(&a->value.flt, &b->value.flt, sizeof(float));
+  case iKernelArg::eType::DOUBLE: return 0 == memcmp(&a->value.dbl, &b->value.dbl, sizeof(double));
+  default: return false;
+  }
+}
+
+// Resolve a single named parameter against the prepared state, keeping the
+// existing kernel argument when the value has not changed.
+napi_status bindParam(napi_env env, preparedRun* pr, uint32_t p, napi_value paramValue) {
+  napi_status status;
+  iKernelArg *ka = pr->runParams->kernelArgMap().at(p);
+  kernelParam update(ka->name(), ka->argType(), ka->access());
+  status = setParamValue(env, paramValue, &update);
+  PASS_STATUS;
+
+  auto paramIter = pr->kernelParams.find(p);
+  kernelParam* kp = nullptr;
+  if (pr->kernelParams.end() == paramIter) {
+    kp = new kernelParam(ka->name(), ka->argType(), ka->access());
+    pr->kernelParams.emplace(p, kp);
+  } else {
+    kp = paramIter->second;
+    if (sameValue(kp, &update))
+      return napi_ok;
+  }
+
+  kp->valueType = update.valueType;
+  kp->value = update.value;
+  kp->changed = true;
+
+  // hold the buffer object so that its OpenCL memory outlives the prepared run
+  auto refIter = pr->bufferRefs.find(p);
+  if (pr->bufferRefs.end() != refIter) {
+    status = napi_delete_reference(env, refIter->second);
+    PASS_STATUS;
+    pr->bufferRefs.erase(refIter);
+  }
+  if (eParamFlags::VALUE != kp->valueType) {
+    napi_ref bufferRef;
+    status = napi_create_reference(env, paramValue, 1, &bufferRef);
+    PASS_STATUS;
+    pr->bufferRefs.emplace(p, bufferRef);
+  }
+  return napi_ok;
+}
+
+napi_status bindParams(napi_env env, preparedRun* pr, napi_value params) {
+  napi_status status;
+  napi_value namesValue;
+  status = napi_get_property_names(env, params, &namesValue);
+  PASS_STATUS;
+
+  uint32_t namesCount;
+  status = napi_get_array_length(env, namesValue, &namesCount);
+  PASS_STATUS;
+
+  for (uint32_t n = 0; n < namesCount; ++n) {
+    napi_value nameValue;
+    status = napi_get_element(env, namesValue, n, &nameValue);
+    PASS_STATUS;
+
+    char name[256];
+    status = napi_get_value_string_utf8(env, nameValue, name, 256, nullptr);
+    PASS_STATUS;
+    auto indexIter = pr->argIndex.find(name);
+    if (pr->argIndex.end() == indexIter) {
+      printf("Parameter name \'%s\' is not a kernel parameter\n", name);
+      napi_throw_error(env, nullptr, "Parameter name is not a kernel parameter");
+      return napi_pending_exception;
+    }
+
+    napi_value paramValue;
+    status = napi_get_property(env, params, nameValue, &paramValue);
+    PASS_STATUS;
+    status = bindParam(env, pr, indexIter->second, paramValue);
+    PASS_STATUS;
+  }
+  return napi_ok;
+}
+
+void preparedComplete(napi_env env, napi_status asyncStatus, void* data) {
+  preparedCarrier* c = (preparedCarrier*) data;
+  c->prepared->inFlight = false;
+
+  if (asyncStatus != napi_ok) {
+    c->status = asyncStatus;
+    c->errorMsg = "Async run of prepared program failed to complete.";
+  }
+  REJECT_STATUS;
+
+  napi_value result;
+  c->status = runTimings(env, c, &result);
+  REJECT_STATUS;
+
+  napi_status status;
+  status = napi_resolve_deferred(env, c->_deferred, result);
+  FLOATING_STATUS;
+
+  tidyCarrier(env, c);
+}
+
+napi_value preparedRunCall(napi_env env, napi_callback_info info) {
+  napi_status status;
+  preparedRun* pr = nullptr;
+
+  napi_value args[3];
+  size_t argc = 3;
+  status = napi_get_cb_info(env, info, &argc, args, nullptr, (void**)&pr);
+  CHECK_STATUS;
+
+  if (argc > 3) {
+    status = napi_throw_error(env, nullptr, "Wrong number of arguments. At most three expected.");
+    return nullptr;
+  }
+
+  if (pr->inFlight) {
+    status = napi_throw_error(env, nullptr, "Prepared run is already in progress.");
+    return nullptr;
+  }
+
+  napi_valuetype t;
+  size_t a = 0;
+  if (argc > a) {
+    status = napi_typeof(env, args[a], &t);
+    CHECK_STATUS;
+    if (napi_object == t) {
+      status = bindParams(env, pr, args[a]);
+      if (napi_pending_exception == status) return nullptr;
+      CHECK_STATUS;
+      ++a;
+    }
+  }
+
+  uint32_t queueNum = 0;
+  uint32_t numQueues = (uint32_t)pr->ctx->commandQueues.size();
+  if (argc > a) {
+    status = parseQueueNum(env, args[a], numQueues, &queueNum);
+    if (napi_pending_exception == status) return nullptr;
+    CHECK_STATUS;
+    ++a;
+  } else if (numQueues > 1)
+    printf("run queueNum parameter not provided - defaulting to 0\n");
+
+  preparedCarrier* c = new preparedCarrier;
+  c->prepared = pr;
+  c->kernelParams = pr->kernelParams;
+  c->ownsParams = false;
+  c->runParams = pr->runParams;
+  if (argc > a) {
+    status = getEventOptions(env, args[a], c->events);
+    if (napi_pending_exception == status) {
+      delete c;
+      return nullptr;
+    }
+    CHECK_STATUS;
+    status = getNDRangeOptions(env, args[a], c);
+    if (napi_pending_exception == status) {
+      delete c;
+      return nullptr;
+    }
+    CHECK_STATUS;
+  }
+
+  c->ctx = pr->ctx;
+  c->context = pr->ctx->context;
+  c->commandQueues = pr->ctx->commandQueues;
+  c->kernel = pr->kernel;
+  c->queueNum = queueNum;
+  c->events.setProfiling(pr->ctx->profiling);
+
+  napi_value programValue;
+  status = napi_get_reference_value(env, pr->programRef, &programValue);
+  CHECK_STATUS;
+  status = napi_create_reference(env, programValue, 1, &c->passthru);
+  CHECK_STATUS;
+
+  napi_value promise;
+  status = napi_create_promise(env, &c->_deferred, &promise);
+  CHECK_STATUS;
+
+  pr->inFlight = true;
+  status = queueRun(env, pr->ctx, "PreparedRun", runExecute, preparedComplete, c);
+  CHECK_STATUS;
+
+  return promise;
+}
+
+napi_value prepare(napi_env env, napi_callback_info info) {
+  napi_status status;
+  cl_int error;
+
+  napi_value args[1];
+  size_t argc = 1;
+  napi_value programValue;
+  status = napi_get_cb_info(env, info, &argc, args, &programValue, nullptr);
+  CHECK_STATUS;
+
+  if (argc != 1) {
+    status = napi_throw_error(env, nullptr, "Wrong number of arguments. One expected.");
+    return nullptr;
+  }
+
+  napi_valuetype t;
+  status = napi_typeof(env, args[0], &t);
+  CHECK_STATUS;
+  if (t != napi_object) {
+    status = napi_throw_type_error(env, nullptr, "Parameter must be an object.");
+    return nullptr;
+  }
+
+  programState *state;
+  status = getProgramState(env, programValue, &state);
+  if (napi_pending_exception == status) return nullptr;
+  CHECK_STATUS;
+  iRunParams *runParams = state->runParams;
+
+  napi_value runNamesValue;
+  status = napi_get_property_names(env, args[0], &runNamesValue);
+  CHECK_STATUS;
+  uint32_t runNamesCount;
+  status = napi_get_array_length(env, runNamesValue, &runNamesCount);
+  CHECK_STATUS;
+  uint32_t argNamesCount = (uint32_t)runParams->kernelArgMap().size();
+  if (argNamesCount != runNamesCount) {
+    status = napi_throw_error(env, nullptr, "Incorrect number of parameters");
+    return nullptr;
+  }
+
+  cl_program program = state->program;
+  cl_kernel programKernel = state->kernel;
+
+  size_t nameLength = 0;
+  error = clGetKernelInfo(programKernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr, &nameLength);
+  CHECK_CL_ERROR;
+  std::string kernelName(nameLength, '\0');
+  error = clGetKernelInfo(programKernel, CL_KERNEL_FUNCTION_NAME, nameLength, &kernelName[0], nullptr);
+  CHECK_CL_ERROR;
+
+  preparedRun* pr = new preparedRun;
+  pr->runParams = runParams;
+  pr->ctx = state->ctx;
+  pr->kernel = clCreateKernel(program, kernelName.c_str(), &error);
+  if (error != CL_SUCCESS) delete pr;
+  CHECK_CL_ERROR;
+
+  // wrap immediately so that the finalizer tidies up on any later failure
+  napi_value result, preparedValue;
+  status = napi_create_object(env, &result);
+  CHECK_STATUS;
+  status = napi_create_external(env, pr, finalizePrepared, nullptr, &preparedValue);
+  CHECK_STATUS;
+  status = napi_set_named_property(env, result, "prepared", preparedValue);
+  CHECK_STATUS;
+
+  for (auto& argIter: runParams->kernelArgMap())
+    pr->argIndex.emplace(argIter.second->name(), argIter.first);
+
+  const tKernelArgMap& kernelArgMap = runParams->kernelArgMap();
+  for (uint32_t p = 0; p < argNamesCount; ++p) {
+    napi_value paramValue;
+    status = napi_get_named_property(env, args[0], kernelArgMap.at(p)->name().c_str(), &paramValue);
+    CHECK_STATUS;
+    status = bindParam(env, pr, p, paramValue);
+    if (napi_pending_exception == status) return nullptr;
+    CHECK_STATUS;
+  }
+
+  napi_value numQueuesVal;
+  status = napi_create_uint32(env, (uint32_t)pr->ctx->commandQueues.size(), &numQueuesVal);
+  CHECK_STATUS;
+  status = napi_set_named_property(env, result, "numQueues", numQueuesVal);
+  CHECK_STATUS;
+
+  status = napi_create_reference(env, programValue, 1, &pr->programRef);
+  CHECK_STATUS;
+
+  napi_value runValue;
+  status = napi_create_function(env, "run", NAPI_AUTO_LENGTH, preparedRunCall, pr, &runValue);
+  CHECK_STATUS;
+  status = napi_set_named_property(env, result, "run", runValue);
+  CHECK_STATUS;
+
+  return result;
+}
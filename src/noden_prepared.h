@@ -0,0 +1,47 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef NODEN_PREPARED_H
+#define NODEN_PREPARED_H
+
+#include "cl_include.h"
+#include <string>
+#include <vector>
+#include <map>
+#include "node_api.h"
+#include "noden_util.h"
+#include "noden_run.h"
+
+// Kernel arguments resolved once by program.prepare() and kept between runs.
+// Each prepared run owns its own kernel object so that argument values set on
+// it stay valid and only changed values need to be set again.
+struct preparedRun {
+  cl_kernel kernel = nullptr;
+  iRunParams *runParams = nullptr;
+  contextState *ctx = nullptr; // held by the program, that programRef holds
+  std::map<uint32_t, kernelParam*> kernelParams;
+  std::map<std::string, uint32_t> argIndex;
+  std::map<uint32_t, napi_ref> bufferRefs;
+  napi_ref programRef = nullptr;
+  bool inFlight = false;
+};
+
+struct preparedCarrier : runCarrier {
+  preparedRun *prepared = nullptr;
+};
+
+napi_value prepare(napi_env env, napi_callback_info info);
+
+#endif
@@ -14,7 +14,11 @@
 */
 
 #include "noden_program.h"
+#include "noden_context.h"
 #include "noden_run.h"
+#include "noden_prepared.h"
+#include "noden_autotune.h"
+#include "noden_cache.h"
 #include "run_params.h"
 #include <regex>
 #include <sstream>
@@ -22,12 +26,13 @@
 class kernelArg : public iKernelArg {
   public:
     kernelArg(const std::string& name, const std::string& type, eAccess access)
-      : mName(name), mType(type), mAccess(access) {}
+      : mName(name), mType(type), mAccess(access), mArgType(parseType(type)) {}
     ~kernelArg() {}
 
     std::string name() const { return mName; }
     std::string type() const { return mType; }
     eAccess access() const { return mAccess; }
+    eType argType() const { return mArgType; }
 
     std::string toString() const {
       return mType + " " + mName + (eAccess::READONLY == mAccess ? " readonly" :
@@ -39,18 +44,41 @@ class kernelArg : public iKernelArg {
     const std::string mName;
     const std::string mType;
     const eAccess mAccess;
+    const eType mArgType;
+
+    // resolve the type name once at build time so that runs can switch on it
+    static eType parseType(const std::string& type) {
+      if (0 == type.compare("uint")) return eType::UINT;
+      if (0 == type.compare("int")) return eType::INT;
+      if (0 == type.compare("long")) return eType::LONG;
+      if (0 == type.compare("float")) return eType::FLOAT;
+      if (0 == type.compare("double")) return eType::DOUBLE;
+      if (0 == type.compare("image2d_t")) return eType::IMAGE;
+      if (std::string::npos != type.find('*')) return eType::BUFFER;
+      return eType::UNKNOWN;
+    }
 };
 
 class runParams : public iRunParams {
 public:
-  runParams(const std::vector<size_t>& gwi, const std::vector<size_t>& wig, const tKernelArgMap& kernelArgMap) :
-    mGlobalWorkItems(gwi), mWorkItemsPerGroup(wig), mKernelArgMap(kernelArgMap) {}
+  runParams(const std::vector<size_t>& gwi, const std::vector<size_t>& wig, size_t kernelWorkGroupSize,
+            const tKernelArgMap& kernelArgMap) :
+    mGlobalWorkItems(gwi), mKernelWorkGroupSize(kernelWorkGroupSize), mKernelArgMap(kernelArgMap) {
+    setWorkItemsPerGroup(wig);
+  }
   ~runParams() {}
 
   size_t numDims() const { return mGlobalWorkItems.size(); }
   const size_t *globalWorkItems() const { return mGlobalWorkItems.data(); }
-  const size_t *workItemsPerGroup() const { return mWorkItemsPerGroup.data(); }
-  const tKernelArgMap kernelArgMap() const { return mKernelArgMap; }
+  std::shared_ptr<const std::vector<size_t>> workItemsPerGroup() const { return std::atomic_load(&mWorkItemsPerGroup); }
+  size_t kernelWorkGroupSize() const { return mKernelWorkGroupSize; }
+  void setWorkItemsPerGroup(const std::vector<size_t>& wig) {
+    std::shared_ptr<const std::vector<size_t>> snapshot;
+    if (!wig.empty())
+      snapshot = std::make_shared<const std::vector<size_t>>(wig);
+    std::atomic_store(&mWorkItemsPerGroup, snapshot);
+  }
+  const tKernelArgMap& kernelArgMap() const { return mKernelArgMap; }
 
   void argDebug(const std::string& kernelName) const {
     printf("%s (\n", kernelName.c_str());
@@ -64,48 +92,149 @@ public:
 
 private:
   const std::vector<size_t> mGlobalWorkItems;
-  const std::vector<size_t> mWorkItemsPerGroup;
+  // replaced as a whole, never modified, so that runs in flight keep the size they started with
+  std::shared_ptr<const std::vector<size_t>> mWorkItemsPerGroup;
+  const size_t mKernelWorkGroupSize;
   const tKernelArgMap mKernelArgMap;
 };
 
-void tidyProgram(napi_env env, void* data, void* hint) {
-  printf("Program finalizer called.\n");
+static const napi_type_tag programTag = { 0x6e6f64656e636c01ULL, 0x70726f6772616d01ULL };
+
+programState::~programState() {
+  delete kernels;
   cl_int error = CL_SUCCESS;
-  error = clReleaseProgram((cl_program) data);
-  if (error != CL_SUCCESS) printf("Failed to release CL program.\n");
+  if (kernel) {
+    error = clReleaseKernel(kernel);
+    if (error != CL_SUCCESS) printf("Failed to release CL kernel.\n");
+  }
+  if (program) {
+    error = clReleaseProgram(program);
+    if (error != CL_SUCCESS) printf("Failed to release CL program.\n");
+  }
+  if (runParams) {
+    for (auto& argIter: runParams->kernelArgMap())
+      delete argIter.second;
+    delete runParams;
+  }
 }
 
-void tidyKernel(napi_env env, void* data, void* hint) {
-  printf("Kernel finalizer called.\n");
-  cl_int error = CL_SUCCESS;
-  error = clReleaseKernel((cl_kernel) data);
-  if (error != CL_SUCCESS) printf("Failed to release CL kernel.\n");
+void finalizeProgram(napi_env env, void* data, void* hint) {
+  printf("Program finalizer called.\n");
+  programState *state = (programState*)data;
+  napi_status status = napi_delete_reference(env, state->contextRef);
+  checkStatus(env, status, __FILE__, __LINE__ - 1);
+  delete state;
 }
 
-void tidyParams(napi_env env, void* data, void* hint) {
-  printf("Params finalizer called.\n");
-  iRunParams *rp = (iRunParams*)data;
-  for (auto& argIter: rp->kernelArgMap())
-     delete argIter.second;
-  delete rp;
+napi_status getProgramState(napi_env env, napi_value programValue, programState **state) {
+  return unwrapState(env, programValue, &programTag, "an OpenCL program", (void**)state);
 }
 
-void tidyProgramContextRef(napi_env env, void* data, void* hint) {
-  napi_ref contextRef = (napi_ref)data;
-  printf("Finalizing a program context reference.\n");
-  napi_delete_reference(env, contextRef);
+// Create an unbuilt program object holding the given context, for a build to complete
+napi_status newProgram(napi_env env, napi_value contextValue, contextState *ctx, buildCarrier *c, napi_value *result) {
+  napi_status status;
+  nodenClasses *classes;
+  status = getClasses(env, &classes);
+  PASS_STATUS;
+  status = newInstance(env, classes->programClass, result);
+  PASS_STATUS;
+
+  programState *state = new programState;
+  state->ctx = ctx;
+  status = napi_create_reference(env, contextValue, 1, &state->contextRef);
+  if (napi_ok != status) {
+    delete state;
+    return status;
+  }
+  status = wrapState(env, *result, &programTag, state, finalizeProgram);
+  if (napi_ok != status) {
+    napi_delete_reference(env, state->contextRef);
+    delete state;
+    return status;
+  }
+  c->state = state;
+
+  c->context = ctx->context;
+  c->deviceId = ctx->deviceId;
+  c->platformIndex = ctx->platformIndex;
+  c->deviceIndex = ctx->deviceIndex;
+  c->numQueues = (uint32_t)ctx->commandQueues.size();
+  c->cacheDir = ctx->cacheDir;
+
+  napi_value numQueuesValue;
+  status = napi_create_uint32(env, c->numQueues, &numQueuesValue);
+  PASS_STATUS;
+  return napi_set_named_property(env, *result, "numQueues", numQueuesValue);
 }
 
-cl_int getArgInfo(cl_kernel kernel, cl_uint arg, cl_uint param, std::string& info) {
-  size_t paramLen = 0;
-  cl_int error = clGetKernelArgInfo(kernel, arg, param, 0, nullptr, &paramLen);
-  PASS_CL_ERROR;
-  char* paramStr = (char *)malloc(sizeof(char) * paramLen);
-  error = clGetKernelArgInfo(kernel, arg, param, paramLen, paramStr, NULL);
-  PASS_CL_ERROR;
-  info = std::string(paramStr);
-  free(paramStr);
-  return error;
+buildCarrier::~buildCarrier() {
+  delete kernels;
+  if (retainedProgram) clReleaseProgram(program);
+}
+
+// Device facts made available to every kernel as macros
+const struct { cl_device_info deviceInfo; const char* macro; } deviceMacros[] = {
+  { CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR, "NODEN_PREFERRED_VECTOR_WIDTH_CHAR" },
+  { CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT, "NODEN_PREFERRED_VECTOR_WIDTH_SHORT" },
+  { CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, "NODEN_PREFERRED_VECTOR_WIDTH_INT" },
+  { CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG, "NODEN_PREFERRED_VECTOR_WIDTH_LONG" },
+  { CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, "NODEN_PREFERRED_VECTOR_WIDTH_FLOAT" },
+  { CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE, "NODEN_PREFERRED_VECTOR_WIDTH_DOUBLE" },
+  { CL_DEVICE_PREFERRED_VECTOR_WIDTH_HALF, "NODEN_PREFERRED_VECTOR_WIDTH_HALF" }
+};
+
+// Build the program from source, or load it from the program cache
+void buildProgram(buildCarrier* c) {
+  cl_int error;
+  std::stringstream optss;
+  optss << "-cl-kernel-arg-info -cl-std=CL3.0";
+  for (auto& deviceMacro: deviceMacros) {
+    cl_uint value;
+    error = clGetDeviceInfo(c->deviceId, deviceMacro.deviceInfo, sizeof(cl_uint), &value, nullptr);
+    ASYNC_CL_ERROR;
+    optss << " -D" << deviceMacro.macro << "=" << value;
+  }
+  for (auto& define: c->defines)
+    optss << " -D" << define.first << "=" << define.second;
+  if (!c->buildOptions.empty())
+    optss << " " << c->buildOptions;
+  std::string buildOptions = optss.str();
+
+  uint64_t cacheKey = 0;
+  std::string cachePath;
+  if (!c->cacheDir.empty()) {
+    error = programCacheKey(c->deviceId, c->kernelSource, buildOptions, cacheKey);
+    ASYNC_CL_ERROR;
+    cachePath = programCachePath(c->cacheDir, cacheKey, ".clbin");
+    c->fromCache = loadProgramBinary(c->context, c->deviceId, cachePath, cacheKey,
+      buildOptions, c->program, c->cachedKernels);
+  }
+
+  if (!c->fromCache) {
+    const char* kernelSource[1];
+    kernelSource[0] = c->kernelSource.data();
+    c->program = clCreateProgramWithSource(c->context, 1, kernelSource,
+      nullptr, &error);
+    ASYNC_CL_ERROR;
+
+    error = clBuildProgram(c->program, 0, nullptr, buildOptions.c_str(), nullptr, nullptr);
+    if (error != CL_SUCCESS) {
+      size_t len;
+      clGetProgramBuildInfo(c->program, c->deviceId, CL_PROGRAM_BUILD_LOG,
+        0, NULL, &len);
+      char* buffer = (char*)std::calloc(len, sizeof(char));
+
+      clGetProgramBuildInfo(c->program, c->deviceId, CL_PROGRAM_BUILD_LOG,
+        len, buffer, NULL);
+      c->status = NODEN_BUILD_ERROR;
+      c->errorMsg = std::string(buffer);
+      free(buffer);
+      return;
+    }
+
+    if (!cachePath.empty())
+      saveProgramBinary(c->program, cachePath, cacheKey);
+  }
 }
 
 // Promise to create a program with context and queue
@@ -133,28 +262,24 @@ void buildExecute(napi_env env, void* data) {
   // printf("globalWorkItems: %s, workItemsPerGroup: %s\n", gwiss.str().c_str(), wigss.str().c_str());
   HR_TIME_POINT start = NOW;
 
-  const char* kernelSource[1];
-  kernelSource[0] = c->kernelSource.data();
-  c->program = clCreateProgramWithSource(c->context, 1, kernelSource,
-    nullptr, &error);
-  ASYNC_CL_ERROR;
-
-  const char* buildOptions = "-cl-kernel-arg-info -cl-std=CL3.0";
-  error = clBuildProgram(c->program, 0, nullptr, buildOptions, nullptr, nullptr);
-  if (error != CL_SUCCESS) {
-    size_t len;
-    clGetProgramBuildInfo(c->program, c->deviceId, CL_PROGRAM_BUILD_LOG,
-      0, NULL, &len);
-    char* buffer = (char*)std::calloc(len, sizeof(char));
-
-    clGetProgramBuildInfo(c->program, c->deviceId, CL_PROGRAM_BUILD_LOG,
-      len, buffer, NULL);
-    c->status = NODEN_BUILD_ERROR;
-    c->errorMsg = std::string(buffer);
-    delete[] buffer;
-    return;
+  // kernels created from an existing program share its build
+  if (!c->program) {
+    buildProgram(c);
+    if (NODEN_SUCCESS != c->status)
+      return;
   }
 
+  size_t namesSize;
+  error = clGetProgramInfo(c->program, CL_PROGRAM_KERNEL_NAMES, 0, nullptr, &namesSize);
+  ASYNC_CL_ERROR;
+  std::string names(namesSize, '\0');
+  error = clGetProgramInfo(c->program, CL_PROGRAM_KERNEL_NAMES, namesSize, &names[0], nullptr);
+  ASYNC_CL_ERROR;
+  std::stringstream namess(names.c_str());
+  std::string name;
+  while (std::getline(namess, name, ';'))
+    if (!name.empty()) c->kernelNames.push_back(name);
+
   c->kernel = clCreateKernel(c->program, c->kernelName.c_str(), &error);
   ASYNC_CL_ERROR;
 
@@ -177,30 +302,28 @@ void buildExecute(napi_env env, void* data) {
     return;
   }
 
-  cl_uint numArgs = 0;
-  error = clGetKernelInfo(c->kernel, CL_KERNEL_NUM_ARGS, sizeof(numArgs), &numArgs, NULL);
+  c->kernels = new queueKernels;
+  error = c->kernels->create(c->kernel, c->numQueues);
   ASYNC_CL_ERROR;
 
-  tKernelArgMap kernelArgMap;
-  for (cl_uint p=0; p<numArgs; ++p) {
-    std::string argName;
-    error = getArgInfo(c->kernel, p, CL_KERNEL_ARG_NAME, argName);
-    ASYNC_CL_ERROR;
-
-    std::string argType;
-    error = getArgInfo(c->kernel, p, CL_KERNEL_ARG_TYPE_NAME, argType);
-    ASYNC_CL_ERROR;
+  tArgInfos argInfos;
+  error = getKernelArgInfos(c->kernel, argInfos);
+  if ((error != CL_SUCCESS) && c->fromCache) {
+    // drivers may not keep argument info for programs built from binaries
+    auto cachedIter = c->cachedKernels.find(c->kernelName);
+    if (c->cachedKernels.end() != cachedIter) {
+      argInfos = cachedIter->second;
+      error = CL_SUCCESS;
+    }
+  }
+  ASYNC_CL_ERROR;
 
-    cl_kernel_arg_access_qualifier accessQualifier;
-    error = clGetKernelArgInfo(c->kernel, p, CL_KERNEL_ARG_ACCESS_QUALIFIER, sizeof(accessQualifier), &accessQualifier, NULL);
-    ASYNC_CL_ERROR;
-    kernelArg::eAccess argAccess(CL_KERNEL_ARG_ACCESS_READ_ONLY == accessQualifier ? kernelArg::eAccess::READONLY :
-                                 CL_KERNEL_ARG_ACCESS_WRITE_ONLY == accessQualifier ? kernelArg::eAccess::WRITEONLY :
-                                 kernelArg::eAccess::NONE);
-    kernelArg *ka = new kernelArg(argName, argType, argAccess);
-    kernelArgMap.emplace(p, ka);
+  tKernelArgMap kernelArgMap;
+  for (size_t p=0; p<argInfos.size(); ++p) {
+    kernelArg *ka = new kernelArg(argInfos[p].name, argInfos[p].type, argInfos[p].access);
+    kernelArgMap.emplace((uint32_t)p, ka);
   }
-  c->runParams = new runParams(c->globalWorkItems, c->workItemsPerGroup, kernelArgMap);
+  c->runParams = new runParams(c->globalWorkItems, c->workItemsPerGroup, deviceWorkGroupSize, kernelArgMap);
 
   c->totalTime = microTime(start);
 }
@@ -218,22 +341,28 @@ void buildComplete(napi_env env, napi_status asyncStatus, void* data) {
   c->status = napi_get_reference_value(env, c->passthru, &result);
   REJECT_STATUS;
 
-  napi_value jsDeviceId;
-  c->status = napi_create_external(env, c->deviceId, nullptr, nullptr, &jsDeviceId);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "deviceId", jsDeviceId);
-  REJECT_STATUS;
-
-  napi_value jsExtProgram;
-  c->status = napi_create_external(env, c->program, tidyProgram, nullptr, &jsExtProgram);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "program", jsExtProgram);
-  REJECT_STATUS;
-
-  napi_value jsKernel;
-  c->status = napi_create_external(env, c->kernel, tidyKernel, nullptr, &jsKernel);
+  // the state owns the program and its kernels from here
+  programState *state = c->state;
+  state->program = c->program;
+  c->retainedProgram = false;
+  state->kernel = c->kernel;
+  state->kernels = c->kernels;
+  c->kernels = nullptr;
+  state->runParams = c->runParams;
+  state->kernelInfos = c->cachedKernels;
+  state->fromCache = c->fromCache;
+
+  napi_value jsKernelNames;
+  c->status = napi_create_array_with_length(env, c->kernelNames.size(), &jsKernelNames);
   REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "kernel", jsKernel);
+  for (size_t i = 0; i < c->kernelNames.size(); ++i) {
+    napi_value jsKernelName;
+    c->status = napi_create_string_utf8(env, c->kernelNames[i].c_str(), NAPI_AUTO_LENGTH, &jsKernelName);
+    REJECT_STATUS;
+    c->status = napi_set_element(env, jsKernelNames, (uint32_t)i, jsKernelName);
+    REJECT_STATUS;
+  }
+  c->status = napi_set_named_property(env, result, "kernelNames", jsKernelNames);
   REJECT_STATUS;
 
   napi_value jsBuildTime;
@@ -242,17 +371,10 @@ void buildComplete(napi_env env, napi_status asyncStatus, void* data) {
   c->status = napi_set_named_property(env, result, "buildTime", jsBuildTime);
   REJECT_STATUS;
 
-  napi_value runParamsValue;
-  c->status = napi_create_external(env, c->runParams, tidyParams, nullptr, &runParamsValue);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "runParams", runParamsValue);
-  REJECT_STATUS;
-
-  napi_value runValue;
-  c->status = napi_create_function(env, "run", NAPI_AUTO_LENGTH, run,
-    nullptr, &runValue);
+  napi_value jsFromCache;
+  c->status = napi_get_boolean(env, c->fromCache, &jsFromCache);
   REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "run", runValue);
+  c->status = napi_set_named_property(env, result, "fromCache", jsFromCache);
   REJECT_STATUS;
 
   napi_status status;
@@ -262,6 +384,186 @@ void buildComplete(napi_env env, napi_status asyncStatus, void* data) {
   tidyCarrier(env, c);
 }
 
+// Read the globalWorkItems and optional workItemsPerGroup of a program configuration
+napi_status parseWorkItems(napi_env env, napi_value config, buildCarrier* carrier) {
+  napi_status status;
+  napi_valuetype t;
+  bool hasProp;
+  napi_value globalWorkItemsValue;
+  status = napi_has_named_property(env, config, "globalWorkItems", &hasProp);
+  PASS_STATUS;
+  if (!hasProp) {
+    status = napi_throw_type_error(env, nullptr, "globalWorkItems parameter must be provided.");
+    return napi_pending_exception;
+  }
+  status = napi_get_named_property(env, config, "globalWorkItems", &globalWorkItemsValue);
+  PASS_STATUS;
+
+  bool hasWIG = false;
+  napi_value workItemsPerGroupValue;
+  status = napi_has_named_property(env, config, "workItemsPerGroup", &hasWIG);
+  PASS_STATUS;
+  if (hasWIG) {
+    status = napi_get_named_property(env, config, "workItemsPerGroup", &workItemsPerGroupValue);
+    PASS_STATUS;
+  }
+
+  status = napi_typeof(env, globalWorkItemsValue, &t);
+  PASS_STATUS;
+  if (napi_number == t) {
+    // OpenCL 1 dimension buffer mode
+    uint32_t gwi, wig;
+    status = napi_get_value_uint32(env, globalWorkItemsValue, &gwi);
+    PASS_STATUS;
+    carrier->globalWorkItems.push_back(gwi);
+    if (hasWIG) {
+      status = napi_get_value_uint32(env, workItemsPerGroupValue, &wig);
+      PASS_STATUS;
+      carrier->workItemsPerGroup.push_back(wig);
+    }
+  } else {
+    // OpenCL 2+ dimension image mode
+    napi_typedarray_type taType;
+    size_t gwiNumDims;
+    uint32_t* gwiData;
+    napi_value arrbuf;
+    size_t byteOffset;
+    status = napi_get_typedarray_info(env, globalWorkItemsValue, &taType, &gwiNumDims, (void**)&gwiData, &arrbuf, &byteOffset);
+    PASS_STATUS;
+    if (napi_uint32_array != taType) {
+      status = napi_throw_type_error(env, nullptr, "globalWorkItems parameter must be a Uint32Array.");
+      return napi_pending_exception;
+    }
+    for (size_t i = 0; i < gwiNumDims; ++i)
+      carrier->globalWorkItems.push_back(gwiData[i]);
+
+    if (hasWIG) {
+      size_t wigNumDims;
+      uint32_t* wigData;
+      status = napi_get_typedarray_info(env, workItemsPerGroupValue, &taType, &wigNumDims, (void**)&wigData, &arrbuf, &byteOffset);
+      PASS_STATUS;
+      if (napi_uint32_array != taType) {
+        status = napi_throw_type_error(env, nullptr, "workItemsPerGroup parameter must be a Uint32Array.");
+        return napi_pending_exception;
+      }
+      if (gwiNumDims != wigNumDims) {
+        status = napi_throw_type_error(env, nullptr, "globalWorkItems and workItemsPerGroup must have the same array dimensions.");
+        return napi_pending_exception;
+      }
+      for (size_t i = 0; i < wigNumDims; ++i) {
+        if (0 == wigData[i]) { // if any paramater is zero deliver a null vector
+          carrier->workItemsPerGroup.clear();
+          break;
+        }
+        carrier->workItemsPerGroup.push_back(wigData[i]);
+      }
+    }
+  }
+  return napi_ok;
+}
+
+// Read the optional buildOptions string and defines object of a program configuration
+napi_status parseBuildOptions(napi_env env, napi_value config, buildCarrier* carrier) {
+  napi_status status;
+  napi_valuetype t;
+  bool hasProp;
+
+  status = napi_has_named_property(env, config, "buildOptions", &hasProp);
+  PASS_STATUS;
+  if (hasProp) {
+    napi_value buildOptionsValue;
+    status = napi_get_named_property(env, config, "buildOptions", &buildOptionsValue);
+    PASS_STATUS;
+    status = napi_typeof(env, buildOptionsValue, &t);
+    PASS_STATUS;
+    if (t != napi_string) {
+      status = napi_throw_type_error(env, nullptr, "buildOptions parameter must be a string.");
+      return napi_pending_exception;
+    }
+    size_t optionsLength;
+    status = napi_get_value_string_utf8(env, buildOptionsValue, nullptr, 0, &optionsLength);
+    PASS_STATUS;
+    carrier->buildOptions.resize(optionsLength + 1);
+    status = napi_get_value_string_utf8(env, buildOptionsValue, &carrier->buildOptions[0], optionsLength + 1, nullptr);
+    PASS_STATUS;
+    carrier->buildOptions.resize(optionsLength);
+  }
+
+  status = napi_has_named_property(env, config, "defines", &hasProp);
+  PASS_STATUS;
+  if (!hasProp)
+    return napi_ok;
+
+  napi_value definesValue;
+  status = napi_get_named_property(env, config, "defines", &definesValue);
+  PASS_STATUS;
+  status = napi_typeof(env, definesValue, &t);
+  PASS_STATUS;
+  if (t != napi_object) {
+    status = napi_throw_type_error(env, nullptr, "defines parameter must be an object.");
+    return napi_pending_exception;
+  }
+
+  napi_value names;
+  status = napi_get_property_names(env, definesValue, &names);
+  PASS_STATUS;
+  uint32_t namesLength;
+  status = napi_get_array_length(env, names, &namesLength);
+  PASS_STATUS;
+
+  std::regex identifier("[A-Za-z_][A-Za-z0-9_]*");
+  for (uint32_t i = 0; i < namesLength; ++i) {
+    napi_value nameValue;
+    status = napi_get_element(env, names, i, &nameValue);
+    PASS_STATUS;
+    size_t nameLength;
+    status = napi_get_value_string_utf8(env, nameValue, nullptr, 0, &nameLength);
+    PASS_STATUS;
+    std::string name(nameLength + 1, '\0');
+    status = napi_get_value_string_utf8(env, nameValue, &name[0], nameLength + 1, nullptr);
+    PASS_STATUS;
+    name.resize(nameLength);
+    if (!std::regex_match(name, identifier)) {
+      std::string errorMsg = std::string("Define name '") + name + "' is not a valid macro name.";
+      status = napi_throw_type_error(env, nullptr, errorMsg.c_str());
+      return napi_pending_exception;
+    }
+
+    napi_value defineValue;
+    status = napi_get_property(env, definesValue, nameValue, &defineValue);
+    PASS_STATUS;
+    status = napi_typeof(env, defineValue, &t);
+    PASS_STATUS;
+
+    std::string value;
+    if (napi_boolean == t) {
+      bool flag;
+      status = napi_get_value_bool(env, defineValue, &flag);
+      PASS_STATUS;
+      value = flag ? "1" : "0";
+    } else {
+      // arrays become comma separated lists for use in initialisers
+      napi_value valueString;
+      status = napi_coerce_to_string(env, defineValue, &valueString);
+      PASS_STATUS;
+      size_t valueLength;
+      status = napi_get_value_string_utf8(env, valueString, nullptr, 0, &valueLength);
+      PASS_STATUS;
+      value.resize(valueLength + 1);
+      status = napi_get_value_string_utf8(env, valueString, &value[0], valueLength + 1, nullptr);
+      PASS_STATUS;
+      value.resize(valueLength);
+    }
+    if (value.empty() || (std::string::npos != value.find_first_of(" \t\r\n"))) {
+      std::string errorMsg = std::string("Value of define '") + name + "' must not be empty or contain spaces.";
+      status = napi_throw_type_error(env, nullptr, errorMsg.c_str());
+      return napi_pending_exception;
+    }
+    carrier->defines[name] = value;
+  }
+  return napi_ok;
+}
+
 napi_value createProgram(napi_env env, napi_callback_info info) {
   napi_status status;
   napi_value promise;
@@ -286,8 +588,13 @@ napi_value createProgram(napi_env env, napi_callback_info info) {
     return nullptr;
   }
 
+  contextState *ctx;
+  status = getContextState(env, contextValue, &ctx);
+  if (napi_pending_exception == status) return nullptr;
+  CHECK_STATUS;
+
   napi_value program;
-  status = napi_create_object(env, &program);
+  status = newProgram(env, contextValue, ctx, carrier, &program);
   CHECK_STATUS;
 
   status = napi_set_named_property(env, program, "kernelSource", args[0]);
@@ -339,142 +646,130 @@ napi_value createProgram(napi_env env, napi_callback_info info) {
   carrier->kernelName = std::string(kernelName);
   free(kernelName);
 
-  napi_value globalWorkItemsValue;
-  status = napi_has_named_property(env, config, "globalWorkItems", &hasProp);
-  CHECK_STATUS;
-  if (!hasProp) {
-    status = napi_throw_type_error(env, nullptr, "globalWorkItems parameter must be provided.");
-    return nullptr;
-  }
-  status = napi_get_named_property(env, config, "globalWorkItems", &globalWorkItemsValue);
+  status = parseWorkItems(env, config, carrier);
+  if (napi_pending_exception == status) return nullptr;
   CHECK_STATUS;
 
-  bool hasWIG = false;
-  napi_value workItemsPerGroupValue;
-  status = napi_has_named_property(env, config, "workItemsPerGroup", &hasWIG);
+  status = parseBuildOptions(env, config, carrier);
+  if (napi_pending_exception == status) return nullptr;
   CHECK_STATUS;
-  if (hasWIG) {
-    status = napi_get_named_property(env, config, "workItemsPerGroup", &workItemsPerGroupValue);
+
+  if (!ctx->cacheDir.empty()) {
+    napi_value cacheDirValue;
+    status = napi_create_string_utf8(env, ctx->cacheDir.c_str(), ctx->cacheDir.length(), &cacheDirValue);
+    CHECK_STATUS;
+    status = napi_set_named_property(env, program, "cacheDir", cacheDirValue);
     CHECK_STATUS;
   }
 
-  status = napi_typeof(env, globalWorkItemsValue, &t);
+  status = napi_create_reference(env, program, 1, &carrier->passthru);
   CHECK_STATUS;
-  if (napi_number == t) {
-    // OpenCL 1 dimension buffer mode
-    uint32_t gwi, wig;
-    status = napi_get_value_uint32(env, globalWorkItemsValue, &gwi);
-    CHECK_STATUS;
-    carrier->globalWorkItems.push_back(gwi);
-    if (hasWIG) {
-      status = napi_get_value_uint32(env, workItemsPerGroupValue, &wig);
-      CHECK_STATUS;
-      carrier->workItemsPerGroup.push_back(wig);
-    }
-  } else {
-    // OpenCL 2+ dimension image mode
-    napi_typedarray_type taType;
-    size_t gwiNumDims;
-    uint32_t* gwiData;
-    napi_value arrbuf;
-    size_t byteOffset;
-    status = napi_get_typedarray_info(env, globalWorkItemsValue, &taType, &gwiNumDims, (void**)&gwiData, &arrbuf, &byteOffset);
-    CHECK_STATUS;
-    if (napi_uint32_array != taType) {
-      status = napi_throw_type_error(env, nullptr, "globalWorkItems parameter must be a Uint32Array.");
-      return nullptr;
-    }
-    for (size_t i = 0; i < gwiNumDims; ++i)
-      carrier->globalWorkItems.push_back(gwiData[i]);
 
-    if (hasWIG) {
-      size_t wigNumDims;
-      uint32_t* wigData;
-      status = napi_get_typedarray_info(env, workItemsPerGroupValue, &taType, &wigNumDims, (void**)&wigData, &arrbuf, &byteOffset);
-      CHECK_STATUS;
-      if (napi_uint32_array != taType) {
-        status = napi_throw_type_error(env, nullptr, "workItemsPerGroup parameter must be a Uint32Array.");
-        return nullptr;
-      }
-      if (gwiNumDims != wigNumDims) {
-        status = napi_throw_type_error(env, nullptr, "globalWorkItems and workItemsPerGroup must have the same array dimensions.");
-        return nullptr;
-      }
-      for (size_t i = 0; i < wigNumDims; ++i) {
-        if (0 == wigData[i]) { // if any paramater is zero deliver a null vector
-          carrier->workItemsPerGroup.clear();
-          break;
-        }
-        carrier->workItemsPerGroup.push_back(wigData[i]);
-      }
-    }
-  }
+  status = napi_create_promise(env, &carrier->_deferred, &promise);
+  CHECK_STATUS;
 
-  napi_value jsContext;
-  status = napi_get_named_property(env, contextValue, "context", &jsContext);
+  status = napi_create_string_utf8(env, "BuildProgram", NAPI_AUTO_LENGTH, &resource_name);
   CHECK_STATUS;
-  void* contextData;
-  status = napi_get_value_external(env, jsContext, &contextData);
+  status = napi_create_async_work(env, NULL, resource_name, buildExecute,
+    buildComplete, carrier, &carrier->_request);
   CHECK_STATUS;
-  carrier->context = (cl_context) contextData;
-  status = napi_set_named_property(env, program, "context", jsContext);
+  status = napi_queue_async_work(env, carrier->_request);
   CHECK_STATUS;
 
-  uint32_t numQueues;
-  napi_value numQueuesVal;
-  status = napi_get_named_property(env, contextValue, "numQueues", &numQueuesVal);
+  return promise;
+}
+
+// Create another kernel from the built program of this object, sharing its compilation
+napi_value createKernel(napi_env env, napi_callback_info info) {
+  napi_status status;
+  napi_value promise;
+  napi_value resource_name;
+
+  napi_value args[2];
+  size_t argc = 2;
+  napi_value programValue;
+  status = napi_get_cb_info(env, info, &argc, args, &programValue, nullptr);
   CHECK_STATUS;
-  status = napi_get_value_uint32(env, numQueuesVal, &numQueues);
+
+  if (argc != 2) {
+    status = napi_throw_error(env, nullptr, "Wrong number of arguments.");
+    return nullptr;
+  }
+
+  napi_valuetype t;
+  status = napi_typeof(env, args[0], &t);
   CHECK_STATUS;
+  if (t != napi_string) {
+    status = napi_throw_type_error(env, nullptr, "First argument should be a string - the kernel name.");
+    return nullptr;
+  }
 
-  status = napi_set_named_property(env, program, "numQueues", numQueuesVal);
+  napi_value config = args[1];
+  status = napi_typeof(env, config, &t);
   CHECK_STATUS;
-  for (uint32_t i = 0; i < numQueues; ++i) {
-    std::stringstream ss;
-    ss << "commands_" << i;
-    napi_value commandQueue;
-    status = napi_get_named_property(env, contextValue, ss.str().c_str(), &commandQueue);
-    CHECK_STATUS;
-    status = napi_set_named_property(env, program, ss.str().c_str(), commandQueue);
-    CHECK_STATUS;
+  if (t != napi_object) {
+    status = napi_throw_type_error(env, nullptr, "Configuration parameters must be an object.");
+    return nullptr;
   }
 
-  napi_value platformValue;
-  status = napi_get_named_property(env, contextValue, "platformIndex", &platformValue);
+  buildCarrier* carrier = new buildCarrier;
+
+  size_t nameLength;
+  status = napi_get_value_string_utf8(env, args[0], nullptr, 0, &nameLength);
   CHECK_STATUS;
-  status = napi_get_value_uint32(env, platformValue, &carrier->platformIndex);
+  carrier->kernelName.resize(nameLength + 1);
+  status = napi_get_value_string_utf8(env, args[0], &carrier->kernelName[0], nameLength + 1, nullptr);
   CHECK_STATUS;
+  carrier->kernelName.resize(nameLength);
 
-  napi_value deviceValue;
-  status = napi_get_named_property(env, contextValue, "deviceIndex", &deviceValue);
-  CHECK_STATUS;
-  status = napi_get_value_uint32(env, deviceValue, &carrier->deviceIndex);
+  status = parseWorkItems(env, config, carrier);
+  if (napi_pending_exception == status) return nullptr;
   CHECK_STATUS;
 
-  napi_value deviceIdValue;
-  status = napi_get_named_property(env, contextValue, "deviceId", &deviceIdValue);
+  programState *parent;
+  status = getProgramState(env, programValue, &parent);
+  if (napi_pending_exception == status) return nullptr;
   CHECK_STATUS;
-  void* deviceIdData;
-  status = napi_get_value_external(env, deviceIdValue, &deviceIdData);
+  napi_value contextValue;
+  status = napi_get_reference_value(env, parent->contextRef, &contextValue);
   CHECK_STATUS;
-  carrier->deviceId = (cl_device_id) deviceIdData;
 
-  status = napi_create_reference(env, program, 1, &carrier->passthru);
+  // the new object refers to the same context and program as this one
+  napi_value kernel;
+  status = newProgram(env, contextValue, parent->ctx, carrier, &kernel);
   CHECK_STATUS;
 
-  napi_ref contextRef;
-  status = napi_create_reference(env, contextValue, 1, &contextRef);
-  CHECK_STATUS;
-  napi_value contextRefValue;
-  status = napi_create_external(env, (void*)contextRef, tidyProgramContextRef, nullptr, &contextRefValue);
-  CHECK_STATUS;
-  status = napi_set_named_property(env, program, "contextRef", contextRefValue);
+  bool hasProp;
+  const char *sharedNames[] = { "kernelSource", "cacheDir" };
+  for (auto sharedName: sharedNames) {
+    status = napi_has_named_property(env, programValue, sharedName, &hasProp);
+    CHECK_STATUS;
+    if (hasProp) {
+      napi_value sharedValue;
+      status = napi_get_named_property(env, programValue, sharedName, &sharedValue);
+      CHECK_STATUS;
+      status = napi_set_named_property(env, kernel, sharedName, sharedValue);
+      CHECK_STATUS;
+    }
+  }
+
+  carrier->fromCache = parent->fromCache;
+  carrier->cachedKernels = parent->kernelInfos;
+  carrier->program = parent->program;
+  cl_int error = clRetainProgram(carrier->program);
+  if (error != CL_SUCCESS) {
+    status = napi_throw_error(env, nullptr, "Failed to retain the CL program.");
+    return nullptr;
+  }
+  carrier->retainedProgram = true;
+
+  status = napi_create_reference(env, kernel, 1, &carrier->passthru);
   CHECK_STATUS;
 
   status = napi_create_promise(env, &carrier->_deferred, &promise);
   CHECK_STATUS;
 
-  status = napi_create_string_utf8(env, "BuildProgram", NAPI_AUTO_LENGTH, &resource_name);
+  status = napi_create_string_utf8(env, "CreateKernel", NAPI_AUTO_LENGTH, &resource_name);
   CHECK_STATUS;
   status = napi_create_async_work(env, NULL, resource_name, buildExecute,
     buildComplete, carrier, &carrier->_request);
@@ -484,3 +779,28 @@ napi_value createProgram(napi_env env, napi_callback_info info) {
 
   return promise;
 }
+
+napi_value programConstructor(napi_env env, napi_callback_info info) {
+  napi_status status;
+  napi_value thisValue;
+  status = napi_get_cb_info(env, info, nullptr, nullptr, &thisValue, nullptr);
+  CHECK_STATUS;
+  return thisValue;
+}
+
+napi_status defineProgramClass(napi_env env, napi_ref *constructor) {
+  napi_status status;
+  napi_property_descriptor desc[] = {
+    DECLARE_NAPI_METHOD("run", run),
+    DECLARE_NAPI_METHOD("runSync", runSync),
+    DECLARE_NAPI_METHOD("runBatch", runBatch),
+    DECLARE_NAPI_METHOD("prepare", prepare),
+    DECLARE_NAPI_METHOD("autotune", autotune),
+    DECLARE_NAPI_METHOD("createKernel", createKernel)
+  };
+  napi_value programClass;
+  status = napi_define_class(env, "nodenProgram", NAPI_AUTO_LENGTH, programConstructor, nullptr,
+    sizeof(desc) / sizeof(desc[0]), desc, &programClass);
+  PASS_STATUS;
+  return napi_create_reference(env, programClass, 1, constructor);
+}
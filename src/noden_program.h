@@ -22,25 +22,56 @@
 #include <map>
 #include "node_api.h"
 #include "noden_util.h"
+#include "noden_cache.h"
 
 class iRunParams;
+class queueKernels;
+struct contextState;
+
+// Native state of a program object, wrapped in it so that each run reaches it in one step
+struct programState {
+  ~programState();
+  contextState *ctx = nullptr;
+  napi_ref contextRef = nullptr; // holds the context while the program is in use
+  cl_program program = nullptr;
+  cl_kernel kernel = nullptr;
+  queueKernels *kernels = nullptr;
+  iRunParams *runParams = nullptr;
+  tKernelInfos kernelInfos; // argument info read from the program cache, for kernels created later
+  bool fromCache = false;
+};
 
 struct buildCarrier : carrier {
+  programState *state = nullptr;
   std::string kernelSource;
   size_t sourceLength;
   uint32_t platformIndex;
   uint32_t deviceIndex;
   cl_device_id deviceId;
   cl_context context;
-  cl_program program;
+  cl_program program = nullptr;
   cl_kernel kernel;
   std::string kernelName;
   cl_ulong svmCaps;
   std::vector<size_t> globalWorkItems;
   std::vector<size_t> workItemsPerGroup;
   iRunParams *runParams;
+  std::string cacheDir;
+  std::string buildOptions;
+  std::map<std::string, std::string> defines;
+  bool fromCache = false;
+  tKernelInfos cachedKernels;
+  std::vector<std::string> kernelNames;
+  bool retainedProgram = false; // holds a reference to a program shared with another kernel
+  uint32_t numQueues = 1;
+  queueKernels *kernels = nullptr;
+  ~buildCarrier();
 };
 
 napi_value createProgram(napi_env env, napi_callback_info info);
+napi_value createKernel(napi_env env, napi_callback_info info);
+napi_status defineProgramClass(napi_env env, napi_ref *constructor);
+// The native state of a program, throwing a TypeError if the value is not a program
+napi_status getProgramState(napi_env env, napi_value programValue, programState **state);
 
 #endif
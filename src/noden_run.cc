@@ -14,11 +14,55 @@
 */
 
 #include "noden_run.h"
+#include "noden_context.h"
+#include "noden_program.h"
+#include "noden_buffer.h"
 #include "cl_memory.h"
+#include "noden_submit.h"
 #include "sstream"
+#include <cstring>
 
-void runExecute(napi_env env, void* data) {
-  runCarrier* c = (runCarrier*) data;
+cl_command_queue runQueue(runCarrier* c) {
+  uint32_t q = c->queueNum;
+  if (q >= (uint32_t)c->commandQueues.size()) {
+    printf("Invalid queue \'%d\', defaulting to 0\n", q);
+    q = 0;
+  }
+  return c->commandQueues.at(q);
+}
+
+queueKernels::~queueKernels() {
+  for (auto& inst: mInstances)
+    if (inst->kernel && (CL_SUCCESS != clReleaseKernel(inst->kernel)))
+      printf("Failed to release CL kernel.\n");
+}
+
+cl_int queueKernels::create(cl_kernel kernel, uint32_t numQueues) {
+  cl_int error = clRetainKernel(kernel);
+  if (CL_SUCCESS != error) return error;
+  mInstances.emplace_back(new instance);
+  mInstances.back()->kernel = kernel;
+
+  cl_program program;
+  error = clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(cl_program), &program, nullptr);
+  if (CL_SUCCESS != error) return error;
+  size_t nameLength = 0;
+  error = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr, &nameLength);
+  if (CL_SUCCESS != error) return error;
+  std::string kernelName(nameLength, '\0');
+  error = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, nameLength, &kernelName[0], nullptr);
+  if (CL_SUCCESS != error) return error;
+
+  for (uint32_t q = 1; q < numQueues; ++q) {
+    cl_kernel queueKernel = clCreateKernel(program, kernelName.c_str(), &error);
+    if (CL_SUCCESS != error) return error;
+    mInstances.emplace_back(new instance);
+    mInstances.back()->kernel = queueKernel;
+  }
+  return CL_SUCCESS;
+}
+
+void runEnqueue(runCarrier* c) {
   cl_int error = CL_SUCCESS;
   // HR_TIME_POINT bufAlloc = NOW;
   // Not recording buffer create time - should probably be done once, before here
@@ -33,12 +77,20 @@ void runExecute(napi_env env, void* data) {
   HR_TIME_POINT start = NOW;
   HR_TIME_POINT dataToKernelStart = start;
 
+  // runs on other queues use their own kernel, runs on this queue wait until the kernel is enqueued
+  uint32_t q = (c->queueNum < (uint32_t)c->commandQueues.size()) ? c->queueNum : 0;
+  queueKernels::instance* qk = (c->kernels && (q < c->kernels->size())) ? c->kernels->at(q) : nullptr;
+  cl_kernel kernel = qk ? qk->kernel : c->kernel;
+  std::unique_lock<std::mutex> kernelLock;
+  if (qk)
+    kernelLock = std::unique_lock<std::mutex>(qk->lock);
+
   for (auto& paramIter: c->kernelParams) {
     uint32_t p = paramIter.first;
     kernelParam* param = paramIter.second;
     if (eParamFlags::VALUE != param->valueType) {
-      error = param->gpuAccess->setKernelParam(c->kernel, p, eParamFlags::IMAGE == param->valueType, 
-                                               param->access, c->runParams, c->queueNum);
+      error = param->gpuAccess->setKernelParam(kernel, p, eParamFlags::IMAGE == param->valueType, 
+                                               param->access, c->runParams, c->queueNum, c->events);
       ASYNC_CL_ERROR;
       param->gpuAccess.reset();
     }
@@ -47,41 +99,96 @@ void runExecute(napi_env env, void* data) {
   for (auto& paramIter: c->kernelParams) {
     uint32_t p = paramIter.first;
     kernelParam* param = paramIter.second;
-    if (0 == param->paramType.compare("uint"))
-      error = clSetKernelArg(c->kernel, p, sizeof(uint32_t), &param->value.uint32);
-    else if (0 == param->paramType.compare("int"))
-      error = clSetKernelArg(c->kernel, p, sizeof(int32_t), &param->value.int32);
-    else if (0 == param->paramType.compare("long"))
-      error = clSetKernelArg(c->kernel, p, sizeof(int64_t), &param->value.int64);
-    else if (0 == param->paramType.compare("float"))
-      error = clSetKernelArg(c->kernel, p, sizeof(float), &param->value.flt);
-    else if (0 == param->paramType.compare("double"))
-      error = clSetKernelArg(c->kernel, p, sizeof(double), &param->value.dbl);
-    ASYNC_CL_ERROR;
-  }
-
-  uint32_t q = c->queueNum;
-  if (q >= (uint32_t)c->commandQueues.size()) {
-    printf("Invalid queue \'%d\', defaulting to 0\n", q);
-    q = 0;
+    if ((eParamFlags::VALUE != param->valueType) || !param->changed)
+      continue;
+    size_t argSize = 0;
+    const void* argValue = nullptr;
+    switch (param->paramType) {
+    case iKernelArg::eType::UINT:
+      argSize = sizeof(uint32_t); argValue = &param->value.uint32;
+      break;
+    case iKernelArg::eType::INT:
+      argSize = sizeof(int32_t); argValue = &param->value.int32;
+      break;
+    case iKernelArg::eType::LONG:
+      argSize = sizeof(int64_t); argValue = &param->value.int64;
+      break;
+    case iKernelArg::eType::FLOAT:
+      argSize = sizeof(float); argValue = &param->value.flt;
+      break;
+    case iKernelArg::eType::DOUBLE:
+      argSize = sizeof(double); argValue = &param->value.dbl;
+      break;
+    default:
+      break;
+    }
+    if (argValue) {
+      uint64_t bits = 0;
+      memcpy(&bits, argValue, argSize);
+      bool unchanged = false;
+      if (qk) {
+        auto valueIter = qk->values.find(p);
+        unchanged = (qk->values.end() != valueIter) && (bits == valueIter->second);
+      }
+      if (!unchanged) {
+        error = clSetKernelArg(kernel, p, argSize, argValue);
+        ASYNC_CL_ERROR;
+        if (qk) qk->values[p] = bits;
+      }
+    }
+    param->changed = false;
   }
-  cl_command_queue commandQueue = c->commandQueues.at(q);
 
   c->dataToKernel = microTime(dataToKernelStart);
   HR_TIME_POINT kernelExecStart = NOW;
 
   size_t numDims = c->runParams->numDims();
-  const size_t *global = c->runParams->globalWorkItems();
-  const size_t *local = c->runParams->workItemsPerGroup();
-  error = clEnqueueNDRangeKernel(commandQueue, c->kernel, numDims, nullptr, global, local, 0, nullptr, nullptr);
+  const size_t *global = c->globalWorkItems.empty() ? c->runParams->globalWorkItems() : c->globalWorkItems.data();
+  std::shared_ptr<const std::vector<size_t>> programLocal = c->runParams->workItemsPerGroup();
+  const size_t *local = c->nullWorkItemsPerGroup ? nullptr :
+                        !c->workItemsPerGroup.empty() ? c->workItemsPerGroup.data() :
+                        programLocal ? programLocal->data() : nullptr;
+  const size_t *offset = c->globalWorkOffset.empty() ? nullptr : c->globalWorkOffset.data();
+  error = clEnqueueNDRangeKernel(runQueue(c), kernel, numDims, offset, global, local, c->events.numWaits(), c->events.waitList(), c->events.record("kernel"));
   ASYNC_CL_ERROR;
+  if (qk)
+    kernelLock.unlock();
 
-  if (1 == c->commandQueues.size()) {
+  c->kernelExec = microTime(kernelExecStart);
+  c->dataFromKernel = 0;
+  c->totalTime = microTime(start);
+}
+
+void runExecute(napi_env env, void* data) {
+  runCarrier* c = (runCarrier*) data;
+  cl_int error = CL_SUCCESS;
+  HR_TIME_POINT start = NOW;
+
+  runEnqueue(c);
+  if (NODEN_SUCCESS != c->status)
+    return;
+
+  cl_command_queue commandQueue = runQueue(c);
+  HR_TIME_POINT kernelExecStart = NOW;
+
+  if (c->eventCompletion) {
+    // completion is signalled by a callback on the marker event
+    error = c->events.markCompletion(commandQueue, c->inFlight);
+    ASYNC_CL_ERROR;
+  } else if (1 == c->commandQueues.size()) {
     error = clFinish(commandQueue);
     ASYNC_CL_ERROR;
+  } else {
+    error = c->events.markCompletion(commandQueue, c->inFlight);
+    ASYNC_CL_ERROR;
+    if (c->events.profiling()) {
+      // device timestamps are only available once the commands have completed
+      error = c->events.wait();
+      ASYNC_CL_ERROR;
+    }
   }
 
-  c->kernelExec = microTime(kernelExecStart);
+  c->kernelExec += microTime(kernelExecStart);
   HR_TIME_POINT dataFromKernelStart = NOW;
 
   // set host readonly access for any buffers that are declared writeonly for the kernel
@@ -98,6 +205,55 @@ void runExecute(napi_env env, void* data) {
   c->totalTime = microTime(start);
 }
 
+napi_status runTimings(napi_env env, runCarrier* c, napi_value* result) {
+  napi_status status;
+  status = napi_create_object(env, result);
+  PASS_STATUS;
+
+  napi_value totalValue;
+  status = napi_create_int64(env, (int64_t) c->totalTime, &totalValue);
+  PASS_STATUS;
+  status = napi_set_named_property(env, *result, "totalTime", totalValue);
+  PASS_STATUS;
+
+  napi_value dataToValue;
+  status = napi_create_int64(env, (int64_t) c->dataToKernel, &dataToValue);
+  PASS_STATUS;
+  status = napi_set_named_property(env, *result, "dataToKernel", dataToValue);
+  PASS_STATUS;
+
+  napi_value kernelExecValue;
+  status = napi_create_int64(env, (int64_t) c->kernelExec, &kernelExecValue);
+  PASS_STATUS;
+  status = napi_set_named_property(env, *result, "kernelExec", kernelExecValue);
+  PASS_STATUS;
+
+  napi_value dataFromValue;
+  status = napi_create_int64(env, (int64_t) c->dataFromKernel, &dataFromValue);
+  PASS_STATUS;
+  status = napi_set_named_property(env, *result, "dataFromKernel", dataFromValue);
+  PASS_STATUS;
+
+  if (c->events.profiling()) {
+    napi_value profileValue;
+    status = c->events.profile(env, &profileValue);
+    PASS_STATUS;
+    status = napi_set_named_property(env, *result, "profile", profileValue);
+    PASS_STATUS;
+  }
+
+  cl_event completion = c->events.takeCompletion();
+  if (completion) {
+    napi_value eventValue;
+    status = createEventHandle(env, completion, &eventValue);
+    PASS_STATUS;
+    status = napi_set_named_property(env, *result, "event", eventValue);
+    PASS_STATUS;
+  }
+
+  return napi_ok;
+}
+
 void runComplete(napi_env env, napi_status asyncStatus, void* data) {
   runCarrier* c = (runCarrier*) data;
 
@@ -108,236 +264,574 @@ void runComplete(napi_env env, napi_status asyncStatus, void* data) {
   REJECT_STATUS;
 
   napi_value result;
-  c->status = napi_create_object(env, &result);
-  REJECT_STATUS;
-
-  napi_value totalValue;
-  c->status = napi_create_int64(env, (int64_t) c->totalTime, &totalValue);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "totalTime", totalValue);
-  REJECT_STATUS;
-
-  napi_value dataToValue;
-  c->status = napi_create_int64(env, (int64_t) c->dataToKernel, &dataToValue);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "dataToKernel", dataToValue);
-  REJECT_STATUS;
-
-  napi_value kernelExecValue;
-  c->status = napi_create_int64(env, (int64_t) c->kernelExec, &kernelExecValue);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "kernelExec", kernelExecValue);
-  REJECT_STATUS;
-
-  napi_value dataFromValue;
-  c->status = napi_create_int64(env, (int64_t) c->dataFromKernel, &dataFromValue);
-  REJECT_STATUS;
-  c->status = napi_set_named_property(env, result, "dataFromKernel", dataFromValue);
+  c->status = runTimings(env, c, &result);
   REJECT_STATUS;
 
   napi_status status;
   status = napi_resolve_deferred(env, c->_deferred, result);
   FLOATING_STATUS;
 
-  for (auto& paramIter: c->kernelParams)
-    delete paramIter.second;
   tidyCarrier(env, c);
 }
 
-napi_value run(napi_env env, napi_callback_info info) {
-  napi_status status;
-  runCarrier* c = new runCarrier;
-
-  napi_value args[2];
-  size_t argc = 2;
-  napi_value programValue;
-  status = napi_get_cb_info(env, info, &argc, args, &programValue, nullptr);
-  CHECK_STATUS;
+napi_status queueRun(napi_env env, contextState *ctx, const char *resourceName,
+  napi_async_execute_callback execute, napi_async_complete_callback complete, runCarrier* c) {
+  ctx->trackWork(c->queueNum, c);
+  completionQueue *completion = ctx->completion;
+  if (!completion)
+    return queueWork(env, ctx->engine, c->queueNum, resourceName, execute, complete, c);
+
+  // enqueueing is non-blocking so is done on the JS thread, with no thread waiting for the device
+  c->eventCompletion = true;
+  execute(env, c);
+  if (NODEN_SUCCESS == c->status) {
+    cl_int error = completion->completeOnEvent(c->events.completion(), complete, c);
+    if (CL_SUCCESS != error) {
+      c->status = error;
+      c->errorMsg = "Failed to set a callback for completion of the run.";
+    }
+  }
+  if (NODEN_SUCCESS != c->status)
+    complete(env, napi_ok, c);
+  return napi_ok;
+}
 
-  if (!((argc > 0) && (argc <= 2))) {
-    status = napi_throw_error(env, nullptr, "Wrong number of arguments. One or two expected.");
-    return nullptr;
+napi_status setParamValue(napi_env env, napi_value paramValue, kernelParam* kp) {
+  napi_status status;
+  napi_valuetype valueType;
+  status = napi_typeof(env, paramValue, &valueType);
+  PASS_STATUS;
+
+  switch (valueType) {
+  case napi_undefined:
+    printf("Parameter name \'%s\' not found during run\n", kp->name.c_str());
+    napi_throw_error(env, nullptr, "Parameter name not found during run");
+    return napi_pending_exception;
+  case napi_number:
+    kp->valueType = eParamFlags::VALUE;
+    switch (kp->paramType) {
+    case iKernelArg::eType::UINT:
+      status = napi_get_value_uint32(env, paramValue, &kp->value.uint32);
+      break;
+    case iKernelArg::eType::INT:
+      status = napi_get_value_int32(env, paramValue, &kp->value.int32);
+      break;
+    case iKernelArg::eType::LONG:
+      status = napi_get_value_int64(env, paramValue, &kp->value.int64);
+      break;
+    case iKernelArg::eType::FLOAT: {
+      double tmp = 0.0;
+      status = napi_get_value_double(env, paramValue, &tmp);
+      kp->value.flt = (float)tmp;
+      break;
+    }
+    case iKernelArg::eType::DOUBLE:
+      status = napi_get_value_double(env, paramValue, &kp->value.dbl);
+      break;
+    default:
+      printf("Unsupported numeric parameter type for \'%s\'\n", kp->name.c_str());
+      napi_throw_type_error(env, nullptr, "Unsupported numeric parameter type");
+      return napi_pending_exception;
+    }
+    PASS_STATUS;
+    break;
+  case napi_object: {
+    if (iKernelArg::eType::IMAGE == kp->paramType) {
+      kp->valueType = eParamFlags::IMAGE;
+    } else if (iKernelArg::eType::BUFFER == kp->paramType) {
+      kp->valueType = eParamFlags::BUFFER;
+    } else {
+      printf("Parameter \'%s\' not recognised as a buffer type\n", kp->name.c_str());
+      napi_throw_error(env, nullptr, "Parameter type not recognised during run");
+      return napi_pending_exception;
+    }
+    bufferState *buf;
+    status = getBufferState(env, paramValue, &buf);
+    PASS_STATUS;
+    kp->value.clMem = buf->clMem;
+    if ((eParamFlags::IMAGE == kp->valueType) && !kp->value.clMem->hasDimensions()) {
+      napi_throw_error(env, nullptr, "Buffer used as image type must provide image dimensions");
+      return napi_pending_exception;
+    }
+    break;
   }
+  default:
+    printf("Unsupported parameter value type: \'%d\'\n", valueType);
+    napi_throw_type_error(env, nullptr, "Unsupported parameter value type");
+    return napi_pending_exception;
+  }
+
+  kp->changed = true;
+  return napi_ok;
+}
 
+// Fill a run carrier with the kernel, queues and parameter values for a run of a program
+napi_status parseRun(napi_env env, napi_value programValue, napi_value params, runCarrier* c) {
+  napi_status status;
   napi_valuetype t;
-  status = napi_typeof(env, args[0], &t);
-  CHECK_STATUS;
+  status = napi_typeof(env, params, &t);
+  PASS_STATUS;
   if (t != napi_object) {
-    status = napi_throw_type_error(env, nullptr, "Parameter must be an object.");
-    return nullptr;
+    napi_throw_type_error(env, nullptr, "Parameter must be an object.");
+    return napi_pending_exception;
   }
 
-  napi_value runParamsValue;
-  status = napi_get_named_property(env, programValue, "runParams", &runParamsValue);
-  CHECK_STATUS;
-  status = napi_get_value_external(env, runParamsValue, (void**)&c->runParams);
-  CHECK_STATUS;
+  programState *state;
+  status = getProgramState(env, programValue, &state);
+  PASS_STATUS;
+  c->runParams = state->runParams;
+  c->ctx = state->ctx;
+  c->context = state->ctx->context;
+  c->commandQueues = state->ctx->commandQueues;
+  c->kernel = state->kernel;
+  c->kernels = state->kernels;
+  c->events.setProfiling(state->ctx->profiling);
 
   napi_value runNamesValue;
-  status = napi_get_property_names(env, args[0], &runNamesValue);
-  CHECK_STATUS;
+  status = napi_get_property_names(env, params, &runNamesValue);
+  PASS_STATUS;
 
   uint32_t runNamesCount;
   status = napi_get_array_length(env, runNamesValue, &runNamesCount);
-  CHECK_STATUS;
+  PASS_STATUS;
 
   uint32_t argNamesCount = (uint32_t)c->runParams->kernelArgMap().size();
   if (argNamesCount != runNamesCount) {
-    status = napi_throw_error(env, nullptr, "Incorrect number of parameters");
-    return nullptr;
+    napi_throw_error(env, nullptr, "Incorrect number of parameters");
+    return napi_pending_exception;
   }
 
+  const tKernelArgMap& kernelArgMap = c->runParams->kernelArgMap();
   for (uint32_t p=0; p<argNamesCount; ++p) {
-    iKernelArg *ka = c->runParams->kernelArgMap().at(p);
+    iKernelArg *ka = kernelArgMap.at(p);
     std::string argName(ka->name());
-    std::string argType(ka->type());
-    iKernelArg::eAccess argAccess(ka->access());
-
-    napi_value argNameValue;
-    status = napi_create_string_utf8(env, argName.c_str(), argName.length(), &argNameValue);
 
     napi_value paramValue;
-    status = napi_get_property(env, args[0], argNameValue, &paramValue);
-    CHECK_STATUS;
-    
-    napi_valuetype valueType;
-    status = napi_typeof(env, paramValue, &valueType);
-    CHECK_STATUS;
+    status = napi_get_named_property(env, params, argName.c_str(), &paramValue);
+    PASS_STATUS;
 
-    kernelParam* kp = new kernelParam(argName.c_str(), argType.c_str(), argAccess);
-    switch (valueType) {
-    case napi_undefined:
-      printf("Parameter name \'%s\' not found during run\n", argName.c_str());
-      status = napi_throw_error(env, nullptr, "Parameter name not found during run");
-      delete kp;
-      return nullptr;
-      break;
-    case napi_number:
-      if (0 == argType.compare("uint"))
-        status = napi_get_value_uint32(env, paramValue, &kp->value.uint32);
-      else if (0 == argType.compare("int"))
-        status = napi_get_value_int32(env, paramValue, &kp->value.int32);
-      else if (0 == argType.compare("long"))
-        status = napi_get_value_int64(env, paramValue, &kp->value.int64);
-      else if (0 == argType.compare("float")) {
-        double tmp = 0.0;
-        status = napi_get_value_double(env, paramValue, &tmp);
-        kp->value.flt = (float)tmp;
-      }
-      else if (0 == argType.compare("double"))
-        status = napi_get_value_double(env, paramValue, &kp->value.dbl);
-      else {
-        printf("Unsupported numeric parameter type: \'%s\'\n", argType.c_str());
-        status = napi_throw_type_error(env, nullptr, "Unsupported numeric parameter type");
-        delete kp;
-        return nullptr;
-      }
-      break;
-    case napi_object:
-      if (0 == argType.compare("image2d_t")) {
-        kp->valueType = eParamFlags::IMAGE;
-        kp->paramType = std::string("image");
-      } else if (std::string::npos != argType.find('*')) {
-        kp->valueType = eParamFlags::BUFFER;
-        kp->paramType = std::string("ptr");
-      } else {
-        printf("Parameter type \'%s\' not recognised as a buffer type\n", argType.c_str());
-        status = napi_throw_error(env, nullptr, "Parameter type not recognised during run");
-        delete kp;
-        return nullptr;
-      }
-      napi_value clMemValue;
-      status = napi_get_named_property(env, paramValue, "clMemory", &clMemValue);
-      CHECK_STATUS;
-      status = napi_get_value_external(env, clMemValue, (void**)&kp->value.clMem);
-      CHECK_STATUS;
-      if ((eParamFlags::IMAGE == kp->valueType) && !kp->value.clMem->hasDimensions()) {
-        status = napi_throw_error(env, nullptr, "Buffer used as image type must provide image dimensions");
-        delete kp;
-        return nullptr;
-      }
+    kernelParam* kp = new kernelParam(argName, ka->argType(), ka->access());
+    c->kernelParams.emplace(p, kp);
+    status = setParamValue(env, paramValue, kp);
+    PASS_STATUS;
+  }
+
+  return napi_ok;
+}
+
+// A number for a one dimensional program, otherwise a Uint32Array with an element per dimension
+napi_status getDimsOption(napi_env env, napi_value options, const char* name, size_t numDims, std::vector<size_t>& dims) {
+  napi_status status;
+  napi_value value;
+  status = napi_get_named_property(env, options, name, &value);
+  PASS_STATUS;
+  napi_valuetype t;
+  status = napi_typeof(env, value, &t);
+  PASS_STATUS;
+  if (napi_undefined == t)
+    return napi_ok;
+
+  std::string err;
+  if ((napi_number == t) && (1 == numDims)) {
+    uint32_t dim;
+    status = napi_get_value_uint32(env, value, &dim);
+    PASS_STATUS;
+    dims.push_back(dim);
+  } else {
+    bool isTypedArray = false;
+    status = napi_is_typedarray(env, value, &isTypedArray);
+    PASS_STATUS;
+    napi_typedarray_type taType = napi_int8_array;
+    size_t length = 0;
+    uint32_t* data = nullptr;
+    if (isTypedArray) {
+      napi_value arrbuf;
+      size_t byteOffset;
+      status = napi_get_typedarray_info(env, value, &taType, &length, (void**)&data, &arrbuf, &byteOffset);
+      PASS_STATUS;
+    }
+    if ((napi_uint32_array != taType) || (length != numDims)) {
+      err = std::string("Run option ") + name + " must be a Uint32Array with the same dimensions as the program" +
+        (1 == numDims ? ", or a number." : ".");
+      napi_throw_type_error(env, nullptr, err.c_str());
+      return napi_pending_exception;
+    }
+    for (size_t i = 0; i < length; ++i)
+      dims.push_back(data[i]);
+  }
+  return napi_ok;
+}
+
+napi_status getNDRangeOptions(napi_env env, napi_value options, runCarrier* c) {
+  napi_status status;
+  napi_valuetype t;
+  status = napi_typeof(env, options, &t);
+  PASS_STATUS;
+  if (napi_object != t)
+    return napi_ok; // reported by getEventOptions
+
+  size_t numDims = c->runParams->numDims();
+  status = getDimsOption(env, options, "globalWorkItems", numDims, c->globalWorkItems);
+  PASS_STATUS;
+  for (auto& gwi: c->globalWorkItems)
+    if (0 == gwi) {
+      napi_throw_range_error(env, nullptr, "Run option globalWorkItems cannot be zero.");
+      return napi_pending_exception;
+    }
+
+  status = getDimsOption(env, options, "workItemsPerGroup", numDims, c->workItemsPerGroup);
+  PASS_STATUS;
+  size_t requestedWorkItemsSize = 1;
+  for (auto& wig: c->workItemsPerGroup) {
+    if (0 == wig) { // as for createProgram, any zero lets the implementation choose
+      c->workItemsPerGroup.clear();
+      c->nullWorkItemsPerGroup = true;
       break;
-    default:
-      printf("Unsupported parameter value type: \'%d\'\n", valueType);
-      status = napi_throw_type_error(env, nullptr, "Unsupported parameter value type");
-      delete kp;
-      return nullptr;
     }
-    
-    c->kernelParams.emplace(p, kp);
+    requestedWorkItemsSize *= wig;
+  }
+  if (!c->workItemsPerGroup.empty() && (requestedWorkItemsSize > c->runParams->kernelWorkGroupSize())) {
+    std::stringstream ss;
+    ss << "Run option workItemsPerGroup of " << requestedWorkItemsSize << " work items is larger than the kernel work group size ("
+       << c->runParams->kernelWorkGroupSize() << ").";
+    napi_throw_range_error(env, nullptr, ss.str().c_str());
+    return napi_pending_exception;
+  }
+
+  // without a whole number of work groups in each dimension the enqueue fails on the worker
+  std::shared_ptr<const std::vector<size_t>> programLocal = c->runParams->workItemsPerGroup();
+  const size_t *global = c->globalWorkItems.empty() ? c->runParams->globalWorkItems() : c->globalWorkItems.data();
+  const size_t *local = c->nullWorkItemsPerGroup ? nullptr :
+                        !c->workItemsPerGroup.empty() ? c->workItemsPerGroup.data() :
+                        (programLocal && (numDims == programLocal->size())) ? programLocal->data() : nullptr;
+  for (size_t i = 0; local && (i < numDims); ++i)
+    if (0 != global[i] % local[i]) {
+      std::stringstream ss;
+      ss << "Run globalWorkItems of " << global[i] << " in dimension " << i
+         << " is not a multiple of the " << local[i] << " workItemsPerGroup.";
+      napi_throw_range_error(env, nullptr, ss.str().c_str());
+      return napi_pending_exception;
+    }
+
+  status = getDimsOption(env, options, "globalWorkOffset", numDims, c->globalWorkOffset);
+  PASS_STATUS;
+  return napi_ok;
+}
+
+napi_status parseQueueNum(napi_env env, napi_value queueNumValue, uint32_t numQueues, uint32_t* queueNum) {
+  napi_status status;
+  napi_valuetype t;
+  status = napi_typeof(env, queueNumValue, &t);
+  PASS_STATUS;
+  if (t != napi_number) {
+    napi_throw_type_error(env, nullptr, "Optional parameter queueNum must be a number.");
+    return napi_pending_exception;
   }
 
-  uint32_t numQueues;
-  napi_value numQueuesVal;
-  status = napi_get_named_property(env, programValue, "numQueues", &numQueuesVal);
+  int32_t checkValue;
+  status = napi_get_value_int32(env, queueNumValue, &checkValue);
+  PASS_STATUS;
+  if (!((checkValue >= 0) && (checkValue < (int32_t)numQueues))) {
+    napi_throw_range_error(env, nullptr, "Optional parameter queueNum out of range.");
+    return napi_pending_exception;
+  }
+  *queueNum = (uint32_t)checkValue;
+  return napi_ok;
+}
+
+// Fill a run carrier from the arguments of run or runSync - the parameters, an optional
+// queue number and optional run options, that are returned for any further options
+napi_status parseRunArgs(napi_env env, napi_callback_info info, runCarrier* c,
+  napi_value* programValue, napi_value* optionsValue) {
+  napi_status status;
+  napi_value args[3];
+  size_t argc = 3;
+  status = napi_get_cb_info(env, info, &argc, args, programValue, nullptr);
+  PASS_STATUS;
+
+  if (!((argc > 0) && (argc <= 3))) {
+    napi_throw_error(env, nullptr, "Wrong number of arguments. One to three expected.");
+    return napi_pending_exception;
+  }
+
+  status = parseRun(env, *programValue, args[0], c);
+  PASS_STATUS;
+
+  *optionsValue = nullptr;
+  if (argc > 1) {
+    status = parseQueueNum(env, args[1], (uint32_t)c->commandQueues.size(), &c->queueNum);
+    PASS_STATUS;
+
+    if (argc > 2) {
+      *optionsValue = args[2];
+      status = getEventOptions(env, args[2], c->events);
+      PASS_STATUS;
+      status = getNDRangeOptions(env, args[2], c);
+      PASS_STATUS;
+    }
+  } else {
+    if (c->commandQueues.size() > 1) printf("run queueNum parameter not provided - defaulting to 0\n");
+    c->queueNum = 0;
+  }
+  return napi_ok;
+}
+
+// Queue a parsed run, returning the promise of its timings
+napi_value queueRunPromise(napi_env env, napi_value programValue, runCarrier* c) {
+  napi_status status;
+  status = napi_create_reference(env, programValue, 1, &c->passthru);
   CHECK_STATUS;
-  status = napi_get_value_uint32(env, numQueuesVal, &numQueues);
+
+  napi_value promise;
+  status = napi_create_promise(env, &c->_deferred, &promise);
   CHECK_STATUS;
 
-  if (argc > 1) {
-    status = napi_typeof(env, args[1], &t);
-    CHECK_STATUS;
-    if (t != napi_number) {
-      status = napi_throw_type_error(env, nullptr, "Optional parameter queueNum must be a number.");
-      return nullptr;
+  status = queueRun(env, c->ctx, "Run", runExecute, runComplete, c);
+  CHECK_STATUS;
+
+  return promise;
+}
+
+napi_value run(napi_env env, napi_callback_info info) {
+  napi_status status;
+  runCarrier* c = new runCarrier;
+
+  napi_value programValue, optionsValue;
+  status = parseRunArgs(env, info, c, &programValue, &optionsValue);
+  if (napi_pending_exception == status) {
+    delete c;
+    return nullptr;
+  }
+  CHECK_STATUS;
+
+  return queueRunPromise(env, programValue, c);
+}
+
+// Total global work items of a run, as an estimate of its cost
+static size_t runWorkItems(runCarrier* c) {
+  size_t numDims = c->runParams->numDims();
+  const size_t *global = c->globalWorkItems.empty() ? c->runParams->globalWorkItems() : c->globalWorkItems.data();
+  size_t workItems = 1;
+  for (size_t i = 0; i < numDims; ++i)
+    workItems *= global[i];
+  return workItems;
+}
+
+// Run on the calling thread, waiting for the run to complete on the device. Without
+// clFinish, runExecute only marks completion, so the marker is waited for here.
+static void runExecuteSync(napi_env env, runCarrier* c) {
+  cl_int error = CL_SUCCESS;
+  runExecute(env, c);
+  cl_event completion = c->events.completion();
+  if ((NODEN_SUCCESS != c->status) || !completion)
+    return;
+
+  HR_TIME_POINT waitStart = NOW;
+  error = clWaitForEvents(1, &completion);
+  ASYNC_CL_ERROR;
+  long long waited = microTime(waitStart);
+  c->kernelExec += waited;
+  c->totalTime += waited;
+}
+
+// Small runs on an idle queue are enqueued and waited for on the JS thread, returning the
+// timings directly. Other runs are queued as for run, returning a promise.
+napi_value runSync(napi_env env, napi_callback_info info) {
+  napi_status status;
+  runCarrier* c = new runCarrier;
+
+  napi_value programValue, optionsValue;
+  status = parseRunArgs(env, info, c, &programValue, &optionsValue);
+  uint32_t syncWorkItems = NODEN_SYNC_WORK_ITEMS;
+  if (napi_ok == status)
+    status = getSyncLimit(env, optionsValue, "syncWorkItems", &syncWorkItems);
+  if (napi_pending_exception == status) {
+    delete c;
+    return nullptr;
+  }
+  CHECK_STATUS;
+
+  // waiting for other work, or for a busy queue, would block the JS thread
+  if (!c->ctx->queueIdle(c->queueNum) || (c->events.numWaits() > 0) || (runWorkItems(c) > syncWorkItems))
+    return queueRunPromise(env, programValue, c);
+
+  runExecuteSync(env, c);
+  THROW_STATUS;
+
+  napi_value result;
+  status = runTimings(env, c, &result);
+  delete c;
+  CHECK_STATUS;
+  return result;
+}
+
+void batchExecute(napi_env env, void* data) {
+  batchCarrier* c = (batchCarrier*) data;
+  cl_int error = CL_SUCCESS;
+  HR_TIME_POINT start = NOW;
+
+  for (auto& item: c->items) {
+    runEnqueue(item);
+    if (NODEN_SUCCESS != item->status) {
+      c->status = item->status;
+      c->errorMsg = item->errorMsg;
+      return;
     }
+  }
 
-    int32_t checkValue;
-    status = napi_get_value_int32(env, args[1], &checkValue);
-    CHECK_STATUS;
-    if (!((checkValue >= 0) && (checkValue < (int32_t)numQueues))) {
-      status = napi_throw_range_error(env, nullptr, "Optional parameter queueNum out of range.");
-      delete c;
-      return nullptr;
+  // one flush and wait for the whole batch
+  cl_command_queue commandQueue = runQueue(c);
+  if (c->eventCompletion || (c->commandQueues.size() > 1)) {
+    error = c->events.markCompletion(commandQueue, c->inFlight);
+    ASYNC_CL_ERROR;
+    if (!c->eventCompletion && c->events.profiling()) {
+      for (auto& item: c->items) {
+        error = item->events.wait();
+        ASYNC_CL_ERROR;
+      }
     }
-    status = napi_get_value_uint32(env, args[1], &c->queueNum);
-    CHECK_STATUS;
   } else {
-    if (numQueues > 1) printf("run queueNum parameter not provided - defaulting to 0\n");
-    c->queueNum = 0;
+    error = clFinish(commandQueue);
+    ASYNC_CL_ERROR;
+  }
+
+  c->totalTime = microTime(start);
+}
+
+void batchComplete(napi_env env, napi_status asyncStatus, void* data) {
+  batchCarrier* c = (batchCarrier*) data;
+
+  if (asyncStatus != napi_ok) {
+    c->status = asyncStatus;
+    c->errorMsg = "Async batch run of program failed to complete.";
+  }
+  REJECT_STATUS;
+
+  napi_value result;
+  c->status = napi_create_object(env, &result);
+  REJECT_STATUS;
+
+  napi_value totalValue;
+  c->status = napi_create_int64(env, (int64_t) c->totalTime, &totalValue);
+  REJECT_STATUS;
+  c->status = napi_set_named_property(env, result, "totalTime", totalValue);
+  REJECT_STATUS;
+
+  napi_value runsValue;
+  c->status = napi_create_array_with_length(env, c->items.size(), &runsValue);
+  REJECT_STATUS;
+  for (uint32_t i = 0; i < (uint32_t)c->items.size(); ++i) {
+    napi_value itemValue;
+    c->status = runTimings(env, c->items[i], &itemValue);
+    REJECT_STATUS;
+    c->status = napi_set_element(env, runsValue, i, itemValue);
+    REJECT_STATUS;
   }
+  c->status = napi_set_named_property(env, result, "runs", runsValue);
+  REJECT_STATUS;
+
+  cl_event completion = c->events.takeCompletion();
+  if (completion) {
+    napi_value eventValue;
+    c->status = createEventHandle(env, completion, &eventValue);
+    REJECT_STATUS;
+    c->status = napi_set_named_property(env, result, "event", eventValue);
+    REJECT_STATUS;
+  }
+
+  napi_status status;
+  status = napi_resolve_deferred(env, c->_deferred, result);
+  FLOATING_STATUS;
+
+  tidyCarrier(env, c);
+}
 
-  // Extract externals into variables
-  napi_value jsContext;
-  void* contextData;
-  status = napi_get_named_property(env, programValue, "context", &jsContext);
+napi_value runBatch(napi_env env, napi_callback_info info) {
+  napi_status status;
+  batchCarrier* c = new batchCarrier;
+
+  napi_value args[3];
+  size_t argc = 3;
+  napi_value programValue;
+  status = napi_get_cb_info(env, info, &argc, args, &programValue, nullptr);
+  if (napi_ok != status) delete c;
   CHECK_STATUS;
-  status = napi_get_value_external(env, jsContext, &contextData);
-  c->context = (cl_context) contextData;
+
+  if (!((argc > 0) && (argc <= 3))) {
+    status = napi_throw_error(env, nullptr, "Wrong number of arguments. One to three expected.");
+    delete c;
+    return nullptr;
+  }
+
+  bool isArray = false;
+  status = napi_is_array(env, args[0], &isArray);
+  if (napi_ok != status) delete c;
   CHECK_STATUS;
+  uint32_t numRuns = 0;
+  if (isArray) {
+    status = napi_get_array_length(env, args[0], &numRuns);
+    if (napi_ok != status) delete c;
+    CHECK_STATUS;
+  }
+  if (0 == numRuns) {
+    status = napi_throw_type_error(env, nullptr, "First parameter must be a non-empty array of parameter objects.");
+    delete c;
+    return nullptr;
+  }
 
-  c->commandQueues.resize(numQueues);
-  for (uint32_t i = 0; i < numQueues; ++i) {
-    std::stringstream ss;
-    ss << "commands_" << i;
-    napi_value commandQueue;
-    status = napi_get_named_property(env, programValue, ss.str().c_str(), &commandQueue);
+  for (uint32_t i = 0; i < numRuns; ++i) {
+    runCarrier* item = new runCarrier;
+    c->items.push_back(item);
+    napi_value params;
+    status = napi_get_element(env, args[0], i, &params);
+    if (napi_ok != status) delete c;
     CHECK_STATUS;
-    c->status = napi_get_value_external(env, commandQueue, (void**)&c->commandQueues.at(i));
+    status = parseRun(env, programValue, params, item);
+    if (napi_ok != status) delete c;
+    if (napi_pending_exception == status) return nullptr;
     CHECK_STATUS;
   }
 
-  napi_value jsKernel;
-  void* kernelData;
-  status = napi_get_named_property(env, programValue, "kernel", &jsKernel);
-  CHECK_STATUS;
-  status = napi_get_value_external(env, jsKernel, &kernelData);
-  c->kernel = (cl_kernel) kernelData;
-  CHECK_STATUS;
+  runCarrier* first = c->items.front();
+  c->ctx = first->ctx;
+  c->commandQueues = first->commandQueues;
+  c->events.setProfiling(first->events.profiling());
+  if (argc > 1) {
+    status = parseQueueNum(env, args[1], (uint32_t)c->commandQueues.size(), &c->queueNum);
+    if (napi_ok != status) delete c;
+    if (napi_pending_exception == status) return nullptr;
+    CHECK_STATUS;
+
+    if (argc > 2) {
+      // the queue is in-order, so only the first run needs to wait
+      status = getEventOptions(env, args[2], first->events);
+      if (napi_ok != status) delete c;
+      if (napi_pending_exception == status) return nullptr;
+      CHECK_STATUS;
+      // every run of the batch uses the same range
+      for (auto& item: c->items) {
+        status = getNDRangeOptions(env, args[2], item);
+        if (napi_ok != status) delete c;
+        if (napi_pending_exception == status) return nullptr;
+        CHECK_STATUS;
+      }
+    }
+  } else if (c->commandQueues.size() > 1)
+    printf("runBatch queueNum parameter not provided - defaulting to 0\n");
+
+  for (auto& item: c->items)
+    item->queueNum = c->queueNum;
 
   status = napi_create_reference(env, programValue, 1, &c->passthru);
+  if (napi_ok != status) delete c;
   CHECK_STATUS;
 
-  napi_value promise, resource_name;
+  napi_value promise;
   status = napi_create_promise(env, &c->_deferred, &promise);
+  if (napi_ok != status) tidyCarrier(env, c);
   CHECK_STATUS;
 
-  status = napi_create_string_utf8(env, "Run", NAPI_AUTO_LENGTH, &resource_name);
-  CHECK_STATUS;
-  status = napi_create_async_work(env, NULL, resource_name, runExecute,
-    runComplete, c, &c->_request);
-  CHECK_STATUS;
-  status = napi_queue_async_work(env, c->_request);
+  status = queueRun(env, c->ctx, "RunBatch", batchExecute, batchComplete, c);
   CHECK_STATUS;
 
   return promise;
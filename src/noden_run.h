@@ -21,20 +21,23 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <mutex>
 #include "node_api.h"
 #include "noden_util.h"
 #include "run_params.h"
+#include "cl_events.h"
 
 class iClMemory;
 class iGpuMemory;
+struct contextState;
 
 enum class eParamFlags : uint8_t { VALUE = 0, BUFFER = 1, IMAGE = 2 };
 
 struct kernelParam {
-  kernelParam(const std::string& paramName, const std::string& paramType, iKernelArg::eAccess access) : 
+  kernelParam(const std::string& paramName, iKernelArg::eType paramType, iKernelArg::eAccess access) : 
     name(paramName), paramType(paramType), access(access), valueType(eParamFlags::VALUE), value(0) {}
   const std::string name;
-  std::string paramType;
+  iKernelArg::eType paramType;
   iKernelArg::eAccess access;
   eParamFlags valueType;
   union paramVal {
@@ -47,11 +50,40 @@ struct kernelParam {
     iClMemory* clMem;
   } value;
   std::shared_ptr<iGpuMemory> gpuAccess;
+  bool changed = true; // value must be (re)applied with clSetKernelArg
+};
+
+// One kernel object per command queue of a program, so that runs on different
+// queues set their arguments independently. The scalar values last set on each
+// kernel are kept so that unchanged values are not set again.
+class queueKernels {
+public:
+  struct instance {
+    cl_kernel kernel = nullptr;
+    std::mutex lock; // held from setting the arguments until the kernel is enqueued
+    std::map<uint32_t, uint64_t> values;
+  };
+
+  ~queueKernels();
+  // The given kernel is retained for queue 0, the others are created from its program
+  cl_int create(cl_kernel kernel, uint32_t numQueues);
+  instance* at(uint32_t queueNum) const { return mInstances.at(queueNum).get(); }
+  size_t size() const { return mInstances.size(); }
+
+private:
+  std::vector<std::unique_ptr<instance>> mInstances;
 };
 
 struct runCarrier : carrier {
+  ~runCarrier() {
+    if (ownsParams)
+      for (auto& paramIter: kernelParams)
+        delete paramIter.second;
+  }
   std::map<uint32_t, kernelParam*> kernelParams;
+  bool ownsParams = true;
   iRunParams *runParams;
+  contextState *ctx = nullptr;
   uint32_t queueNum = 0;
   long long dataToKernel;
   long long kernelExec;
@@ -59,8 +91,42 @@ struct runCarrier : carrier {
   cl_context context;
   std::vector<cl_command_queue> commandQueues;
   cl_kernel kernel;
+  queueKernels *kernels = nullptr; // the kernel for the run's queue is used when set
+  clEvents events;
+  bool eventCompletion = false; // complete from an event callback rather than clFinish
+  // NDRange for this run only - the program's global and local sizes are used when empty
+  std::vector<size_t> globalWorkItems;
+  std::vector<size_t> workItemsPerGroup;
+  bool nullWorkItemsPerGroup = false; // let the implementation choose the local size
+  std::vector<size_t> globalWorkOffset;
 };
 
+// Many runs of a program on one queue, enqueued together and completed together
+struct batchCarrier : runCarrier {
+  ~batchCarrier() {
+    for (auto& item: items)
+      delete item;
+  }
+  std::vector<runCarrier*> items;
+};
+
+cl_command_queue runQueue(runCarrier* c);
+// Sets the kernel arguments and enqueues the kernel without waiting for it to complete
+void runEnqueue(runCarrier* c);
+void runExecute(napi_env env, void* data);
+// Runs on the JS thread when the context has a completion queue, otherwise queues async work
+napi_status queueRun(napi_env env, contextState *ctx, const char *resourceName,
+  napi_async_execute_callback execute, napi_async_complete_callback complete, runCarrier* c);
+napi_status runTimings(napi_env env, runCarrier* c, napi_value* result);
+napi_status setParamValue(napi_env env, napi_value paramValue, kernelParam* kp);
+// Fill a run carrier with the kernel, queues and parameter values for a run of a program
+napi_status parseRun(napi_env env, napi_value programValue, napi_value params, runCarrier* c);
+napi_status parseQueueNum(napi_env env, napi_value queueNumValue, uint32_t numQueues, uint32_t* queueNum);
+// Reads the globalWorkItems, workItemsPerGroup and globalWorkOffset run options, that must match the program dimensions
+napi_status getNDRangeOptions(napi_env env, napi_value options, runCarrier* c);
+
 napi_value run(napi_env env, napi_callback_info info);
+napi_value runSync(napi_env env, napi_callback_info info);
+napi_value runBatch(napi_env env, napi_callback_info info);
 
 #endif
@@ -0,0 +1,253 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "noden_submit.h"
+
+napi_status submitEngine::create(napi_env env, uint32_t numQueues, submitEngine **engine) {
+  napi_status status;
+  submitEngine *e = new submitEngine(env);
+
+  napi_value resourceName;
+  status = napi_create_string_utf8(env, "SubmitEngine", NAPI_AUTO_LENGTH, &resourceName);
+  if (status != napi_ok) { delete e; return status; }
+  status = napi_create_threadsafe_function(env, nullptr, nullptr, resourceName, 0, 1,
+    e, finalizeTsfn, e, callComplete, &e->mTsfn);
+  if (status != napi_ok) { delete e; return status; }
+  // only keep the event loop alive while work is in flight
+  status = napi_unref_threadsafe_function(env, e->mTsfn);
+  PASS_STATUS;
+
+  for (uint32_t q = 0; q < numQueues; ++q) {
+    // each worker releases the function when it exits, so it is finalized once they have all stopped
+    status = napi_acquire_threadsafe_function(e->mTsfn);
+    PASS_STATUS;
+    worker *w = new worker;
+    e->mWorkers.push_back(w);
+    w->thread = std::thread(&submitEngine::workerLoop, e, w);
+  }
+
+  *engine = e;
+  return napi_ok;
+}
+
+bool submitEngine::submit(uint32_t queueNum, napi_async_execute_callback execute,
+                          napi_async_complete_callback complete, carrier *c) {
+  if (mClosed || !mTsfn || (queueNum >= mWorkers.size()))
+    return false;
+
+  worker *w = mWorkers.at(queueNum);
+  job j = { execute, complete, c };
+  if (w->overflowing.load(std::memory_order_acquire) || !w->ring.push(j)) {
+    // once the ring is full, jobs queue behind it until the worker has caught up
+    std::lock_guard<std::mutex> lk(w->m);
+    w->overflow.push_back(j);
+    w->overflowing.store(true, std::memory_order_release);
+  }
+  if (w->sleeping.load(std::memory_order_seq_cst)) {
+    std::lock_guard<std::mutex> lk(w->m);
+    w->cv.notify_one();
+  }
+
+  if (0 == mInFlight++)
+    napi_ref_threadsafe_function(mEnv, mTsfn);
+  return true;
+}
+
+bool submitEngine::popOverflow(worker *w, job &j) {
+  if (w->overflow.empty())
+    return false;
+  j = w->overflow.front();
+  w->overflow.pop_front();
+  // the ring is empty, so the producer can use it again once the overflow is drained
+  if (w->overflow.empty())
+    w->overflowing.store(false, std::memory_order_release);
+  return true;
+}
+
+void submitEngine::runJob(const job &j) {
+  j.execute(mEnv, j.c);
+  job *done = new job(j);
+  if (napi_ok != napi_call_threadsafe_function(mTsfn, done, napi_tsfn_nonblocking))
+    delete done; // environment is closing
+}
+
+void submitEngine::workerLoop(worker *w) {
+  while (true) {
+    job j;
+    if (w->ring.pop(j)) {
+      runJob(j);
+      continue;
+    }
+    if (w->overflowing.load(std::memory_order_acquire)) {
+      std::unique_lock<std::mutex> lk(w->m);
+      bool popped = popOverflow(w, j);
+      lk.unlock();
+      if (popped) {
+        runJob(j);
+        continue;
+      }
+    }
+
+    std::unique_lock<std::mutex> lk(w->m);
+    w->sleeping.store(true, std::memory_order_seq_cst);
+    // check again now that the producer can see this thread is sleeping
+    if (w->ring.pop(j) || popOverflow(w, j)) {
+      w->sleeping.store(false, std::memory_order_relaxed);
+      lk.unlock();
+      runJob(j);
+      continue;
+    }
+    if (mStop.load())
+      break;
+    w->cv.wait(lk);
+    w->sleeping.store(false, std::memory_order_relaxed);
+  }
+  // the engine may be deleted as soon as the last worker has released the function
+  napi_release_threadsafe_function(mTsfn, napi_tsfn_release);
+}
+
+void submitEngine::stopWorkers() {
+  mStop.store(true);
+  for (auto& w: mWorkers) {
+    std::lock_guard<std::mutex> lk(w->m);
+    w->cv.notify_one();
+  }
+}
+
+void submitEngine::joinWorkers() {
+  for (auto& w: mWorkers) {
+    if (w->thread.joinable())
+      w->thread.join();
+    delete w;
+  }
+  mWorkers.clear();
+}
+
+void submitEngine::close() {
+  mClosed = true;
+  if (mTsfn) {
+    // finalizeTsfn deletes the engine once the workers have finished and released the function
+    stopWorkers();
+    napi_release_threadsafe_function(mTsfn, napi_tsfn_release);
+  } else
+    delete this;
+}
+
+void submitEngine::callComplete(napi_env env, napi_value jsCallback, void* context, void* data) {
+  submitEngine *e = (submitEngine*)context;
+  job *j = (job*)data;
+  if (env) {
+    if (0 == --e->mInFlight)
+      napi_unref_threadsafe_function(env, e->mTsfn);
+    j->complete(env, napi_ok, j->c);
+  }
+  delete j;
+}
+
+void submitEngine::finalizeTsfn(napi_env env, void* data, void* hint) {
+  submitEngine *e = (submitEngine*)data;
+  // after close the workers have already exited, otherwise the environment is being torn down
+  e->stopWorkers();
+  e->joinWorkers();
+  e->mTsfn = nullptr;
+  if (e->mClosed)
+    delete e;
+}
+
+napi_status queueWork(napi_env env, submitEngine *engine, uint32_t queueNum, const char *resourceName,
+  napi_async_execute_callback execute, napi_async_complete_callback complete, carrier *c) {
+  napi_status status;
+  if (engine && engine->submit(queueNum, execute, complete, c))
+    return napi_ok;
+
+  napi_value resource_name;
+  status = napi_create_string_utf8(env, resourceName, NAPI_AUTO_LENGTH, &resource_name);
+  PASS_STATUS;
+  status = napi_create_async_work(env, NULL, resource_name, execute, complete, c, &c->_request);
+  PASS_STATUS;
+  return napi_queue_async_work(env, c->_request);
+}
+
+napi_status completionQueue::create(napi_env env, completionQueue **queue) {
+  napi_status status;
+  completionQueue *cq = new completionQueue(env);
+
+  napi_value resourceName;
+  status = napi_create_string_utf8(env, "EventCompletion", NAPI_AUTO_LENGTH, &resourceName);
+  if (status != napi_ok) { delete cq; return status; }
+  status = napi_create_threadsafe_function(env, nullptr, nullptr, resourceName, 0, 1,
+    cq, finalizeTsfn, cq, callComplete, &cq->mTsfn);
+  if (status != napi_ok) { delete cq; return status; }
+  status = napi_unref_threadsafe_function(env, cq->mTsfn);
+  PASS_STATUS;
+
+  *queue = cq;
+  return napi_ok;
+}
+
+cl_int completionQueue::completeOnEvent(cl_event event, napi_async_complete_callback complete, carrier *c) {
+  if (mClosed || !mTsfn)
+    return CL_INVALID_OPERATION;
+
+  if (0 == mInFlight++)
+    napi_ref_threadsafe_function(mEnv, mTsfn);
+  job *j = new job { this, complete, c };
+  cl_int error = clSetEventCallback(event, CL_COMPLETE, onEvent, j);
+  if (CL_SUCCESS != error) {
+    delete j;
+    if (0 == --mInFlight)
+      napi_unref_threadsafe_function(mEnv, mTsfn);
+  }
+  return error;
+}
+
+void CL_CALLBACK completionQueue::onEvent(cl_event event, cl_int eventStatus, void* data) {
+  job *j = (job*)data;
+  if (eventStatus < 0) {
+    j->c->status = eventStatus;
+    char errorMsg[200];
+    snprintf(errorMsg, 200, "OpenCL command terminated abnormally with error %i of type %s.",
+      eventStatus, clGetErrorString(eventStatus));
+    j->c->errorMsg = std::string(errorMsg);
+  }
+  if (napi_ok != napi_call_threadsafe_function(j->queue->mTsfn, j, napi_tsfn_nonblocking))
+    delete j; // environment is closing
+}
+
+void completionQueue::callComplete(napi_env env, napi_value jsCallback, void* context, void* data) {
+  completionQueue *cq = (completionQueue*)context;
+  job *j = (job*)data;
+  if (env) {
+    if (0 == --cq->mInFlight)
+      napi_unref_threadsafe_function(env, cq->mTsfn);
+    j->complete(env, napi_ok, j->c);
+  }
+  delete j;
+}
+
+void completionQueue::close() {
+  mClosed = true;
+  if (mTsfn)
+    napi_release_threadsafe_function(mTsfn, napi_tsfn_abort); // finalizeTsfn deletes the queue
+  else
+    delete this;
+}
+
+void completionQueue::finalizeTsfn(napi_env env, void* data, void* hint) {
+  completionQueue *cq = (completionQueue*)data;
+  cq->mTsfn = nullptr;
+  if (cq->mClosed)
+    delete cq;
+}
@@ -0,0 +1,156 @@
+/* Copyright 2018 Streampunk Media Ltd.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef NODEN_SUBMIT_H
+#define NODEN_SUBMIT_H
+
+#include "cl_include.h"
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "node_api.h"
+#include "noden_util.h"
+
+// Single producer, single consumer ring of fixed size. The producer is always
+// the JS thread and the consumer is the worker thread for one command queue.
+template <typename T, size_t N>
+class spscRing {
+public:
+  spscRing() : mHead(0), mTail(0) {}
+
+  bool push(const T& item) {
+    size_t tail = mTail.load(std::memory_order_relaxed);
+    if (tail - mHead.load(std::memory_order_acquire) == N)
+      return false;
+    mItems[tail % N] = item;
+    mTail.store(tail + 1, std::memory_order_seq_cst);
+    return true;
+  }
+
+  bool pop(T& item) {
+    size_t head = mHead.load(std::memory_order_relaxed);
+    if (head == mTail.load(std::memory_order_seq_cst))
+      return false;
+    item = mItems[head % N];
+    mHead.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::array<T, N> mItems;
+  std::atomic<size_t> mHead;
+  std::atomic<size_t> mTail;
+};
+
+// Runs the execute step of runs, host accesses, buffer allocations and waits
+// on a dedicated thread per command queue, rather than on the libuv thread
+// pool, in submission order. Completions are passed back to the JS thread
+// through a thread-safe function, which each worker holds until it exits.
+class submitEngine {
+public:
+  static napi_status create(napi_env env, uint32_t numQueues, submitEngine **engine);
+
+  // Returns false if the engine is closed, in which case the caller should use async work
+  bool submit(uint32_t queueNum, napi_async_execute_callback execute,
+              napi_async_complete_callback complete, carrier *c);
+
+  // Called when the JS object owning the engine is collected. Workers finish their
+  // queued work and exit without the JS thread waiting for them.
+  void close();
+
+private:
+  struct job {
+    napi_async_execute_callback execute;
+    napi_async_complete_callback complete;
+    carrier *c;
+  };
+
+  struct worker {
+    spscRing<job, 256> ring;
+    // jobs queued behind a full ring, guarded by m, so that submission order is kept
+    std::deque<job> overflow;
+    std::atomic<bool> overflowing;
+    std::thread thread;
+    std::mutex m;
+    std::condition_variable cv;
+    std::atomic<bool> sleeping;
+    worker() : overflowing(false), sleeping(false) {}
+  };
+
+  submitEngine(napi_env env) : mEnv(env), mTsfn(nullptr), mInFlight(0), mStop(false), mClosed(false) {}
+  ~submitEngine() {}
+
+  void workerLoop(worker *w);
+  // Takes the next job queued behind the ring, with the worker's lock held
+  static bool popOverflow(worker *w, job &j);
+  void runJob(const job &j);
+  void stopWorkers();
+  void joinWorkers();
+
+  static void callComplete(napi_env env, napi_value jsCallback, void* context, void* data);
+  static void finalizeTsfn(napi_env env, void* data, void* hint);
+
+  napi_env mEnv;
+  napi_threadsafe_function mTsfn;
+  std::vector<worker*> mWorkers;
+  uint32_t mInFlight;
+  std::atomic<bool> mStop;
+  bool mClosed;
+};
+
+// Calls the complete step of work when an OpenCL event completes, so that no
+// thread waits while the device is busy. Event callbacks run on threads owned
+// by the OpenCL implementation and are passed to the JS thread through a
+// thread-safe function.
+class completionQueue {
+public:
+  static napi_status create(napi_env env, completionQueue **queue);
+
+  // The event must stay valid until complete is called, typically by being held by the carrier
+  cl_int completeOnEvent(cl_event event, napi_async_complete_callback complete, carrier *c);
+
+  // Called when the JS object owning the queue is collected
+  void close();
+
+private:
+  struct job {
+    completionQueue *queue;
+    napi_async_complete_callback complete;
+    carrier *c;
+  };
+
+  completionQueue(napi_env env) : mEnv(env), mTsfn(nullptr), mInFlight(0), mClosed(false) {}
+  ~completionQueue() {}
+
+  static void CL_CALLBACK onEvent(cl_event event, cl_int eventStatus, void* data);
+  static void callComplete(napi_env env, napi_value jsCallback, void* context, void* data);
+  static void finalizeTsfn(napi_env env, void* data, void* hint);
+
+  napi_env mEnv;
+  napi_threadsafe_function mTsfn;
+  uint32_t mInFlight;
+  bool mClosed;
+};
+
+// Queue work for a command queue on the submission engine of a context, if it has
+// one, otherwise queue it as async work on the libuv thread pool
+napi_status queueWork(napi_env env, submitEngine *engine, uint32_t queueNum, const char *resourceName,
+  napi_async_execute_callback execute, napi_async_complete_callback complete, carrier *c);
+
+#endif
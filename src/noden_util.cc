@@ -188,36 +188,135 @@ napi_status checkArgs(napi_env env, napi_callback_info info, const char* methodN
 };
 
 
+void finalizeClasses(napi_env env, void* data, void* hint) {
+  nodenClasses *classes = (nodenClasses*)data;
+  napi_delete_reference(env, classes->contextClass);
+  napi_delete_reference(env, classes->programClass);
+  for (auto& method: classes->bufferMethods)
+    napi_delete_reference(env, method.second);
+  delete classes;
+}
+
+napi_status getClasses(napi_env env, nodenClasses **classes) {
+  return napi_get_instance_data(env, (void**)classes);
+}
+
+napi_status newInstance(napi_env env, napi_ref constructor, napi_value *result) {
+  napi_status status;
+  napi_value constructorValue;
+  status = napi_get_reference_value(env, constructor, &constructorValue);
+  PASS_STATUS;
+  return napi_new_instance(env, constructorValue, 0, nullptr, result);
+}
+
+napi_status wrapState(napi_env env, napi_value object, const napi_type_tag *tag,
+  void *state, napi_finalize finalize) {
+  napi_status status;
+  status = napi_wrap(env, object, state, finalize, nullptr, nullptr);
+  PASS_STATUS;
+  status = napi_type_tag_object(env, object, tag);
+  if (napi_ok != status)
+    napi_remove_wrap(env, object, nullptr); // the caller still owns the state
+  return status;
+}
+
+napi_status unwrapState(napi_env env, napi_value object, const napi_type_tag *tag,
+  const char *typeName, void **state) {
+  napi_status status;
+  napi_valuetype t;
+  status = napi_typeof(env, object, &t);
+  PASS_STATUS;
+  bool isTagged = false;
+  if (napi_object == t) {
+    status = napi_check_object_type_tag(env, object, tag, &isTagged);
+    PASS_STATUS;
+  }
+  if (!isTagged) {
+    std::string errorMsg = std::string("Expected ") + typeName + ".";
+    napi_throw_type_error(env, nullptr, errorMsg.c_str());
+    return napi_pending_exception;
+  }
+  return napi_unwrap(env, object, state);
+}
+
+napi_status getSyncLimit(napi_env env, napi_value options, const char* name, uint32_t* limit) {
+  napi_status status;
+  napi_valuetype t;
+  if (!options)
+    return napi_ok;
+  status = napi_typeof(env, options, &t);
+  PASS_STATUS;
+  if (napi_object != t)
+    return napi_ok;
+
+  napi_value limitValue;
+  status = napi_get_named_property(env, options, name, &limitValue);
+  PASS_STATUS;
+  status = napi_typeof(env, limitValue, &t);
+  PASS_STATUS;
+  if (napi_undefined == t)
+    return napi_ok;
+  if (napi_number != t) {
+    std::string err = std::string("Option ") + name + " must be a number.";
+    napi_throw_type_error(env, nullptr, err.c_str());
+    return napi_pending_exception;
+  }
+  return napi_get_value_uint32(env, limitValue, limit);
+}
+
 void tidyCarrier(napi_env env, carrier* c) {
   napi_status status;
   if (c->passthru != nullptr) {
     status = napi_delete_reference(env, c->passthru);
     FLOATING_STATUS;
   }
-  status = napi_delete_async_work(env, c->_request);
-  FLOATING_STATUS;
+  if (c->_request != nullptr) { // not set for work run by a submission engine
+    status = napi_delete_async_work(env, c->_request);
+    FLOATING_STATUS;
+  }
   delete c;
 }
 
+napi_status statusError(napi_env env, carrier* c, const char* file, int32_t line, napi_value* errorValue) {
+  napi_value errorCode, errorMsg;
+  napi_status status;
+  char statusChars[20];
+  snprintf(statusChars, 20, "%d", c->status);
+  std::string extMsg = std::string("In file ") + file + " on line " + std::to_string(line) +
+    ", found error: " + c->errorMsg;
+  status = napi_create_string_utf8(env, statusChars, NAPI_AUTO_LENGTH, &errorCode);
+  PASS_STATUS;
+  status = napi_create_string_utf8(env, extMsg.c_str(), NAPI_AUTO_LENGTH, &errorMsg);
+  PASS_STATUS;
+  return napi_create_error(env, errorCode, errorMsg, errorValue);
+}
+
 int32_t rejectStatus(napi_env env, carrier* c, const char* file, int32_t line) {
+  int32_t result = c->status;
   if (c->status != NODEN_SUCCESS) {
-    napi_value errorValue, errorCode, errorMsg;
+    napi_value errorValue;
     napi_status status;
-    char statusChars[20];
-    snprintf(statusChars, 20, "%d", c->status);
-    char* extMsg = (char *) malloc(sizeof(char) * c->errorMsg.length() + 200);
-    sprintf(extMsg, "In file %s on line %i, found error: %s", file, line, c->errorMsg.c_str());
-    status = napi_create_string_utf8(env, statusChars, NAPI_AUTO_LENGTH, &errorCode);
+    status = statusError(env, c, file, line, &errorValue);
     FLOATING_STATUS;
-    status = napi_create_string_utf8(env, extMsg, NAPI_AUTO_LENGTH, &errorMsg);
+    status = napi_reject_deferred(env, c->_deferred, errorValue);
     FLOATING_STATUS;
-    status = napi_create_error(env, errorCode, errorMsg, &errorValue);
+
+    tidyCarrier(env, c); // the carrier is deleted
+  }
+  return result;
+}
+
+int32_t throwStatus(napi_env env, carrier* c, const char* file, int32_t line) {
+  int32_t result = c->status;
+  if (c->status != NODEN_SUCCESS) {
+    napi_value errorValue;
+    napi_status status;
+    status = statusError(env, c, file, line, &errorValue);
     FLOATING_STATUS;
-    status = napi_reject_deferred(env, c->_deferred, errorValue);
+    status = napi_throw(env, errorValue);
     FLOATING_STATUS;
 
-    delete[] extMsg;
     tidyCarrier(env, c);
   }
-  return c->status;
+  return result;
 }
@@ -17,9 +17,13 @@
 #define NODEN_UTIL_H
 
 #include "cl_include.h"
+#include <atomic>
 #include <chrono>
+#include <memory>
 #include <stdio.h>
 #include <string>
+#include <utility>
+#include <vector>
 #include "node_api.h"
 
 #define DECLARE_NAPI_METHOD(name, func) { name, 0, func, 0, 0, 0, napi_default, 0 }
@@ -54,6 +58,29 @@ long long microTime(std::chrono::high_resolution_clock::time_point start);
 napi_status checkArgs(napi_env env, napi_callback_info info, const char* methodName,
   napi_value* args, size_t argc, napi_valuetype* types);
 
+// Default thresholds below which runSync and hostAccessSync complete on the JS thread
+#define NODEN_SYNC_WORK_ITEMS 65536
+#define NODEN_SYNC_BYTES 1048576
+// Reads an optional numeric threshold for the synchronous path from run or host access options
+napi_status getSyncLimit(napi_env env, napi_value options, const char* name, uint32_t* limit);
+
+// Constructors and shared methods, created once for each environment that loads the module
+struct nodenClasses {
+  napi_ref contextClass = nullptr;
+  napi_ref programClass = nullptr;
+  std::vector<std::pair<std::string, napi_ref>> bufferMethods;
+};
+
+void finalizeClasses(napi_env env, void* data, void* hint);
+napi_status getClasses(napi_env env, nodenClasses **classes);
+napi_status newInstance(napi_env env, napi_ref constructor, napi_value *result);
+
+// Native state wrapped in a JS object, tagged so that it is only unwrapped as the expected type
+napi_status wrapState(napi_env env, napi_value object, const napi_type_tag *tag,
+  void *state, napi_finalize finalize);
+napi_status unwrapState(napi_env env, napi_value object, const napi_type_tag *tag,
+  const char *typeName, void **state);
+
 // Async error handling
 #define NODEN_OUT_OF_RANGE 4097
 #define NODEN_ASYNC_FAILURE 4098
@@ -62,17 +89,22 @@ napi_status checkArgs(napi_env env, napi_callback_info info, const char* methodN
 #define NODEN_SUCCESS 0
 
 struct carrier {
-  virtual ~carrier() {}
+  virtual ~carrier() {
+    if (inFlight) --*inFlight;
+  }
   napi_ref passthru = nullptr;
+  std::shared_ptr<std::atomic<uint32_t>> inFlight; // count of work on the carrier's queue, if tracked
   int32_t status = NODEN_SUCCESS;
   std::string errorMsg;
   long long totalTime;
   napi_deferred _deferred;
-  napi_async_work _request;
+  napi_async_work _request = nullptr;
 };
 
 void tidyCarrier(napi_env env, carrier* c);
 int32_t rejectStatus(napi_env env, carrier* c, const char* file, int32_t line);
+// As rejectStatus, for work completed on the JS thread without a promise
+int32_t throwStatus(napi_env env, carrier* c, const char* file, int32_t line);
 
 #define ASYNC_CL_ERROR if (error != CL_SUCCESS) { \
   c->status = error; \
@@ -84,6 +116,7 @@ int32_t rejectStatus(napi_env env, carrier* c, const char* file, int32_t line);
 }
 
 #define REJECT_STATUS if (rejectStatus(env, c, __FILE__, __LINE__) != NODEN_SUCCESS) return;
+#define THROW_STATUS if (throwStatus(env, c, __FILE__, __LINE__) != NODEN_SUCCESS) return nullptr;
 #define FLOATING_STATUS if (status != napi_ok) { \
   printf("Unexpected N-API status not OK in file %s at line %d value %i.\n", \
     __FILE__, __LINE__ - 1, status); \
@@ -17,6 +17,7 @@
 #include "noden_info.h"
 #include "noden_context.h"
 #include "noden_program.h"
+#include "noden_buffer.h"
 #include "node_api.h"
 
 napi_value Init(napi_env env, napi_value exports) {
@@ -29,6 +30,17 @@ napi_value Init(napi_env env, napi_value exports) {
   status = napi_define_properties(env, exports, 3, desc);
   CHECK_STATUS;
 
+  // classes and shared methods are defined once for each instance of the module
+  nodenClasses *classes = new nodenClasses;
+  status = napi_set_instance_data(env, classes, finalizeClasses, nullptr);
+  CHECK_STATUS;
+  status = defineContextClass(env, &classes->contextClass);
+  CHECK_STATUS;
+  status = defineProgramClass(env, &classes->programClass);
+  CHECK_STATUS;
+  status = defineBufferMethods(env, classes);
+  CHECK_STATUS;
+
   return exports;
 }
 
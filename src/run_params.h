@@ -17,16 +17,20 @@
 #define RUN_PARAMS_H
 
 #include <string>
+#include <vector>
 #include <map>
+#include <memory>
 
 class iKernelArg {
 public:
   enum class eAccess : uint8_t { NONE = 0, READONLY = 1, WRITEONLY = 2 };
+  enum class eType : uint8_t { UNKNOWN = 0, UINT = 1, INT = 2, LONG = 3, FLOAT = 4, DOUBLE = 5, BUFFER = 6, IMAGE = 7 };
   virtual ~iKernelArg() {}
 
   virtual std::string name() const = 0;
   virtual std::string type() const = 0;
   virtual eAccess access() const = 0;
+  virtual eType argType() const = 0;
 
   virtual std::string toString() const = 0;
 };
@@ -38,8 +42,14 @@ public:
 
   virtual size_t numDims() const = 0;
   virtual const size_t *globalWorkItems() const = 0;
-  virtual const size_t *workItemsPerGroup() const = 0;
-  virtual const tKernelArgMap kernelArgMap() const = 0;
+  // The local size used by runs, nullptr lets the implementation choose. Each call returns an
+  // immutable snapshot that stays valid on other threads when autotuning replaces the size.
+  virtual std::shared_ptr<const std::vector<size_t>> workItemsPerGroup() const = 0;
+  // CL_KERNEL_WORK_GROUP_SIZE, the largest work group the kernel can be run with on the device
+  virtual size_t kernelWorkGroupSize() const = 0;
+  // Replaces the local size used by runs, an empty vector lets the implementation choose
+  virtual void setWorkItemsPerGroup(const std::vector<size_t>& wig) = 0;
+  virtual const tKernelArgMap& kernelArgMap() const = 0;
 };
 
 #endif
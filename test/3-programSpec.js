@@ -15,6 +15,9 @@
 
 const addon = require('../index.js');
 const tape = require('tape');
+const os = require('os');
+const path = require('path');
+const fs = require('fs');
 
 const testBuffer = `
   __kernel void test(__global uint4* restrict input,
@@ -44,6 +47,16 @@ __kernel void
   }
 `;
 
+const testKernels = `
+  __kernel void first(__global uint* restrict output) {
+    output[get_global_id(0)] = 1;
+  }
+
+  __kernel void second(__global uint* restrict output, uint value) {
+    output[get_global_id(0)] = value;
+  }
+`;
+
 function createContext(description, properties, cb) {
   tape(description, async t => {
     const clContext = new addon.clContext(properties);
@@ -80,7 +93,8 @@ createContext('Create program with buffer parameters', { platformIndex: pi, devi
     workItemsPerGroup: workItemsPerGroup
   });
   t.deepEqual(testBuffer, testProgram.kernelSource, 'has the correct program source');
-  t.ok(Object.prototype.hasOwnProperty.call(testProgram, 'run'), 'has run function');
+  t.equal(typeof testProgram.run, 'function', 'has run function');
+  t.throws(() => testProgram.run.call({}, {}), /Expected an OpenCL program/, 'run checks it is called on a program');
 });
 
 createContext('Create program with no kernel name parameter', { platformIndex: pi, deviceIndex: di }, async (t, clContext) => {
@@ -91,7 +105,7 @@ createContext('Create program with no kernel name parameter', { platformIndex: p
     workItemsPerGroup: workItemsPerGroup
   });
   t.deepEqual(testBuffer, testProgram.kernelSource, 'has the correct program source');
-  t.ok(Object.prototype.hasOwnProperty.call(testProgram, 'run'), 'has run function');
+  t.equal(typeof testProgram.run, 'function', 'has run function');
 });
 
 createContext('Create program with no globalWorkItems parameter', { platformIndex: pi, deviceIndex: di }, async (t, clContext) => {
@@ -115,5 +129,123 @@ createContext('Create program with image parameters', { platformIndex: pi, devic
     globalWorkItems: Uint32Array.from([ width, height ])
   });
   t.deepEqual(testImage, testProgram.kernelSource, 'has the correct program source');
-  t.ok(Object.prototype.hasOwnProperty.call(testProgram, 'run'), 'has run function');
+  t.equal(typeof testProgram.run, 'function', 'has run function');
+});
+
+createContext('Create kernels from a program with several kernels', { platformIndex: pi, deviceIndex: di }, async (t, clContext) => {
+  const testProgram = await clContext.createProgram(testKernels, { globalWorkItems: 1024 });
+  t.deepEqual(testProgram.kernelNames.slice().sort(), [ 'first', 'second' ], 'lists every kernel in the program');
+  const secondKernel = await testProgram.createKernel('second', { globalWorkItems: 256 });
+  t.deepEqual(testKernels, secondKernel.kernelSource, 'has the correct program source');
+  t.equal(typeof secondKernel.run, 'function', 'has run function');
+
+  const output = await clContext.createBuffer(1024 * 4, 'readwrite', 'coarse');
+  await output.hostAccess('writeonly');
+  output.fill(0);
+  await testProgram.run({ output: output });
+  await secondKernel.run({ output: output, value: 7 });
+  await output.hostAccess('readonly');
+  t.equal(output.readUInt32LE(0), 7, 'second kernel overwrites the start of the buffer');
+  t.equal(output.readUInt32LE(1023 * 4), 1, 'first kernel writes the end of the buffer');
+
+  try {
+    await testProgram.createKernel('third', { globalWorkItems: 256 });
+    t.fail('unknown kernel name should give error');
+  } catch (err) {
+    t.pass(`unknown kernel name produces ${err}`);
+  }
+});
+
+const testDefines = `
+  __constant uint values[] = { VALUES };
+  __kernel void test(__global uint* restrict output) {
+    uint i = get_global_id(0);
+  #if FLAG && NODEN_PREFERRED_VECTOR_WIDTH_INT > 0
+    output[i] = WIDTH + values[i % 3];
+  #endif
+  }
+`;
+
+createContext('Create program with build options and defines', { platformIndex: pi, deviceIndex: di }, async (t, clContext) => {
+  const testProgram = await clContext.createProgram(testDefines, {
+    globalWorkItems: 256,
+    buildOptions: '-cl-mad-enable',
+    defines: { WIDTH: 1920, FLAG: true, VALUES: [ 1, 2, 3 ] }
+  });
+  const output = await clContext.createBuffer(256 * 4, 'writeonly', 'coarse');
+  await output.hostAccess('writeonly');
+  output.fill(0);
+  await testProgram.run({ output: output });
+  await output.hostAccess('readonly');
+  t.equal(output.readUInt32LE(0), 1921, 'defines are compile-time constants');
+  t.equal(output.readUInt32LE(5 * 4), 1923, 'array define is a comma separated list');
+
+  try {
+    await clContext.createProgram(testDefines, { globalWorkItems: 256, defines: { '1BAD': 1 } });
+    t.fail('invalid define name should give error');
+  } catch (err) {
+    t.pass(`invalid define name produces ${err}`);
+  }
+});
+
+const testSpecialise = `
+  __kernel void test(__global uint* restrict output, uint width) {
+  #ifdef NODEN_SPECIALISED_width
+    output[get_global_id(0)] = NODEN_SPECIALISED_width + 1000;
+  #else
+    output[get_global_id(0)] = width;
+  #endif
+  }
+`;
+
+createContext('Run program with a specialised argument', { platformIndex: pi, deviceIndex: di }, async (t, clContext) => {
+  const testProgram = await clContext.createProgram(testSpecialise, { globalWorkItems: 64, specialise: [ 'width' ] });
+  const output = await clContext.createBuffer(64 * 4, 'writeonly', 'coarse');
+  for (const width of [ 5, 6, 5 ]) {
+    await testProgram.run({ output: output, width: width });
+    await output.hostAccess('readonly');
+    t.equal(output.readUInt32LE(0), width + 1000, `run with width ${width} uses the specialised variant`);
+  }
+
+  await testProgram.runBatch([ { output: output, width: 7 }, { output: output, width: 8 } ]);
+  await output.hostAccess('readonly');
+  t.equal(output.readUInt32LE(0), 8, 'batch with mixed values uses the generic program');
+
+  try {
+    await testProgram.run({ output: output, width: 'wide' });
+    t.fail('non-numeric specialised argument should give error');
+  } catch (err) {
+    t.pass(`non-numeric specialised argument produces ${err}`);
+  }
+});
+
+createContext('Limit the number of specialised variants', { platformIndex: pi, deviceIndex: di }, async (t, clContext) => {
+  const testProgram = await clContext.createProgram(testSpecialise, { globalWorkItems: 64, specialise: [ 'width' ], maxVariants: 2 });
+  const output = await clContext.createBuffer(64 * 4, 'writeonly', 'coarse');
+  for (const width of [ 5, 6, 7, 5 ]) {
+    await testProgram.run({ output: output, width: width });
+    await output.hostAccess('readonly');
+    t.equal(output.readUInt32LE(0), width + 1000, `run with width ${width} rebuilds a dropped variant when needed`);
+  }
+
+  try {
+    await clContext.createProgram(testSpecialise, { globalWorkItems: 64, specialise: [ 'width' ], maxVariants: 0 });
+    t.fail('maxVariants of zero should give error');
+  } catch (err) {
+    t.pass(`maxVariants of zero produces ${err}`);
+  }
+});
+
+const cacheDir = fs.mkdtempSync(path.join(os.tmpdir(), 'nodencl-'));
+createContext('Create program twice with a program cache', { platformIndex: pi, deviceIndex: di, cacheDir: cacheDir }, async (t, clContext) => {
+  const options = { name: 'test', globalWorkItems: 4096, workItemsPerGroup: 64 };
+  const firstProgram = await clContext.createProgram(testBuffer, options);
+  t.notOk(firstProgram.fromCache, 'first program is built from source');
+  t.equal(fs.readdirSync(cacheDir).filter(f => f.endsWith('.clbin')).length, 1, 'program binary is cached');
+  const secondProgram = await clContext.createProgram(testBuffer, options);
+  t.ok(secondProgram.fromCache, 'second program is loaded from the cache');
+  t.equal(typeof secondProgram.run, 'function', 'has run function');
+  const definedProgram = await clContext.createProgram(testBuffer, Object.assign({ defines: { UNUSED: 1 } }, options));
+  t.notOk(definedProgram.fromCache, 'program with different defines is built from source');
+  fs.rmSync(cacheDir, { recursive: true, force: true });
 });
@@ -19,9 +19,9 @@ const tape = require('tape');
 const pi = 0;
 const di = 0;
 const properties = { platformIndex: pi, deviceIndex: di };
-function createContext(description, cb) {
+function createContext(description, cb, contextProps = properties) {
   tape(description, async t => {
-    const clContext = new addon.clContext(properties);
+    const clContext = new addon.clContext(contextProps);
     try {
       await clContext.initialise();
       await cb(t, clContext);
@@ -71,6 +71,22 @@ createContext('Create buffer with negative size', async (t, clContext) => {
   }
 });
 
+createContext('Create buffer larger than the device maximum allocation', async (t, clContext) => {
+  const maxMemAllocSize = platformInfo[pi].devices[di].maxMemAllocSize;
+  try {
+    await clContext.createBuffer(Number(maxMemAllocSize) + 4096, 'readwrite');
+    t.fail('buffer size above the maximum allocation should give error');
+  } catch (err) {
+    t.pass(`buffer size above the maximum allocation produces ${err}`);
+  }
+  try {
+    await clContext.createBuffer(numBytes + 0.5, 'readwrite');
+    t.fail('fractional buffer size should give error');
+  } catch (err) {
+    t.pass(`fractional buffer size produces ${err}`);
+  }
+});
+
 createContext('Create buffer with no direction parameter', async (t, clContext) => {
   try {
     await clContext.createBuffer(numBytes);
@@ -121,3 +137,101 @@ createContext('Create buffer and request host access with incorrect access param
     t.pass(`incorrect host access parameter produces ${err}`);
   }
 });
+
+createContext('Reuse released buffers from the pool', async (t, clContext) => {
+  const first = await clContext.createBuffer(numBytes, 'readwrite', 'none', null, 'pool');
+  first.release();
+  const second = await clContext.createBuffer(numBytes, 'readwrite', 'none', null, 'pool');
+  t.equal(second, first, 'released buffer is reused');
+  const third = await clContext.createBuffer(numBytes, 'readwrite', 'none', null, 'pool');
+  t.notEqual(third, first, 'reserved buffer is not reused');
+  const stats = clContext.getPoolStats();
+  t.equal(stats.hits, 1, 'pool hit is counted');
+  t.equal(stats.misses, 2, 'pool misses are counted');
+  t.equal(stats.allocatedBytes, numBytes * 2, 'allocated bytes are tracked');
+});
+
+createContext('Evict released buffers to stay within the budget', async (t, clContext) => {
+  const first = await clContext.createBuffer(numBytes, 'readwrite', 'none', null, 'pool');
+  const second = await clContext.createBuffer(numBytes, 'readwrite', 'none', null, 'pool');
+  first.release();
+  await clContext.createBuffer(numBytes * 2, 'readwrite', 'none', null, 'pool');
+  const stats = clContext.getPoolStats();
+  t.equal(stats.evictions, 1, 'released buffer is evicted');
+  t.equal(stats.freeBuffers, 0, 'no released buffers remain');
+  t.equal(stats.allocatedBytes, numBytes * 3, 'reserved buffer is not evicted');
+  t.ok(clContext.buffers.includes(second), 'reserved buffer is still held');
+}, Object.assign({ bufferBudget: numBytes * 2 }, properties));
+
+createContext('Create buffers from an arena', async (t, clContext) => {
+  const buffers = [];
+  for (let x = 0; x < 4; ++x) {
+    const testBuffer = await clContext.createBuffer(numBytes + x, 'readwrite', 'none');
+    const srcBuf = Buffer.alloc(numBytes + x, x + 1);
+    await testBuffer.hostAccess('readwrite', srcBuf);
+    buffers.push(testBuffer);
+  }
+  buffers.forEach((testBuffer, x) =>
+    t.deepEqual(testBuffer, Buffer.alloc(numBytes + x, x + 1), `arena buffer ${x} contains expected data`));
+  const largeBuffer = await clContext.createBuffer(numBytes * 4, 'readwrite', 'none');
+  t.equal(largeBuffer.length, numBytes * 4, 'buffer larger than the arena slab is created');
+}, Object.assign({ arenaSize: numBytes * 2 }, properties));
+
+createContext('Wrap a Node buffer as OpenCL memory', async (t, clContext) => {
+  const srcBuf = Buffer.alloc(numBytes, 0x5e);
+  const testBuffer = await clContext.wrapBuffer(srcBuf, 'readwrite');
+  t.equal(typeof testBuffer.zeroCopy, 'boolean', 'wrapped buffer reports zero copy');
+  t.equal(testBuffer.numBytes, numBytes, 'wrapped buffer has the size of the Node buffer');
+  await testBuffer.hostAccess('readonly');
+  t.deepEqual(testBuffer, srcBuf, 'wrapped buffer contains the Node buffer data');
+
+  const fillProgram = await clContext.createProgram(`
+    __kernel void fill(__global uchar* restrict output) {
+      output[get_global_id(0)] = 0xa5;
+    }`, { name: 'fill', globalWorkItems: numBytes });
+  await fillProgram.run({ output: testBuffer });
+  await testBuffer.hostAccess('readonly');
+  t.deepEqual(srcBuf, Buffer.alloc(numBytes, 0xa5), 'kernel write shows in the original Node buffer');
+});
+
+createContext('Wrap something that is not a Node buffer', async (t, clContext) => {
+  try {
+    await clContext.wrapBuffer(numBytes);
+    t.fail('wrapping a number should give error');
+  } catch (err) {
+    t.pass(`wrapping a number produces ${err}`);
+  }
+});
+
+createContext('Request host access to part of a buffer', async (t, clContext) => {
+  const srcBuf = Buffer.alloc(numBytes, 0x3c);
+  const testBuffer = await clContext.createBuffer(numBytes, 'readwrite', 'none');
+  await testBuffer.hostAccess('writeonly', srcBuf);
+  await testBuffer.hostAccess('readonly', { offset: 1024, length: 256 });
+  t.deepEqual(testBuffer.slice(1024, 1280), srcBuf.slice(1024, 1280), 'range contains expected data');
+  await testBuffer.hostAccess('writeonly', 0, Buffer.alloc(256, 0xa5), { offset: 256 });
+  await testBuffer.hostAccess('readonly');
+  t.deepEqual(testBuffer.slice(256, 512), Buffer.alloc(256, 0xa5), 'source copied to the range');
+  try {
+    await testBuffer.hostAccess('readonly', { offset: numBytes - 16, length: 32 });
+    t.fail('range outside the buffer should give error');
+  } catch (err) {
+    t.pass(`range outside the buffer produces ${err}`);
+  }
+});
+
+createContext('Transfer data to and from a buffer', async (t, clContext) => {
+  const testBuffer = await clContext.createBuffer(numBytes, 'readwrite', 'none');
+  const srcBuf = Buffer.alloc(numBytes / 2, 0x69);
+  const written = await testBuffer.writeFrom(srcBuf, { offset: numBytes / 2 });
+  t.ok(written.event, 'write returns an event');
+  const dstBuf = Buffer.alloc(numBytes / 2);
+  await testBuffer.readInto(dstBuf, { offset: numBytes / 2, waitFor: written.event });
+  t.deepEqual(dstBuf, srcBuf, 'data read back matches data written');
+  try {
+    await testBuffer.writeFrom(srcBuf, { offset: numBytes });
+    t.fail('transfer outside the buffer should give error');
+  } catch (err) {
+    t.pass(`transfer outside the buffer produces ${err}`);
+  }
+});
@@ -15,6 +15,9 @@
 
 const addon = require('../index.js');
 const tape = require('tape');
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
 
 let pi = 0;
 let di = 0;
@@ -30,9 +33,9 @@ platformInfo.some((platform, p) => platform.devices.find((device, d) => {
 }));
 
 const properties = { platformIndex: pi, deviceIndex: di };
-function createContext(description, cb) {
+function createContext(description, cb, contextProps = properties) {
   tape(description, async t => {
-    const clContext = new addon.clContext(properties);
+    const clContext = new addon.clContext(contextProps);
     try {
       await clContext.initialise();
       await cb(t, clContext);
@@ -77,6 +80,7 @@ platformInfo.forEach((platform, pi) => {
   svmTypes[pi].push([]);
   platform.devices.forEach((device, di) => {
     svmTypes[pi][di].push('none');
+    svmTypes[pi][di].push('device');
     if (device.svmCapabilities.includes('CL_DEVICE_SVM_COARSE_GRAIN_BUFFER'))
       svmTypes[pi][di].push('coarse');
     if (device.svmCapabilities.includes('CL_DEVICE_SVM_FINE_GRAIN_BUFFER'))
@@ -104,6 +108,110 @@ for (let d=0; d<bufDirs.length; ++d) {
   });
 }
 
+createContext('Run OpenCL program chain with device buffers', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, testKernel);
+  const srcBuf = Buffer.alloc(numBytes);
+  for (let i=0; i<numBytes; i+=4)
+    srcBuf.writeUInt32LE((i/4)&0xff, i);
+
+  const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'device');
+  await bufIn.hostAccess('writeonly', srcBuf);
+  const bufMid = await clContext.createBuffer(numBytes, 'readwrite', 'device');
+  const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'device');
+
+  const first = await testProgram.run({ input: bufIn, output: bufMid });
+  t.ok(first.profile.some(p => p.name === 'stagingToDevice'), 'input is copied to the device');
+  const second = await testProgram.run({ input: bufMid, output: bufOut });
+  t.notOk(second.profile.some(p => p.name === 'stagingToDevice' || p.name === 'deviceToStaging'),
+    'intermediate buffer stays on the device');
+  const access = await bufOut.hostAccess('readonly');
+  t.ok(access.profile.some(p => p.name === 'deviceToStaging'), 'output is copied from the device');
+  t.deepEqual(bufOut, srcBuf, 'program chain produced expected result');
+
+  const again = await bufOut.hostAccess('readonly');
+  t.notOk(again.profile && again.profile.some(p => p.name === 'deviceToStaging'), 'unchanged output is not copied again');
+}, Object.assign({ profiling: true }, properties));
+
+const stripeKernel = `
+  __kernel void test(__global uint4* restrict input,
+                     __global uint4* restrict output) {
+    uint off = get_global_id(0) * 4;
+    for (uint i=0; i<4; ++i) {
+      output[off] = input[off];
+      ++off;
+    }
+  }
+`;
+
+createContext('Run OpenCL program in stripes with a global work offset', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, stripeKernel);
+  const srcBuf = Buffer.alloc(numBytes);
+  for (let i=0; i<numBytes; i+=4)
+    srcBuf.writeUInt32LE((i/4)&0xff, i);
+
+  const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none');
+  await bufIn.hostAccess('writeonly', srcBuf);
+  const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'none');
+  await bufOut.hostAccess('writeonly');
+  bufOut.fill(0);
+
+  const stripeItems = width / 16 * height / 2;
+  await testProgram.run({ input: bufIn, output: bufOut }, 0, { globalWorkItems: stripeItems });
+  await bufOut.hostAccess('readonly');
+  t.deepEqual(bufOut.slice(0, numBytes / 2), srcBuf.slice(0, numBytes / 2), 'first stripe produced expected result');
+  t.ok(bufOut.slice(numBytes / 2).every(v => v === 0), 'second stripe not yet written');
+
+  await testProgram.run({ input: bufIn, output: bufOut }, 0, { globalWorkItems: stripeItems, globalWorkOffset: stripeItems });
+  await bufOut.hostAccess('readonly');
+  t.deepEqual(bufOut, srcBuf, 'offset stripe completed the expected result');
+
+  try {
+    await testProgram.run({ input: bufIn, output: bufOut }, 0, { workItemsPerGroup: 1 << 20 });
+    t.fail('workItemsPerGroup larger than the kernel work group size should give error');
+  } catch (err) {
+    t.pass(`workItemsPerGroup larger than the kernel work group size produces ${err}`);
+  }
+  try {
+    await testProgram.run({ input: bufIn, output: bufOut }, 0, { globalWorkItems: new Uint32Array([ 64, 64 ]) });
+    t.fail('globalWorkItems with the wrong dimensions should give error');
+  } catch (err) {
+    t.pass(`globalWorkItems with the wrong dimensions produces ${err}`);
+  }
+  try {
+    testProgram.run({ input: bufIn, output: bufOut }, 0, { globalWorkItems: stripeItems + 1 });
+    t.fail('globalWorkItems that are not a multiple of workItemsPerGroup should give error');
+  } catch (err) {
+    t.ok(err instanceof RangeError, `globalWorkItems that are not a multiple of workItemsPerGroup produces ${err}`);
+  }
+});
+
+const tuneDir = fs.mkdtempSync(path.join(os.tmpdir(), 'nodencl-'));
+createContext('Autotune the work group size of an OpenCL program', async (t, clContext) => {
+  const srcBuf = Buffer.alloc(numBytes);
+  for (let i=0; i<numBytes; i+=4)
+    srcBuf.writeUInt32LE((i/4)&0xff, i);
+  const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none');
+  await bufIn.hostAccess('writeonly', srcBuf);
+  const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'none');
+
+  const testProgram = await createProgram(clContext, stripeKernel);
+  const tuned = await testProgram.autotune({ input: bufIn, output: bufOut }, 0, { iterations: 2 });
+  t.notOk(tuned.fromCache, 'first autotune times the candidates');
+  t.ok(tuned.timings.length > 1, 'more than one candidate was timed');
+  t.ok(tuned.timings.some(c => c.time !== null), 'at least one candidate ran');
+  t.ok(fs.readdirSync(tuneDir).some(f => f.endsWith('.tune')), 'autotune choice is stored');
+
+  await testProgram.run({ input: bufIn, output: bufOut });
+  await bufOut.hostAccess('readonly');
+  t.deepEqual(bufOut, srcBuf, 'program produced expected result with the tuned size');
+
+  const secondProgram = await createProgram(clContext, stripeKernel);
+  const stored = await secondProgram.autotune({ input: bufIn, output: bufOut });
+  t.ok(stored.fromCache, 'second autotune uses the stored choice');
+  t.deepEqual(stored.workItemsPerGroup, tuned.workItemsPerGroup, 'stored choice matches');
+  fs.rmSync(tuneDir, { recursive: true, force: true });
+}, Object.assign({ cacheDir: tuneDir }, properties));
+
 createContext('Run OpenCL program with missing parameter', async (t, clContext) => {
   const testProgram = await createProgram(clContext, testKernel);
   const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none');
@@ -127,3 +235,226 @@ createContext('Run OpenCL program with extra parameter', async (t, clContext) =>
   }
 });
 
+
+createContext('Run prepared OpenCL program', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, testKernel);
+  const srcBuf = Buffer.alloc(numBytes);
+  for (let i=0; i<numBytes; i+=4)
+    srcBuf.writeUInt32LE((i/4)&0xff, i);
+
+  const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none');
+  await bufIn.hostAccess('writeonly', srcBuf);
+  const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'none');
+
+  const prepared = testProgram.prepare({ input: bufIn, output: bufOut });
+  await prepared.run();
+  await bufOut.hostAccess('readonly');
+  t.deepEqual(bufOut, srcBuf, 'prepared program produced expected result');
+
+  const bufOut2 = await clContext.createBuffer(numBytes, 'writeonly', 'none');
+  await prepared.run({ output: bufOut2 });
+  await bufOut2.hostAccess('readonly');
+  t.deepEqual(bufOut2, srcBuf, 'prepared program with changed parameter produced expected result');
+});
+
+createContext('Run OpenCL program with profiling', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, testKernel);
+  const srcBuf = Buffer.alloc(numBytes);
+  for (let i=0; i<numBytes; i+=4)
+    srcBuf.writeUInt32LE((i/4)&0xff, i);
+
+  const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none');
+  await bufIn.hostAccess('writeonly', clContext.queue.load, srcBuf);
+  const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'none');
+
+  const timings = await testProgram.run({ input: bufIn, output: bufOut }, clContext.queue.process);
+  t.ok(Array.isArray(timings.profile), 'run timings include a profile');
+  const kernel = timings.profile.find(p => p.name === 'kernel');
+  t.ok(kernel, 'profile includes the kernel');
+  t.equal(typeof kernel.start, 'bigint', 'profile timestamps are BigInt values');
+  t.ok(kernel.queued <= kernel.submit && kernel.submit <= kernel.start && kernel.start <= kernel.end,
+    'profile timestamps are in order');
+  t.ok(timings.profile.some(p => p.name === 'unmap'), 'profile includes the unmap of the input buffer');
+
+  const access = await bufOut.hostAccess('readonly', clContext.queue.unload);
+  t.ok(access.profile.some(p => p.name === 'map'), 'hostAccess profile includes the map of the output buffer');
+  t.deepEqual(bufOut, srcBuf, 'program produced expected result');
+}, Object.assign({ overlapping: true, profiling: true }, properties));
+
+createContext('Run OpenCL program with event dependencies between queues', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, testKernel);
+  const srcBuf = Buffer.alloc(numBytes);
+  for (let i=0; i<numBytes; i+=4)
+    srcBuf.writeUInt32LE((i/4)&0xff, i);
+
+  const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none');
+  await bufIn.hostAccess('writeonly', clContext.queue.load, srcBuf);
+  const loaded = await bufIn.hostAccess('none', clContext.queue.load);
+  t.ok(loaded.event, 'hostAccess returns an event when overlapping');
+  const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'none');
+
+  const timings = await testProgram.run({ input: bufIn, output: bufOut }, clContext.queue.process, { waitFor: loaded.event });
+  t.ok(timings.event, 'run returns an event when overlapping');
+  await bufOut.hostAccess('readonly', clContext.queue.unload, { waitFor: [ timings.event ] });
+  await clContext.waitFinish(clContext.queue.unload);
+  t.deepEqual(bufOut, srcBuf, 'program produced expected result');
+
+  try {
+    await testProgram.run({ input: bufIn, output: bufOut }, clContext.queue.process, { waitFor: 'not an event' });
+    t.fail('invalid waitFor should give error');
+  } catch (err) {
+    t.pass(`invalid waitFor produces ${err}`);
+  }
+}, Object.assign({ overlapping: true }, properties));
+
+createContext('Run OpenCL program concurrently on every queue', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, testKernel);
+  const queues = [ clContext.queue.load, clContext.queue.process, clContext.queue.unload ];
+  const runs = await Promise.all(queues.map(async (q, i) => {
+    const srcBuf = Buffer.alloc(numBytes, i + 1);
+    const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'coarse');
+    await bufIn.hostAccess('writeonly', q, srcBuf);
+    await bufIn.hostAccess('none', q);
+    const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'coarse');
+    return { q: q, srcBuf: srcBuf, bufIn: bufIn, bufOut: bufOut };
+  }));
+  await Promise.all(runs.map(r => clContext.waitFinish(r.q)));
+
+  await Promise.all(runs.map(r => testProgram.run({ input: r.bufIn, output: r.bufOut }, r.q)));
+  for (const r of runs) {
+    await clContext.waitFinish(r.q);
+    await r.bufOut.hostAccess('readonly', r.q);
+    await clContext.waitFinish(r.q);
+    t.deepEqual(r.bufOut, r.srcBuf, `run on queue ${r.q} used its own arguments`);
+  }
+}, Object.assign({ overlapping: true }, properties));
+
+createContext('Run OpenCL program with submission threads', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, testKernel);
+  const srcBuf = Buffer.alloc(numBytes);
+  for (let i=0; i<numBytes; i+=4)
+    srcBuf.writeUInt32LE((i/4)&0xff, i);
+
+  const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none');
+  const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'none');
+  for (let i=0; i<4; ++i) {
+    await bufIn.hostAccess('writeonly', srcBuf);
+    await testProgram.run({ input: bufIn, output: bufOut });
+    await bufOut.hostAccess('readonly');
+    t.deepEqual(bufOut, srcBuf, `program run ${i} produced expected result`);
+  }
+}, Object.assign({ submitThreads: true }, properties));
+
+createContext('Run OpenCL program with event completion', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, testKernel);
+  const srcBuf = Buffer.alloc(numBytes);
+  for (let i=0; i<numBytes; i+=4)
+    srcBuf.writeUInt32LE((i/4)&0xff, i);
+
+  const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none');
+  await bufIn.hostAccess('writeonly', srcBuf);
+  const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'none');
+
+  const timings = await testProgram.run({ input: bufIn, output: bufOut });
+  t.ok(timings.event, 'run with event completion returns an event');
+  await clContext.waitFinish();
+  await bufOut.hostAccess('readonly');
+  t.deepEqual(bufOut, srcBuf, 'program produced expected result');
+}, Object.assign({ eventCompletion: true }, properties));
+
+createContext('Run OpenCL program as a batch', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, testKernel);
+  const srcBufs = [];
+  const bufIns = [];
+  const bufOuts = [];
+  for (let b=0; b<3; ++b) {
+    const srcBuf = Buffer.alloc(numBytes);
+    for (let i=0; i<numBytes; i+=4)
+      srcBuf.writeUInt32LE(((i/4)+b)&0xff, i);
+    const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none');
+    await bufIn.hostAccess('writeonly', srcBuf);
+    srcBufs.push(srcBuf);
+    bufIns.push(bufIn);
+    bufOuts.push(await clContext.createBuffer(numBytes, 'writeonly', 'none'));
+  }
+
+  const timings = await testProgram.runBatch(bufIns.map((bufIn, b) => ({ input: bufIn, output: bufOuts[b] })));
+  t.equal(timings.runs.length, 3, 'batch returns timings for each run');
+  for (let b=0; b<3; ++b) {
+    await bufOuts[b].hostAccess('readonly');
+    t.deepEqual(bufOuts[b], srcBufs[b], `batch run ${b} produced expected result`);
+  }
+
+  try {
+    await testProgram.runBatch([]);
+    t.fail('empty batch should give error');
+  } catch (err) {
+    t.pass(`empty batch produces ${err}`);
+  }
+});
+
+createContext('Run OpenCL program synchronously when the work is small', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, testKernel);
+  const srcBuf = Buffer.alloc(numBytes);
+  for (let i=0; i<numBytes; i+=4)
+    srcBuf.writeUInt32LE((i/4)&0xff, i);
+  const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none');
+  const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'none');
+
+  const loaded = bufIn.hostAccessSync('writeonly', 0, srcBuf);
+  t.notOk(loaded instanceof Promise, 'small host access on an idle queue is synchronous');
+  const timings = testProgram.runSync({ input: bufIn, output: bufOut }, 0);
+  t.notOk(timings instanceof Promise, 'small run on an idle queue is synchronous');
+  t.equal(typeof timings.totalTime, 'number', 'synchronous run returns timings');
+  bufOut.hostAccessSync('readonly', 0);
+  t.deepEqual(bufOut, srcBuf, 'synchronous run produced expected result');
+
+  const queued = testProgram.runSync({ input: bufIn, output: bufOut }, 0, { syncWorkItems: 1 });
+  t.ok(queued instanceof Promise, 'run larger than the limit is queued');
+  await queued;
+  await bufOut.hostAccess('readonly');
+  t.deepEqual(bufOut, srcBuf, 'queued run produced expected result');
+});
+
+createContext('Run OpenCL program synchronously with several queues and event completion', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, testKernel);
+  const srcBuf = Buffer.alloc(numBytes);
+  for (let i=0; i<numBytes; i+=4)
+    srcBuf.writeUInt32LE((i/4)&0xff, i);
+  const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none');
+  await bufIn.hostAccess('writeonly', clContext.queue.load, srcBuf);
+  await bufIn.hostAccess('none', clContext.queue.load);
+  await clContext.waitFinish(clContext.queue.load);
+  const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'none');
+
+  const timings = testProgram.runSync({ input: bufIn, output: bufOut }, clContext.queue.process);
+  t.notOk(timings instanceof Promise, 'small run on an idle queue is synchronous');
+  t.ok(timings.event, 'synchronous run returns its completion event');
+  await bufOut.hostAccess('readonly', clContext.queue.unload);
+  await clContext.waitFinish(clContext.queue.unload);
+  t.deepEqual(bufOut, srcBuf, 'synchronous run had completed when it returned');
+}, Object.assign({ overlapping: true, eventCompletion: true }, properties));
+
+const longKernel = `
+  __kernel void spin(__global uint* restrict output, uint iterations) {
+    uint acc = get_global_id(0);
+    for (uint i=0; i<iterations; ++i)
+      acc = acc * 1664525u + 1013904223u;
+    output[get_global_id(0)] = acc;
+  }
+`;
+
+createContext('Run OpenCL program synchronously on a queue that the device is still busy with', async (t, clContext) => {
+  const longProgram = await clContext.createProgram(longKernel, { name: 'spin', globalWorkItems: 1024 });
+  const longOut = await clContext.createBuffer(1024 * 4, 'writeonly', 'none');
+  const testProgram = await createProgram(clContext, testKernel);
+  const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none');
+  const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'none');
+
+  // with several queues the run resolves once enqueued, while the device is still running it
+  await longProgram.run({ output: longOut, iterations: 1 << 22 }, clContext.queue.process);
+  const queued = testProgram.runSync({ input: bufIn, output: bufOut }, clContext.queue.process);
+  t.ok(queued instanceof Promise, 'run on a queue with device work still pending is queued');
+  await queued;
+  await clContext.waitFinish(clContext.queue.process);
+}, Object.assign({ overlapping: true }, properties));
@@ -105,3 +105,70 @@ for (let d=0; d<bufDirs.length; ++d) {
     });
   });
 }
+
+createContext('Run OpenCL program with half float image parameters', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, testKernel);
+  const halfBytes = width * height * 4 * 2; // rgba-f16
+  const imageDims = { width: width, height: height, channelType: 'HALF_FLOAT' };
+  const srcBuf = Buffer.alloc(halfBytes);
+  for (let i=0; i<halfBytes; i+=2)
+    srcBuf.writeUInt16LE(0x3c00 - (i % 1024), i); // halves just below 1.0 survive the round trip exactly
+
+  const bufIn = await clContext.createBuffer(halfBytes, 'readonly', 'none', imageDims);
+  await bufIn.hostAccess('writeonly', srcBuf);
+  const bufOut = await clContext.createBuffer(halfBytes, 'writeonly', 'none', imageDims);
+
+  await testProgram.run({ input: bufIn, output: bufOut });
+  await bufOut.hostAccess('readonly');
+  t.deepEqual(bufOut, srcBuf, 'program produced expected result');
+});
+
+createContext('Create image buffer with an unknown channel type', async (t, clContext) => {
+  try {
+    await clContext.createBuffer(numBytes, 'readonly', 'none', { width: width, height: height, channelType: 'FLOAT64' });
+    t.fail('unknown channel type should give error');
+  } catch (err) {
+    t.pass(`unknown channel type produces ${err}`);
+  }
+});
+
+createContext('Run OpenCL program with image rows that are not pitch aligned', async (t, clContext) => {
+  const oddWidth = width - 8;
+  const oddBytes = oddWidth * height * 4 * 4;
+  const imageDims = { width: oddWidth, height: height };
+  const testProgram = await clContext.createProgram(testKernel, {
+    name: 'test',
+    globalWorkItems: Uint32Array.from([ oddWidth, height ])
+  });
+  const srcBuf = Buffer.alloc(oddBytes);
+  for (let i=0; i<oddBytes; i+=4)
+    srcBuf.writeFloatLE(i/oddBytes, i);
+
+  const bufIn = await clContext.createBuffer(oddBytes, 'readonly', 'none', imageDims);
+  await bufIn.hostAccess('writeonly', srcBuf);
+  const bufOut = await clContext.createBuffer(oddBytes, 'writeonly', 'none', imageDims);
+
+  await testProgram.run({ input: bufIn, output: bufOut });
+  await bufOut.hostAccess('readonly');
+  t.deepEqual(bufOut, srcBuf, 'program produced expected result');
+});
+
+createContext('Request host access to a rectangle of an image buffer', async (t, clContext) => {
+  const testProgram = await createProgram(clContext, testKernel);
+  const imageDims = { width: width, height: height };
+  const srcBuf = Buffer.alloc(numBytes);
+  for (let i=0; i<numBytes; i+=4)
+    srcBuf.writeFloatLE(i/numBytes, i);
+
+  const bufIn = await clContext.createBuffer(numBytes, 'readonly', 'none', imageDims);
+  await bufIn.hostAccess('writeonly', srcBuf);
+  const bufOut = await clContext.createBuffer(numBytes, 'writeonly', 'none', imageDims);
+
+  await testProgram.run({ input: bufIn, output: bufOut });
+  const rowBytes = width * 4 * 4;
+  await bufOut.hostAccess('readonly', { origin: [ 16, 10 ], region: [ 32, 2 ] });
+  t.deepEqual(bufOut.slice(10 * rowBytes + 16 * 16, 10 * rowBytes + 48 * 16),
+    srcBuf.slice(10 * rowBytes + 16 * 16, 10 * rowBytes + 48 * 16), 'first row of rectangle contains expected data');
+  t.deepEqual(bufOut.slice(11 * rowBytes + 16 * 16, 11 * rowBytes + 48 * 16),
+    srcBuf.slice(11 * rowBytes + 16 * 16, 11 * rowBytes + 48 * 16), 'second row of rectangle contains expected data');
+});